@@ -1,6 +1,8 @@
 //#define USE_SERVER
 
 #include <iostream>
+#include <new>
+#include <cstdlib>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #ifdef USE_SERVER
@@ -17,13 +19,52 @@ using namespace Passenger;
 
 #define TRANSACTIONS 20000
 #define CONCURRENCY 24
+#define WARMUP_TRANSACTIONS 100
 
 ApplicationPoolPtr pool;
 
+/* Count heap allocations, so that we can see how many allocations
+ * the request path makes. */
+static volatile long allocations = 0;
+
+void *
+operator new(size_t size) throw(std::bad_alloc) {
+	__sync_fetch_and_add(&allocations, 1);
+	void *p = malloc(size == 0 ? 1 : size);
+	if (p == NULL) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void *
+operator new[](size_t size) throw(std::bad_alloc) {
+	return operator new(size);
+}
+
+void
+operator delete(void *p) throw() {
+	free(p);
+}
+
+void
+operator delete[](void *p) throw() {
+	operator delete(p);
+}
+
+static long
+countAllocations(const PoolOptions &options, unsigned int times) {
+	long before = __sync_fetch_and_add(&allocations, 0);
+	for (unsigned int i = 0; i < times; i++) {
+		Application::SessionPtr session(pool->get(options));
+	}
+	return __sync_fetch_and_add(&allocations, 0) - before;
+}
+
 static void
-threadMain(unsigned int times) {
+threadMain(const PoolOptions &options, unsigned int times) {
 	for (unsigned int i = 0; i < times; i++) {
-		Application::SessionPtr session(pool->get("test/stub/minimal-railsapp"));
+		Application::SessionPtr session(pool->get(options));
 		for (int x = 0; x < 200000; x++) {
 			// Do nothing.
 		}
@@ -42,8 +83,19 @@ main() {
 	#endif
 	pool->setMax(6);
 	
+	// Build the options once, so that only the pool's own
+	// allocations are counted.
+	PoolOptions options("test/stub/minimal-railsapp");
+	
+	// Let the pool spawn the application and fill its free lists.
+	countAllocations(options, WARMUP_TRANSACTIONS);
+	long n = countAllocations(options, TRANSACTIONS);
+	cout << "Heap allocations per request: " <<
+		(double) n / TRANSACTIONS << endl;
+	
 	for (int i = 0; i < CONCURRENCY; i++) {
-		tg.create_thread(boost::bind(&threadMain, TRANSACTIONS / CONCURRENCY));
+		tg.create_thread(boost::bind(&threadMain, boost::cref(options),
+			TRANSACTIONS / CONCURRENCY));
 	}
 	
 	tg.join_all();
@@ -0,0 +1,121 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "MessageChannel.h"
+#include "BufferedMessageChannel.h"
+
+using namespace std;
+using namespace Passenger;
+
+#define ROUND_TRIPS 100000
+#define WARMUP_ROUND_TRIPS 1000
+#define PIPELINE_DEPTH 16
+
+/* Compares the cost of a request/reply round trip between MessageChannel
+ * and BufferedMessageChannel. The messages resemble the ones that are sent
+ * to the ApplicationPool server: a 'get' request with a serialized option
+ * set, and a short reply. Round trips are measured one at a time, and
+ * pipelined, in which case several requests are written before the replies
+ * are read, so that a buffered reader can pick up several messages per
+ * read. */
+
+static vector<string>
+createRequest() {
+	vector<string> args;
+	args.push_back("get");
+	args.push_back("123");
+	args.push_back("app_root");
+	args.push_back("/var/www/apps/foo/current");
+	args.push_back("lower_privilege");
+	args.push_back("true");
+	args.push_back("lowest_user");
+	args.push_back("nobody");
+	args.push_back("environment");
+	args.push_back("production");
+	args.push_back("spawn_method");
+	args.push_back("smart-lv2");
+	args.push_back("app_type");
+	args.push_back("rails");
+	args.push_back("framework_spawner_timeout");
+	args.push_back("-1");
+	args.push_back("app_spawner_timeout");
+	args.push_back("-1");
+	args.push_back("max_requests");
+	args.push_back("0");
+	return args;
+}
+
+template<typename Channel>
+static void
+serve(int fd) {
+	Channel channel(fd);
+	vector<string> args;
+	
+	while (channel.read(args)) {
+		channel.write(args[1].c_str(), "ok", "1234", "/tmp/passenger.1234/backends/backend.abc", NULL);
+	}
+}
+
+template<typename Channel>
+static double
+benchmark(unsigned int roundTrips, unsigned int depth) {
+	int fds[2];
+	pid_t pid;
+	
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		throw SystemException("Cannot create a socket pair", errno);
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		serve<Channel>(fds[1]);
+		_exit(0);
+	}
+	close(fds[1]);
+	
+	Channel channel(fds[0]);
+	vector<string> request(createRequest());
+	vector<string> reply;
+	struct timeval begin, end;
+	double usecs;
+	
+	gettimeofday(&begin, NULL);
+	for (unsigned int i = 0; i < roundTrips; i += depth) {
+		for (unsigned int j = 0; j < depth; j++) {
+			channel.write(request);
+		}
+		for (unsigned int j = 0; j < depth; j++) {
+			channel.read(reply);
+		}
+	}
+	gettimeofday(&end, NULL);
+	
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+	
+	usecs = (end.tv_sec - begin.tv_sec) * 1000000.0 + (end.tv_usec - begin.tv_usec);
+	return usecs / roundTrips;
+}
+
+template<typename Channel>
+static void
+report(const char *name) {
+	cout << name << ": " <<
+		benchmark<Channel>(ROUND_TRIPS, 1) << " usec per round trip, " <<
+		benchmark<Channel>(ROUND_TRIPS, PIPELINE_DEPTH) << " usec pipelined" << endl;
+}
+
+int
+main() {
+	benchmark<MessageChannel>(WARMUP_ROUND_TRIPS, 1);
+	benchmark<BufferedMessageChannel>(WARMUP_ROUND_TRIPS, 1);
+	
+	report<MessageChannel>("MessageChannel        ");
+	report<BufferedMessageChannel>("BufferedMessageChannel");
+	return 0;
+}
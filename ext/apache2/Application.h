@@ -101,12 +101,17 @@ public:
 		 * @param headers The HTTP request headers, converted into CGI headers and encoded as
 		 *                a string, according to the description.
 		 * @param size The size, in bytes, of <tt>headers</tt>.
+		 * @param timeout A pointer to the maximum number of microseconds that
+		 *                sending the headers may take, or NULL if there's no
+		 *                limit. The time spent is deducted from <tt>*timeout</tt>.
 		 * @pre headers != NULL
 		 * @throws IOException The writer channel has already been closed.
+		 * @throws TimeoutException The headers could not be sent within the timeout.
 		 * @throws SystemException Something went wrong during writing.
 		 * @throws boost::thread_interrupted
 		 */
-		virtual void sendHeaders(const char *headers, unsigned int size) {
+		virtual void sendHeaders(const char *headers, unsigned int size,
+		                         unsigned long long *timeout = NULL) {
 			TRACE_POINT();
 			int stream = getStream();
 			if (stream == -1) {
@@ -114,7 +119,7 @@ public:
 					"because the writer stream has already been closed.");
 			}
 			try {
-				MessageChannel(stream).writeScalar(headers, size);
+				MessageChannel(stream).writeScalar(headers, size, timeout);
 			} catch (SystemException &e) {
 				e.setBriefMessage("An error occured while writing headers "
 					"to the request handler");
@@ -123,14 +128,16 @@ public:
 		}
 		
 		/**
-		 * Convenience shortcut for sendHeaders(const char *, unsigned int)
+		 * Convenience shortcut for sendHeaders(const char *, unsigned int, unsigned long long *)
 		 * @param headers
+		 * @param timeout
 		 * @throws IOException The writer channel has already been closed.
+		 * @throws TimeoutException The headers could not be sent within the timeout.
 		 * @throws SystemException Something went wrong during writing.
 		 * @throws boost::thread_interrupted
 		 */
-		virtual void sendHeaders(const string &headers) {
-			sendHeaders(headers.c_str(), headers.size());
+		virtual void sendHeaders(const string &headers, unsigned long long *timeout = NULL) {
+			sendHeaders(headers.c_str(), headers.size(), timeout);
 		}
 		
 		/**
@@ -143,11 +150,16 @@ public:
 		 *
 		 * @param block A block of HTTP request body data to send.
 		 * @param size The size, in bytes, of <tt>block</tt>.
+		 * @param timeout A pointer to the maximum number of microseconds that
+		 *                sending the block may take, or NULL if there's no
+		 *                limit. The time spent is deducted from <tt>*timeout</tt>.
 		 * @throws IOException The writer channel has already been closed.
+		 * @throws TimeoutException The block could not be sent within the timeout.
 		 * @throws SystemException Something went wrong during writing.
 		 * @throws boost::thread_interrupted
 		 */
-		virtual void sendBodyBlock(const char *block, unsigned int size) {
+		virtual void sendBodyBlock(const char *block, unsigned int size,
+		                           unsigned long long *timeout = NULL) {
 			TRACE_POINT();
 			int stream = getStream();
 			if (stream == -1) {
@@ -156,7 +168,7 @@ public:
 					"already been closed.");
 			}
 			try {
-				MessageChannel(stream).writeRaw(block, size);
+				MessageChannel(stream).writeRaw(block, size, timeout);
 			} catch (SystemException &e) {
 				e.setBriefMessage("An error occured while sending the "
 					"request body to the request handler");
@@ -178,6 +190,9 @@ public:
 		 * If no data can be read within the timeout period, then the
 		 * read call will fail with error EAGAIN or EWOULDBLOCK.
 		 *
+		 * This timeout applies to each read system call separately, so a
+		 * slow application can still keep a read going for much longer.
+		 *
 		 * @param msec The timeout, in milliseconds. If 0 is given,
 		 *             there will be no timeout.
 		 * @throws SystemException Cannot set the timeout.
@@ -189,6 +204,10 @@ public:
 		 * If no data can be written within the timeout period, then the
 		 * write call will fail with error EAGAIN or EWOULDBLOCK.
 		 *
+		 * This timeout applies to each write system call separately. Pass
+		 * a timeout to sendHeaders() or sendBodyBlock() to limit the
+		 * duration of an entire write operation.
+		 *
 		 * @param msec The timeout, in milliseconds. If 0 is given,
 		 *             there will be no timeout.
 		 * @throws SystemException Cannot set the timeout.
@@ -233,7 +252,6 @@ public:
 		virtual pid_t getPid() const = 0;
 	};
 
-private:
 	/**
 	 * A "standard" implementation of Session.
 	 */
@@ -255,7 +273,9 @@ private:
 		virtual ~StandardSession() {
 			TRACE_POINT();
 			closeStream();
-			closeCallback();
+			if (closeCallback) {
+				closeCallback();
+			}
 		}
 		
 		virtual int getStream() const {
@@ -313,6 +333,7 @@ private:
 		}
 	};
 
+private:
 	string appRoot;
 	pid_t pid;
 	string listenSocketName;
@@ -424,6 +445,20 @@ public:
 	 * @throws IOException Something went wrong during the connection process.
 	 */
 	SessionPtr connect(const function<void()> &closeCallback) const {
+		int fd = openConnection();
+		return ptr(new StandardSession(pid, closeCallback, fd));
+	}
+	
+	/**
+	 * Connect to this application instance, and return the file descriptor
+	 * of the connection. This is what connect() uses under the hood; use it
+	 * if you want to manage the Session object yourself. The caller is
+	 * responsible for closing the file descriptor.
+	 *
+	 * @throws SystemException Something went wrong during the connection process.
+	 * @throws IOException Something went wrong during the connection process.
+	 */
+	int openConnection() const {
 		if (listenSocketType != "unix") {
 			throw "TODO: implement support for socket types other than 'unix'";
 		}
@@ -456,7 +491,7 @@ public:
 			throw SystemException(message, e);
 		}
 		
-		return ptr(new StandardSession(pid, closeCallback, fd));
+		return fd;
 	}
 };
 
@@ -21,7 +21,9 @@
 #define _PASSENGER_APPLICATION_POOL_SERVER_H_
 
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
 #include <oxt/system_calls.hpp>
 #include <oxt/backtrace.hpp>
 
@@ -29,15 +31,23 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <limits.h>
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
 
 #include "MessageChannel.h"
+#include "BufferedMessageChannel.h"
 #include "ApplicationPool.h"
+#include "PoolStatistics.h"
 #include "Application.h"
 #include "Exceptions.h"
 #include "Logging.h"
@@ -126,10 +136,72 @@ using namespace oxt;
  * server through that socket. The server will then create a new socket pair, and pass one of
  * them back. This new socket pair represents the newly established connection.
  *
+ * <h3>Registered option sets</h3>
+ * A web server process usually sends the same PoolOptions over and over again, e.g.
+ * one set per virtual host. So instead of sending the serialized options along with
+ * every 'get' request, the client registers each option set once per connection, and
+ * the server replies with an ID for it. Subsequent 'get' requests for that option set
+ * are sent as a small binary frame which only contains the request ID and the option
+ * set ID. The frame is framed like an array message (a size header followed by the
+ * body) so that it doesn't confuse array message readers, but its body starts with
+ * REGISTERED_GET_MARKER, which no message name starts with.
+ *
+ * <h3>Frame format</h3>
+ * Right after connecting, the client negotiates MessageChannel::LATEST_FRAME_VERSION
+ * with the server, so that array messages, such as batched closes, aren't limited
+ * to 64 KB.
+ *
+ * <h3>Batched session closes</h3>
+ * When a session is closed, the client has to tell the server, so that the server can
+ * release the application instance. Only one thread at a time writes to a connection.
+ * Sessions that are closed while another thread is writing are queued, and sent by
+ * the writing thread: either appended to the next registered 'get' frame, as 32-bit
+ * session IDs after the option set ID, or otherwise as a single 'close' message with
+ * multiple session IDs. Closes are never held back until some later request, because
+ * the application instances would stay busy in the mean time. The server releases all
+ * sessions that are closed by a batch of messages with a single pool lock acquisition.
+ *
  * @ingroup Support
  */
 class ApplicationPoolServer {
 private:
+	/**
+	 * The maximum number of option sets that a client may register on a
+	 * single connection. Must be the same as in the server executable.
+	 */
+	static const unsigned int MAX_REGISTERED_OPTIONS = 1024;
+	
+	/**
+	 * The first byte of the body of a registered 'get' frame. Must be the
+	 * same as in the server executable.
+	 */
+	static const char REGISTERED_GET_MARKER = '\x01';
+	
+	/**
+	 * The maximum number of session IDs in a single 'close' message or
+	 * registered 'get' frame.
+	 */
+	static const unsigned int MAX_BATCHED_CLOSES = 1000;
+	
+	/**
+	 * A reply from the ApplicationPool server, to a request that expects
+	 * one.
+	 */
+	struct Reply {
+		/** The reply message, without the request ID. */
+		vector<string> args;
+		
+		/** The file descriptor that was passed along with the reply, or -1. */
+		int fd;
+		
+		/** The error page that was sent along with the reply, if any. */
+		string errorPage;
+		
+		Reply() {
+			fd = -1;
+		}
+	};
+	
 	/**
 	 * Contains data shared between RemoteSession and Client.
 	 * Since RemoteSession and Client have different life times, i.e. one may be
@@ -144,15 +216,280 @@ private:
 		 */
 		int server;
 		
+		/**
+		 * The channel through which replies are read from <tt>server</tt>.
+		 * It buffers what it reads, so it's kept around across replies, and
+		 * it may only be used by the thread that has set <tt>reading</tt>.
+		 */
+		BufferedMessageChannel replyChannel;
+		
+		/**
+		 * The frame format that has been negotiated with the server. Only
+		 * set upon construction of the Client.
+		 */
+		unsigned int frameVersion;
+		
+		/** Protects everything below. */
 		boost::mutex lock;
 		
+		/**
+		 * Whether a thread is currently writing to the server. Only one
+		 * thread may do so at a time, so that messages from different
+		 * threads don't get mixed up.
+		 */
+		bool writing;
+		
+		/** The number of threads that are waiting for <tt>writing</tt> to become false. */
+		unsigned int waitingWriters;
+		
+		/** Notified when <tt>writing</tt> has become false. */
+		condition writerDone;
+		
+		/** The IDs of closed sessions that haven't been reported to the server yet. */
+		vector<int> pendingCloses;
+		
+		/**
+		 * Notified when a reply has been read from the server, or when
+		 * reading failed.
+		 */
+		condition replyAvailable;
+		
+		/** The request ID that will be sent along with the next request. */
+		unsigned int nextRequestID;
+		
+		/** Whether a thread is currently reading a reply from the server. */
+		bool reading;
+		
+		/**
+		 * Replies that have been read from the server, but that haven't
+		 * been picked up yet by the threads that sent the requests.
+		 * Indexed by request ID.
+		 */
+		map<unsigned int, Reply> replies;
+		
+		/**
+		 * If not empty, then reading from the server has failed, and this
+		 * describes why.
+		 */
+		string error;
+		
+		/**
+		 * The number of messages that might have changed the pool's state,
+		 * that have been sent or queued for sending.
+		 */
+		unsigned long long stateChanges;
+		
+		/**
+		 * The number of such messages that the server has certainly
+		 * processed. While this is less than <tt>stateChanges</tt>, the
+		 * published statistics might not reflect all messages yet.
+		 */
+		unsigned long long syncedStateChanges;
+		
+		/**
+		 * The IDs of the option sets that have been registered with the
+		 * server, indexed by the option set.
+		 */
+		map<PoolOptions, unsigned int> registeredOptions;
+		
+		/**
+		 * The number of option set registrations that have been sent,
+		 * including ones that are still waiting for a reply.
+		 */
+		unsigned int registrations;
+		
+		/**
+		 * The option sets whose registrations are still waiting for a reply.
+		 */
+		set<PoolOptions> pendingRegistrations;
+		
+		SharedData(int server)
+			: server(server),
+			  replyChannel(server) {
+			frameVersion = MessageChannel::FRAME_VERSION_1;
+			nextRequestID = 0;
+			reading = false;
+			stateChanges = 0;
+			syncedStateChanges = 0;
+			registrations = 0;
+			writing = false;
+			waitingWriters = 0;
+		}
+		
 		~SharedData() {
 			TRACE_POINT();
+			map<unsigned int, Reply>::iterator it;
 			int ret;
+			
+			for (it = replies.begin(); it != replies.end(); it++) {
+				if (it->second.fd != -1) {
+					do {
+						ret = close(it->second.fd);
+					} while (ret == -1 && errno == EINTR);
+				}
+			}
 			do {
 				ret = close(server);
 			} while (ret == -1 && errno == EINTR);
 		}
+		
+		/**
+		 * Send an array message to the server, along with any pending closes.
+		 *
+		 * @param l A lock on <tt>lock</tt>. It's released while writing.
+		 * @param message The encoded message.
+		 * @param changesState Whether the message might change the pool's state.
+		 * @return The value of <tt>stateChanges</tt> right after the
+		 *         message was queued for writing.
+		 * @throws SystemException
+		 * @throws boost::thread_interrupted
+		 */
+		unsigned long long send(boost::mutex::scoped_lock &l, const string &message,
+		                        bool changesState) {
+			string buffer;
+			unsigned long long changes;
+			
+			waitForTurn(l);
+			appendCloses(buffer);
+			buffer.append(message);
+			if (changesState) {
+				stateChanges++;
+			}
+			changes = stateChanges;
+			writeBuffer(l, buffer);
+			return changes;
+		}
+		
+		/**
+		 * Send a registered 'get' frame to the server, with pending closes
+		 * appended to it.
+		 *
+		 * @param l A lock on <tt>lock</tt>. It's released while writing.
+		 * @return The value of <tt>stateChanges</tt> right after the
+		 *         frame was queued for writing.
+		 * @throws SystemException
+		 * @throws boost::thread_interrupted
+		 */
+		unsigned long long sendRegisteredGet(boost::mutex::scoped_lock &l, uint32_t requestID,
+		                                     uint32_t optionsID) {
+			string buffer;
+			unsigned long long changes;
+			
+			waitForTurn(l);
+			if (pendingCloses.size() > MAX_BATCHED_CLOSES) {
+				appendCloses(buffer);
+			}
+			
+			unsigned int size = 1 + 4 + 4 + 4 * pendingCloses.size();
+			vector<int>::const_iterator it;
+			
+			buffer.reserve(buffer.size() + MessageChannel::frameHeaderSize(frameVersion) + size);
+			MessageChannel::appendFrameHeader(buffer, size, frameVersion);
+			buffer.append(1, REGISTERED_GET_MARKER);
+			appendInteger(buffer, requestID);
+			appendInteger(buffer, optionsID);
+			for (it = pendingCloses.begin(); it != pendingCloses.end(); it++) {
+				appendInteger(buffer, *it);
+			}
+			pendingCloses.clear();
+			changes = stateChanges;
+			writeBuffer(l, buffer);
+			return changes;
+		}
+		
+		/**
+		 * Report that the session with the given ID has been closed. If
+		 * another thread is writing, or about to write, then that thread
+		 * will report it instead.
+		 *
+		 * @param l A lock on <tt>lock</tt>. It's released while writing.
+		 * @throws SystemException
+		 * @throws boost::thread_interrupted
+		 */
+		void sendClose(boost::mutex::scoped_lock &l, int sessionID) {
+			pendingCloses.push_back(sessionID);
+			stateChanges++;
+			if (!writing && waitingWriters == 0) {
+				string buffer;
+				
+				writing = true;
+				appendCloses(buffer);
+				writeBuffer(l, buffer);
+			}
+		}
+		
+	private:
+		static void appendInteger(string &buffer, uint32_t value) {
+			value = htonl(value);
+			buffer.append((const char *) &value, sizeof(value));
+		}
+		
+		/**
+		 * Wait until no other thread is writing, then mark the current
+		 * thread as the writer.
+		 */
+		void waitForTurn(boost::mutex::scoped_lock &l) {
+			waitingWriters++;
+			try {
+				while (writing) {
+					writerDone.wait(l);
+				}
+			} catch (...) {
+				waitingWriters--;
+				throw;
+			}
+			waitingWriters--;
+			writing = true;
+		}
+		
+		/**
+		 * Append 'close' messages for all pending closes to the buffer.
+		 */
+		void appendCloses(string &buffer) {
+			vector<int>::const_iterator it = pendingCloses.begin();
+			
+			while (it != pendingCloses.end()) {
+				vector<string> args;
+				
+				args.push_back("close");
+				while (it != pendingCloses.end() && args.size() <= MAX_BATCHED_CLOSES) {
+					args.push_back(toString(*it));
+					it++;
+				}
+				MessageChannel::appendArrayMessage(buffer, args, frameVersion);
+			}
+			pendingCloses.clear();
+		}
+		
+		/**
+		 * Write the buffer to the server, followed by the closes that are
+		 * reported in the mean time, unless another thread is about to
+		 * write and can take them along.
+		 *
+		 * @pre The current thread is the writer.
+		 * @post The current thread is no longer the writer.
+		 */
+		void writeBuffer(boost::mutex::scoped_lock &l, string &buffer) {
+			while (true) {
+				l.unlock();
+				try {
+					MessageChannel(server).writeRaw(buffer);
+				} catch (...) {
+					l.lock();
+					writing = false;
+					writerDone.notify_all();
+					throw;
+				}
+				l.lock();
+				if (pendingCloses.empty() || waitingWriters > 0) {
+					break;
+				}
+				buffer.clear();
+				appendCloses(buffer);
+			}
+			writing = false;
+			writerDone.notify_all();
+		}
 	};
 	
 	typedef shared_ptr<SharedData> SharedDataPtr;
@@ -175,9 +512,17 @@ private:
 		}
 		
 		virtual ~RemoteSession() {
+			this_thread::disable_syscall_interruption dsi;
+			this_thread::disable_interruption di;
+			
 			closeStream();
-			boost::mutex::scoped_lock(data->lock);
-			MessageChannel(data->server).write("close", toString(id).c_str(), NULL);
+			boost::mutex::scoped_lock l(data->lock);
+			try {
+				data->sendClose(l, id);
+			} catch (const SystemException &e) {
+				P_TRACE(3, "Cannot report a closed session to the "
+					"ApplicationPool server: " << e.what());
+			}
 		}
 		
 		virtual int getStream() const {
@@ -236,6 +581,13 @@ private:
 	 * An ApplicationPool implementation that works together with ApplicationPoolServer.
 	 * It doesn't do much by itself, its job is mostly to forward queries/commands to
 	 * the server and returning the result. Most of the logic is in the server executable.
+	 *
+	 * A Client may be used by multiple threads at the same time. Requests that
+	 * expect a reply carry a request ID, which the server sends back along with
+	 * the reply, so multiple requests can be outstanding on the same connection.
+	 * There's no dedicated thread for reading replies: one of the waiting threads
+	 * reads the next reply from the server, hands it over to the thread that
+	 * sent the request, and then either returns or goes back to waiting.
 	 */
 	class Client: public ApplicationPool {
 	private:
@@ -244,134 +596,373 @@ private:
 		SharedDataPtr dataSmartPointer;
 		SharedData *data;
 		
+		/** The statistics that are published by the server, if any. */
+		PoolStatisticsPtr statistics;
+		
+		/**
+		 * Send a message that doesn't expect a reply.
+		 *
+		 * @throws IOException The ApplicationPool server has exited.
+		 */
+		void sendMessage(const vector<string> &args, bool changesState) {
+			string message;
+			
+			MessageChannel::appendArrayMessage(message, args, data->frameVersion);
+			boost::mutex::scoped_lock l(data->lock);
+			try {
+				data->send(l, message, changesState);
+			} catch (const SystemException &) {
+				throw IOException("The ApplicationPool server exited unexpectedly.");
+			}
+		}
+		
+		/**
+		 * Send a request that expects a reply. A request ID is inserted
+		 * into <tt>args</tt>, right after the message name.
+		 *
+		 * @pre <tt>l</tt> is locked.
+		 * @param changes Set to the number of state-changing messages that
+		 *                the server will have processed when it replies.
+		 * @return The request ID.
+		 * @throws IOException The ApplicationPool server has exited.
+		 */
+		unsigned int sendRequest(boost::mutex::scoped_lock &l, vector<string> &args,
+		                         unsigned long long &changes) const {
+			unsigned int id = data->nextRequestID;
+			string message;
+			
+			data->nextRequestID++;
+			args.insert(args.begin() + 1, toString(id));
+			MessageChannel::appendArrayMessage(message, args, data->frameVersion);
+			try {
+				changes = data->send(l, message, false);
+			} catch (const SystemException &) {
+				throw IOException("The ApplicationPool server exited unexpectedly.");
+			}
+			return id;
+		}
+		
+		/**
+		 * Record that the server has processed the given number of
+		 * state-changing messages.
+		 *
+		 * @pre <tt>data->lock</tt> is locked.
+		 */
+		void synced(unsigned long long changes) const {
+			// The server processes messages in order, so it had processed
+			// the messages that we sent before a request by the time it
+			// replied, and it published the statistics before replying.
+			if (changes > data->syncedStateChanges) {
+				data->syncedStateChanges = changes;
+			}
+		}
+		
+		/**
+		 * Read the next reply from the server.
+		 *
+		 * @pre <tt>data->reading</tt> has been set by the current thread.
+		 * @throws SystemException
+		 * @throws IOException
+		 */
+		void readReply(unsigned int &id, Reply &reply) const {
+			TRACE_POINT();
+			BufferedMessageChannel &channel(data->replyChannel);
+			bool result;
+			
+			try {
+				result = channel.read(reply.args);
+			} catch (const SystemException &e) {
+				throw SystemException("Could not read a message from "
+					"the ApplicationPool server", e.code());
+			}
+			if (!result) {
+				throw IOException("The ApplicationPool server unexpectedly "
+					"closed the connection.");
+			}
+			if (reply.args.size() < 2) {
+				throw IOException("The ApplicationPool server returned "
+					"an unknown message: " + toString(reply.args));
+			}
+			
+			UPDATE_TRACE_POINT();
+			id = atoi(reply.args[0]);
+			reply.args.erase(reply.args.begin());
+			if (reply.args[0] == "ok") {
+				reply.fd = channel.readFileDescriptor();
+			} else if (reply.args[0] == "SpawnException" && reply.args.size() == 3
+			        && reply.args[2] == "true") {
+				if (!channel.readScalar(reply.errorPage)) {
+					throw IOException("The ApplicationPool server "
+						"unexpectedly closed the connection.");
+				}
+			}
+		}
+		
+		/**
+		 * Wait for the reply to the request with the given ID. If no other
+		 * thread is reading from the server, then the current thread reads
+		 * replies until it has found its own, handing over replies for
+		 * other threads on the way.
+		 *
+		 * @pre <tt>l</tt> is locked.
+		 * @throws SystemException
+		 * @throws IOException
+		 * @throws boost::thread_interrupted
+		 */
+		void waitForReply(boost::mutex::scoped_lock &l, unsigned int id, Reply &reply) const {
+			TRACE_POINT();
+			map<unsigned int, Reply>::iterator it;
+			
+			while (true) {
+				it = data->replies.find(id);
+				if (it != data->replies.end()) {
+					reply = it->second;
+					data->replies.erase(it);
+					return;
+				} else if (!data->error.empty()) {
+					throw IOException(data->error);
+				} else if (data->reading) {
+					UPDATE_TRACE_POINT();
+					data->replyAvailable.wait(l);
+					continue;
+				}
+				
+				UPDATE_TRACE_POINT();
+				unsigned int replyID;
+				Reply nextReply;
+				
+				data->reading = true;
+				l.unlock();
+				try {
+					readReply(replyID, nextReply);
+				} catch (const exception &e) {
+					l.lock();
+					data->reading = false;
+					data->error = e.what();
+					data->replyAvailable.notify_all();
+					throw;
+				} catch (...) {
+					l.lock();
+					data->reading = false;
+					data->replyAvailable.notify_all();
+					throw;
+				}
+				l.lock();
+				data->reading = false;
+				data->replies[replyID] = nextReply;
+				data->replyAvailable.notify_all();
+			}
+		}
+		
+		/**
+		 * Send a request that expects a reply, and wait for the reply.
+		 */
+		void request(vector<string> &args, Reply &reply) const {
+			boost::mutex::scoped_lock l(data->lock);
+			unsigned long long changes;
+			
+			waitForReply(l, sendRequest(l, args, changes), reply);
+			synced(changes);
+		}
+		
+		/**
+		 * Send a 'get' request for a registered option set, and wait for
+		 * the reply.
+		 */
+		void requestRegisteredGet(unsigned int optionsID, Reply &reply) const {
+			boost::mutex::scoped_lock l(data->lock);
+			unsigned int id = data->nextRequestID;
+			unsigned long long changes;
+			
+			data->nextRequestID++;
+			try {
+				changes = data->sendRegisteredGet(l, id, optionsID);
+			} catch (const SystemException &) {
+				throw IOException("The ApplicationPool server exited unexpectedly.");
+			}
+			waitForReply(l, id, reply);
+			synced(changes);
+		}
+		
+		/**
+		 * Look up the ID of the given option set, and register it with the
+		 * server if it hasn't been registered yet.
+		 *
+		 * @return False if no more option sets may be registered on this
+		 *         connection, or if another thread is registering the same
+		 *         option set, in which case the caller should send the
+		 *         option set along with the request.
+		 */
+		bool lookupOptions(const PoolOptions &options, unsigned int &optionsID) const {
+			{
+				boost::mutex::scoped_lock l(data->lock);
+				map<PoolOptions, unsigned int>::const_iterator found;
+				
+				found = data->registeredOptions.find(options);
+				if (found != data->registeredOptions.end()) {
+					optionsID = found->second;
+					return true;
+				} else if (data->registrations >= MAX_REGISTERED_OPTIONS
+				        || data->pendingRegistrations.count(options) > 0) {
+					return false;
+				}
+				data->registrations++;
+				data->pendingRegistrations.insert(options);
+			}
+			
+			vector<string> registration;
+			Reply reply;
+			
+			registration.push_back("registerOptions");
+			options.toVector(registration);
+			try {
+				request(registration, reply);
+			} catch (...) {
+				boost::mutex::scoped_lock l(data->lock);
+				data->registrations--;
+				data->pendingRegistrations.erase(options);
+				throw;
+			}
+			optionsID = atoi(reply.args[0].c_str());
+			
+			boost::mutex::scoped_lock l(data->lock);
+			data->registeredOptions[options] = optionsID;
+			data->pendingRegistrations.erase(options);
+			return true;
+		}
+		
+		/**
+		 * Read the pool's counters from the published statistics, if the
+		 * statistics are available and reflect all messages that we've sent.
+		 */
+		bool readCounters(PoolStatistics::Counters &counters) const {
+			if (statistics == NULL) {
+				return false;
+			}
+			boost::mutex::scoped_lock l(data->lock);
+			return data->syncedStateChanges == data->stateChanges
+				&& statistics->readCounters(counters);
+		}
+		
+		unsigned int requestNumber(const char *name) const {
+			vector<string> args;
+			Reply reply;
+			
+			args.push_back(name);
+			request(args, reply);
+			return atoi(reply.args[0].c_str());
+		}
+		
 	public:
 		/**
 		 * Create a new Client.
 		 *
 		 * @param sock The newly established socket connection with the ApplicationPoolServer.
+		 * @param statistics The statistics that are published by the server,
+		 *                   or NULL if they're not available.
+		 * @throws SystemException Negotiating the frame format failed.
+		 * @throws IOException Negotiating the frame format failed.
 		 */
-		Client(int sock) {
-			dataSmartPointer = ptr(new SharedData());
+		Client(int sock, const PoolStatisticsPtr &statistics) {
+			dataSmartPointer = ptr(new SharedData(sock));
 			data = dataSmartPointer.get();
-			data->server = sock;
+			this->statistics = statistics;
+			data->frameVersion = data->replyChannel.negotiateFrameVersion();
 		}
 		
 		virtual void clear() {
-			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
-			channel.write("clear", NULL);
+			vector<string> args;
+			
+			args.push_back("clear");
+			sendMessage(args, true);
 		}
 		
 		virtual void setMaxIdleTime(unsigned int seconds) {
-			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
-			channel.write("setMaxIdleTime", toString(seconds).c_str(), NULL);
+			vector<string> args;
+			
+			args.push_back("setMaxIdleTime");
+			args.push_back(toString(seconds));
+			sendMessage(args, true);
 		}
 		
 		virtual void setMax(unsigned int max) {
-			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
-			channel.write("setMax", toString(max).c_str(), NULL);
+			vector<string> args;
+			
+			args.push_back("setMax");
+			args.push_back(toString(max));
+			sendMessage(args, true);
 		}
 		
 		virtual unsigned int getActive() const {
-			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
-			vector<string> args;
-			
-			channel.write("getActive", NULL);
-			channel.read(args);
-			return atoi(args[0].c_str());
+			PoolStatistics::Counters counters;
+			if (readCounters(counters)) {
+				return counters.active;
+			} else {
+				return requestNumber("getActive");
+			}
 		}
 		
 		virtual unsigned int getCount() const {
-			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
-			vector<string> args;
-			
-			channel.write("getCount", NULL);
-			channel.read(args);
-			return atoi(args[0].c_str());
+			PoolStatistics::Counters counters;
+			if (readCounters(counters)) {
+				return counters.count;
+			} else {
+				return requestNumber("getCount");
+			}
 		}
 		
 		virtual void setMaxPerApp(unsigned int max) {
-			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
-			channel.write("setMaxPerApp", toString(max).c_str(), NULL);
+			vector<string> args;
+			
+			args.push_back("setMaxPerApp");
+			args.push_back(toString(max));
+			sendMessage(args, true);
 		}
 		
 		virtual pid_t getSpawnServerPid() const {
 			this_thread::disable_syscall_interruption dsi;
-			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
-			vector<string> args;
-			
-			channel.write("getSpawnServerPid", NULL);
-			channel.read(args);
-			return atoi(args[0].c_str());
+			PoolStatistics::Counters counters;
+			if (readCounters(counters)) {
+				return counters.spawnServerPid;
+			} else {
+				return requestNumber("getSpawnServerPid");
+			}
 		}
 		
 		virtual Application::SessionPtr get(const PoolOptions &options) {
 			this_thread::disable_syscall_interruption dsi;
 			TRACE_POINT();
+			unsigned int optionsID;
+			Reply reply;
 			
-			MessageChannel channel(data->server);
-			boost::mutex::scoped_lock l(data->lock);
-			vector<string> args;
-			int stream;
-			bool result;
-			
-			try {
+			if (lookupOptions(options, optionsID)) {
+				requestRegisteredGet(optionsID, reply);
+			} else {
 				vector<string> args;
 				
 				args.push_back("get");
 				options.toVector(args);
-				channel.write(args);
-			} catch (const SystemException &) {
-				UPDATE_TRACE_POINT();
-				throw IOException("The ApplicationPool server exited unexpectedly.");
-			}
-			try {
-				UPDATE_TRACE_POINT();
-				result = channel.read(args);
-			} catch (const SystemException &e) {
-				UPDATE_TRACE_POINT();
-				throw SystemException("Could not read a message from "
-					"the ApplicationPool server", e.code());
-			}
-			if (!result) {
-				UPDATE_TRACE_POINT();
-				throw IOException("The ApplicationPool server unexpectedly "
-					"closed the connection.");
+				request(args, reply);
 			}
-			if (args[0] == "ok") {
-				UPDATE_TRACE_POINT();
-				stream = channel.readFileDescriptor();
+			
+			UPDATE_TRACE_POINT();
+			const vector<string> &result(reply.args);
+			if (result[0] == "ok" && result.size() == 3) {
 				return ptr(new RemoteSession(dataSmartPointer,
-					atoi(args[1]), atoi(args[2]), stream));
-			} else if (args[0] == "SpawnException") {
-				UPDATE_TRACE_POINT();
-				if (args[2] == "true") {
-					string errorPage;
-					
-					if (!channel.readScalar(errorPage)) {
-						throw IOException("The ApplicationPool server "
-							"unexpectedly closed the connection.");
-					}
-					throw SpawnException(args[1], errorPage);
+					atoi(result[1]), atoi(result[2]), reply.fd));
+			} else if (result[0] == "SpawnException" && result.size() == 3) {
+				if (result[2] == "true") {
+					throw SpawnException(result[1], reply.errorPage);
 				} else {
-					throw SpawnException(args[1]);
+					throw SpawnException(result[1]);
 				}
-			} else if (args[0] == "BusyException") {
-				UPDATE_TRACE_POINT();
-				throw BusyException(args[1]);
-			} else if (args[0] == "IOException") {
-				UPDATE_TRACE_POINT();
-				throw IOException(args[1]);
+			} else if (result[0] == "BusyException" && result.size() == 2) {
+				throw BusyException(result[1]);
+			} else if (result[0] == "IOException" && result.size() == 2) {
+				throw IOException(result[1]);
 			} else {
-				UPDATE_TRACE_POINT();
 				throw IOException("The ApplicationPool server returned "
-					"an unknown message: " + toString(args));
+					"an unknown message: " + toString(result));
 			}
 		}
 	};
@@ -384,8 +975,19 @@ private:
 	string m_logFile;
 	string m_rubyCommand;
 	string m_user;
+	unsigned int m_maxConcurrentSpawns;
+	bool m_watchRestartFiles;
 	string statusReportFIFO;
 	
+	/**
+	 * The file in which the server publishes the pool's statistics, or
+	 * the empty string if statistics publishing is disabled.
+	 */
+	string statisticsFile;
+	
+	/** The mapping of <tt>statisticsFile</tt>, or NULL. */
+	PoolStatisticsPtr statistics;
+	
 	/**
 	 * The PID of the ApplicationPool server process. If no server process
 	 * is running, then <tt>serverPid == 0</tt>.
@@ -426,6 +1028,12 @@ private:
 				ret = unlink(statusReportFIFO.c_str());
 			} while (ret == -1 && errno == EINTR);
 		}
+		if (!statisticsFile.empty()) {
+			do {
+				ret = unlink(statisticsFile.c_str());
+			} while (ret == -1 && errno == EINTR);
+		}
+		statistics.reset();
 		
 		P_TRACE(2, "Waiting for existing ApplicationPoolServerExecutable (PID " <<
 			serverPid << ") to exit...");
@@ -479,6 +1087,7 @@ private:
 		}
 		
 		createStatusReportFIFO();
+		createStatisticsFile();
 		
 		pid = syscalls::fork();
 		if (pid == 0) { // Child process.
@@ -503,6 +1112,9 @@ private:
 				m_rubyCommand.c_str(),
 				m_user.c_str(),
 				statusReportFIFO.c_str(),
+				toString(m_maxConcurrentSpawns).c_str(),
+				m_watchRestartFiles ? "true" : "false",
+				statisticsFile.c_str(),
 				(char *) 0);
 			int e = errno;
 			fprintf(stderr, "*** Passenger ERROR (%s:%d):\n"
@@ -545,6 +1157,31 @@ private:
 			statusReportFIFO = filename;
 		}
 	}
+	
+	void createStatisticsFile() {
+		TRACE_POINT();
+		char filename[PATH_MAX];
+		int ret;
+		
+		snprintf(filename, sizeof(filename), "%s/pool_statistics",
+				getPassengerTempDir().c_str());
+		filename[PATH_MAX - 1] = '\0';
+		
+		// Clients of a previous server may still have the old file
+		// mapped, so we create a new file instead of truncating it.
+		do {
+			ret = unlink(filename);
+		} while (ret == -1 && errno == EINTR);
+		try {
+			statistics = ptr(new PoolStatistics(filename, true));
+			statisticsFile = filename;
+		} catch (const SystemException &e) {
+			P_WARN("*** WARNING: " << e.what() << endl <<
+				"Disabling Passenger ApplicationPool statistics publishing.");
+			statistics.reset();
+			statisticsFile = "";
+		}
+	}
 
 public:
 	/**
@@ -565,6 +1202,11 @@ public:
 	 *             running as root. If the empty string is given, or if
 	 *             the <tt>user</tt> is not a valid username, then
 	 *             the spawn manager will be run as the current user.
+	 * @param maxConcurrentSpawns The maximum number of applications that may
+	 *             be spawned concurrently. See SpawnManager for details.
+	 * @param watchRestartFiles Whether applications' tmp directories should be
+	 *             watched for changes to restart.txt. See StandardApplicationPool
+	 *             for details.
 	 * @throws SystemException An error occured while trying to setup the spawn server
 	 *            or the server socket.
 	 * @throws IOException The specified log file could not be opened.
@@ -573,12 +1215,16 @@ public:
 	             const string &spawnServerCommand,
 	             const string &logFile = "",
 	             const string &rubyCommand = "ruby",
-	             const string &user = "")
+	             const string &user = "",
+	             unsigned int maxConcurrentSpawns = 1,
+	             bool watchRestartFiles = false)
 	: m_serverExecutable(serverExecutable),
 	  m_spawnServerCommand(spawnServerCommand),
 	  m_logFile(logFile),
 	  m_rubyCommand(rubyCommand),
-	  m_user(user) {
+	  m_user(user),
+	  m_maxConcurrentSpawns(maxConcurrentSpawns),
+	  m_watchRestartFiles(watchRestartFiles) {
 		TRACE_POINT();
 		serverSocket = -1;
 		serverPid = 0;
@@ -605,24 +1251,20 @@ public:
 	 *   All methods of the returned ApplicationPool object may throw
 	 *   SystemException, IOException or boost::thread_interrupted.
 	 *
+	 * The returned ApplicationPool object may be used by multiple threads
+	 * at the same time. Their get() calls are sent over the same connection
+	 * and are processed by the server concurrently.
+	 *
 	 * @warning
-	 * One may only use the returned ApplicationPool object for handling
-	 * one session at a time. For example, don't do stuff like this:
+	 * A single thread should not hold multiple sessions of the same
+	 * application at the same time. For example, don't do stuff like this:
 	 * @code
 	 *   ApplicationPoolPtr pool = server.connect();
 	 *   Application::SessionPtr session1 = pool->get(...);
 	 *   Application::SessionPtr session2 = pool->get(...);
 	 * @endcode
-	 * Otherwise, a deadlock can occur under certain circumstances.
-	 * @warning
-	 * Instead, one should call connect() multiple times:
-	 * @code
-	 *   ApplicationPoolPtr pool1 = server.connect();
-	 *   Application::SessionPtr session1 = pool1->get(...);
-	 *   
-	 *   ApplicationPoolPtr pool2 = server.connect();
-	 *   Application::SessionPtr session2 = pool2->get(...);
-	 * @endcode
+	 * Otherwise, a deadlock can occur if the application may not have
+	 * more than one instance.
 	 *
 	 * @throws SystemException Something went wrong.
 	 * @throws IOException Something went wrong.
@@ -638,7 +1280,7 @@ public:
 			channel.writeRaw("x", 1);
 			
 			clientConnection = channel.readFileDescriptor();
-			return ptr(new Client(clientConnection));
+			return ptr(new Client(clientConnection, statistics));
 		} catch (const SystemException &e) {
 			throw SystemException("Could not connect to the ApplicationPool server", e.code());
 		} catch (const IOException &e) {
@@ -24,17 +24,34 @@
  * This is the ApplicationPool server executable. See the ApplicationPoolServer
  * class for background information.
  *
- * Each client is handled by a seperate thread. This is necessary because we use
- * StandardApplicationPool, and the current algorithm for StandardApplicationPool::get()
- * can block (in the case that the spawning limit has been exceeded). While it is
- * possible to get around this problem without using threads, a thread-based implementation
- * is easier to write.
+ * All client connections are handled by an event loop in the main thread. It
+ * waits until clients send data (with epoll, or with poll() on platforms that
+ * don't have epoll), buffers the data and processes every complete message.
+ * Most messages can be processed right away, but StandardApplicationPool::get()
+ * can block for a long time, e.g. while an application is being spawned or
+ * while all instances are busy. So 'get' messages are handed over to a pool of
+ * worker threads. A client may send multiple 'get' messages without waiting
+ * for the replies, which are then processed concurrently. Every message that
+ * expects a reply carries a request ID, which is sent back along with the
+ * reply so that the client can tell the replies apart.
+ *
+ * Clients usually register their option sets with 'registerOptions' and then
+ * send 'get' requests as fixed-size binary frames that only refer to an option
+ * set ID. See the ApplicationPoolServer class for details.
+ *
+ * The worker pool only grows when all worker threads are blocked, so the
+ * number of threads depends on the number of concurrently blocking 'get'
+ * calls instead of on the number of clients. It never grows beyond
+ * MAX_WORKER_THREADS threads; further 'get' messages wait until a worker
+ * thread is available. Worker threads above MIN_WORKER_THREADS exit after
+ * they've been idle for WORKER_IDLE_TIMEOUT seconds.
  */
 
 #include <boost/shared_ptr.hpp>
-#include <boost/weak_ptr.hpp>
 #include <boost/bind.hpp>
 #include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
 
 #include <oxt/system_calls.hpp>
 #include <oxt/thread.hpp>
@@ -44,16 +61,27 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#ifdef __linux__
+	#include <sys/epoll.h>
+	#define PASSENGER_HAS_EPOLL
+#else
+	#include <poll.h>
+#endif
 #include <unistd.h>
 #include <signal.h>
 #include <string>
 #include <sstream>
 #include <vector>
+#include <deque>
 #include <set>
 #include <map>
+#include <cstring>
 
 #include "MessageChannel.h"
+#include "BufferedMessageChannel.h"
+#include "StaticString.h"
 #include "StandardApplicationPool.h"
+#include "PoolStatistics.h"
 #include "Application.h"
 #include "Logging.h"
 #include "Exceptions.h"
@@ -68,8 +96,158 @@ class Server;
 class Client;
 typedef shared_ptr<Client> ClientPtr;
 
+/** A 'get' request that should be processed by a worker thread. */
+struct Job {
+	ClientPtr client;
+	string requestID;
+	PoolOptions options;
+};
+
 #define SERVER_SOCKET_FD 3
 
+/** Must be the same as ApplicationPoolServer::MAX_REGISTERED_OPTIONS. */
+#define MAX_REGISTERED_OPTIONS 1024
+
+/** Must be the same as ApplicationPoolServer::REGISTERED_GET_MARKER. */
+#define REGISTERED_GET_MARKER '\x01'
+
+/**
+ * The minimum size of a registered 'get' frame's body. It may be followed
+ * by the IDs of sessions to close.
+ */
+#define REGISTERED_GET_BODY_SIZE (1 + 4 + 4)
+
+
+/*****************************************
+ * EventPoller
+ *****************************************/
+
+/**
+ * Waits until one or more file descriptors become readable. Uses epoll if
+ * the platform supports it, and poll() otherwise.
+ *
+ * File descriptors that have been hung up, or that are in an error state,
+ * are reported as readable as well, so that the caller notices the problem
+ * when reading from them.
+ */
+class EventPoller {
+private:
+	static const int MAX_EVENTS = 64;
+	
+	#ifdef PASSENGER_HAS_EPOLL
+		int epollFd;
+	#else
+		set<int> fds;
+	#endif
+	
+public:
+	/**
+	 * @throws SystemException
+	 */
+	EventPoller() {
+		#ifdef PASSENGER_HAS_EPOLL
+			epollFd = epoll_create(MAX_EVENTS);
+			if (epollFd == -1) {
+				throw SystemException("Cannot create an epoll instance", errno);
+			}
+		#endif
+	}
+	
+	~EventPoller() {
+		#ifdef PASSENGER_HAS_EPOLL
+			this_thread::disable_syscall_interruption dsi;
+			syscalls::close(epollFd);
+		#endif
+	}
+	
+	/**
+	 * Start watching the given file descriptor.
+	 *
+	 * @throws SystemException
+	 */
+	void add(int fd) {
+		#ifdef PASSENGER_HAS_EPOLL
+			struct epoll_event event;
+			
+			memset(&event, 0, sizeof(event));
+			event.events = EPOLLIN;
+			event.data.fd = fd;
+			if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+				throw SystemException("Cannot add a file descriptor to the epoll set",
+					errno);
+			}
+		#else
+			fds.insert(fd);
+		#endif
+	}
+	
+	/**
+	 * Stop watching the given file descriptor. Does nothing if it isn't
+	 * being watched.
+	 */
+	void remove(int fd) {
+		#ifdef PASSENGER_HAS_EPOLL
+			// Kernels older than 2.6.9 require a non-NULL event argument.
+			struct epoll_event event;
+			
+			memset(&event, 0, sizeof(event));
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, &event);
+		#else
+			fds.erase(fd);
+		#endif
+	}
+	
+	/**
+	 * Wait until at least one of the watched file descriptors is readable,
+	 * or until the timeout expires.
+	 *
+	 * @param ready The readable file descriptors will be put in here.
+	 * @param timeout The timeout in milliseconds, or -1 for no timeout.
+	 * @throws SystemException
+	 */
+	void wait(vector<int> &ready, int timeout = -1) {
+		int ret;
+		
+		ready.clear();
+		#ifdef PASSENGER_HAS_EPOLL
+			struct epoll_event events[MAX_EVENTS];
+			
+			do {
+				ret = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+			} while (ret == -1 && errno == EINTR);
+			if (ret == -1) {
+				throw SystemException("epoll_wait() failed", errno);
+			}
+			for (int i = 0; i < ret; i++) {
+				ready.push_back(events[i].data.fd);
+			}
+		#else
+			vector<struct pollfd> pollFds;
+			set<int>::const_iterator it;
+			
+			pollFds.reserve(fds.size());
+			for (it = fds.begin(); it != fds.end(); it++) {
+				struct pollfd pollFd;
+				pollFd.fd = *it;
+				pollFd.events = POLLIN;
+				pollFd.revents = 0;
+				pollFds.push_back(pollFd);
+			}
+			do {
+				ret = poll(&pollFds[0], pollFds.size(), timeout);
+			} while (ret == -1 && errno == EINTR);
+			if (ret == -1) {
+				throw SystemException("poll() failed", errno);
+			}
+			for (unsigned int i = 0; i < pollFds.size(); i++) {
+				if (pollFds[i].revents != 0) {
+					ready.push_back(pollFds[i].fd);
+				}
+			}
+		#endif
+	}
+};
+
 
 /*****************************************
  * Server
@@ -78,14 +256,79 @@ typedef shared_ptr<Client> ClientPtr;
 class Server {
 private:
 	friend class Client;
-
+	
+	static const unsigned int MIN_WORKER_THREADS = 2;
+	/**
+	 * Blocked 'get' calls never depend on other 'get' calls to make
+	 * progress (sessions are closed by the main thread), so queueing the
+	 * ones that exceed this limit is safe.
+	 */
+	static const unsigned int MAX_WORKER_THREADS = 256;
+	/** The number of seconds after which an idle surplus worker thread exits. */
+	static const unsigned int WORKER_IDLE_TIMEOUT = 60;
+	static const int WORKER_THREAD_STACK_SIZE = 1024 * 128;
+	/** The maximum number of milliseconds between two statistics updates. */
+	static const int STATISTICS_PUBLISH_INTERVAL = 1000;
+	
 	int serverSocket;
 	StandardApplicationPool pool;
-	set<ClientPtr> clients;
-	boost::mutex lock;
 	string statusReportFIFO;
 	shared_ptr<oxt::thread> statusReportThread;
 	
+	/** Where the pool's statistics are published, if anywhere. */
+	PoolStatisticsPtr statistics;
+	
+	/**
+	 * All connected clients, indexed by their file descriptors. Only
+	 * accessed by the main thread.
+	 */
+	map<int, ClientPtr> clients;
+	
+	/** Watches the server socket and all client connections. */
+	EventPoller poller;
+	
+	/**
+	 * Worker threads write a byte to this pipe to wake up the main thread
+	 * after they've processed a 'get' message.
+	 */
+	int notificationPipe[2];
+	
+	/** Only accessed by the main thread. */
+	vector< shared_ptr<oxt::thread> > workers;
+	/** The number of worker threads that have been started so far. */
+	unsigned int workersStarted;
+	
+	/** Protects everything below. */
+	boost::mutex lock;
+	
+	/** Notified when a 'get' message has been put in <tt>jobs</tt>. */
+	condition workAvailable;
+	
+	/** 'get' messages that are waiting for a worker thread. */
+	deque<Job> jobs;
+	
+	/**
+	 * Clients whose 'get' messages have been processed by a worker thread.
+	 * The main thread releases these references, so that clients are
+	 * always closed by the main thread.
+	 */
+	vector<ClientPtr> finishedJobs;
+	
+	/** The number of worker threads that are waiting for a job. */
+	unsigned int idleWorkers;
+	
+	/** The number of worker threads that haven't decided to exit. */
+	unsigned int workerCount;
+	
+	/**
+	 * The IDs of the worker threads that have exited because they were
+	 * idle for too long. The main thread joins them and removes them
+	 * from <tt>workers</tt>.
+	 */
+	vector<boost::thread::id> retiredWorkers;
+	
+	bool shuttingDown;
+	
 	void statusReportThreadMain() {
 		TRACE_POINT();
 		try {
@@ -140,6 +383,39 @@ private:
 			} while (ret == -1 && errno == EINTR);
 		}
 	}
+	
+	void startWorker() {
+		stringstream name;
+		
+		workersStarted++;
+		name << "Worker " << workersStarted;
+		{
+			boost::mutex::scoped_lock l(lock);
+			workerCount++;
+		}
+		try {
+			workers.push_back(ptr(
+				new oxt::thread(
+					bind(&Server::workerThreadMain, this),
+					name.str(), WORKER_THREAD_STACK_SIZE
+				)
+			));
+		} catch (...) {
+			boost::mutex::scoped_lock l(lock);
+			workerCount--;
+			throw;
+		}
+	}
+	
+	// The following methods will be defined later, because they depend
+	// on Client's interface.
+	void workerThreadMain();
+	void scheduleGet(const ClientPtr &client, const Job &get);
+	bool acceptClient();
+	void processClientEvent(int fd, vector<ClientPtr> &disconnected);
+	void processFinishedJobs(vector<ClientPtr> &disconnected);
+	void joinRetiredWorkers();
+	void disconnect(const ClientPtr &client, vector<ClientPtr> &disconnected);
 
 public:
 	Server(int serverSocket,
@@ -148,12 +424,54 @@ public:
 	       const string &logFile,
 	       const string &rubyCommand,
 	       const string &user,
-	       const string &statusReportFIFO)
-		: pool(spawnServerCommand, logFile, rubyCommand, user) {
+	       const string &statusReportFIFO,
+	       unsigned int maxConcurrentSpawns,
+	       bool watchRestartFiles,
+	       const string &statisticsFile)
+		: pool(spawnServerCommand, logFile, rubyCommand, user, maxConcurrentSpawns,
+		       watchRestartFiles) {
 		
 		Passenger::setLogLevel(logLevel);
 		this->serverSocket = serverSocket;
 		this->statusReportFIFO = statusReportFIFO;
+		idleWorkers = 0;
+		workerCount = 0;
+		workersStarted = 0;
+		shuttingDown = false;
+		if (pipe(notificationPipe) == -1) {
+			throw SystemException("Cannot create a pipe", errno);
+		}
+		if (!statisticsFile.empty()) {
+			try {
+				statistics = ptr(new PoolStatistics(statisticsFile, false));
+			} catch (const SystemException &e) {
+				P_WARN("*** WARNING: " << e.what() << endl <<
+					"Disabling Passenger ApplicationPool statistics publishing.");
+			}
+		}
+	}
+	
+	/**
+	 * Publish the pool's current state in the statistics file, if there
+	 * is one. This takes a while for big pools, so the main thread only
+	 * does it periodically.
+	 */
+	void publishStatistics() {
+		if (statistics != NULL) {
+			pool.publishStatistics(*statistics);
+		}
+	}
+	
+	/**
+	 * Publish the pool's counters in the statistics file, if there is one.
+	 * Clients read the statistics file instead of asking us for the pool's
+	 * counters, so this must be called before replying to a message that
+	 * might have changed them.
+	 */
+	void publishCounters() {
+		if (statistics != NULL) {
+			pool.publishCounters(*statistics);
+		}
 	}
 	
 	~Server() {
@@ -170,20 +488,26 @@ public:
 			statusReportThread->interrupt_and_join();
 		}
 		
-		// Wait for all clients to disconnect.
 		UPDATE_TRACE_POINT();
-		set<ClientPtr> clientsCopy;
 		{
-			/* If we clear _clients_ directly, then it may result in a deadlock.
-			 * So we make a copy of the set inside a critical section in order to increase
-			 * the reference counts, and then we release all references outside the critical
-			 * section.
-			 */
 			boost::mutex::scoped_lock l(lock);
-			clientsCopy = clients;
-			clients.clear();
+			shuttingDown = true;
+			workAvailable.notify_all();
 		}
-		clientsCopy.clear();
+		vector< shared_ptr<oxt::thread> >::iterator it;
+		for (it = workers.begin(); it != workers.end(); it++) {
+			(*it)->interrupt_and_join();
+		}
+		workers.clear();
+		
+		// Close all client connections. The worker threads are gone,
+		// so nothing else refers to the clients anymore.
+		UPDATE_TRACE_POINT();
+		jobs.clear();
+		finishedJobs.clear();
+		clients.clear();
+		syscalls::close(notificationPipe[0]);
+		syscalls::close(notificationPipe[1]);
 		deleteStatusReportFIFO();
 		
 		P_TRACE(2, "Server shutdown complete.");
@@ -200,23 +524,30 @@ public:
 /**
  * Represents a single ApplicationPool client, connected to this server.
  *
+ * A Client is owned by the main thread, which reads and processes its
+ * messages. Worker threads process its 'get' messages concurrently.
+ *
  * @invariant
  * The life time of a Client object is guaranteed to be less than
  * that of its associated Server object.
  */
 class Client {
 private:
-	static const int CLIENT_THREAD_STACK_SIZE = 1024 * 128;
-
 	/** The Server that this Client object belongs to. */
 	Server &server;
 	
 	/** The connection to the client. */
 	int fd;
-	MessageChannel channel;
+	BufferedMessageChannel channel;
 	
-	/** The thread which handles the client connection. */
-	oxt::thread *thr;
+	/**
+	 * Must be held while writing a reply, so that replies from different
+	 * threads don't get mixed up.
+	 */
+	boost::mutex writeLock;
+	
+	/** Protects <tt>sessions</tt> and <tt>lastSessionID</tt>. */
+	boost::mutex sessionsLock;
 	
 	/**
 	 * Maps session ID to sessions created by ApplicationPool::get(). Session IDs
@@ -228,89 +559,87 @@ private:
 	/** Last used session ID. */
 	int lastSessionID;
 	
-	void processGet(const vector<string> &args) {
-		TRACE_POINT();
-		Application::SessionPtr session;
-		bool failed = false;
+	/** Data that has been received from the client, but not processed yet. */
+	string inbox;
+	
+	/**
+	 * The frame format that the client has negotiated. Only accessed by the
+	 * main thread; worker threads use the channel's copy.
+	 */
+	unsigned int frameVersion;
+	
+	/**
+	 * The option sets that the client has registered, indexed by option
+	 * set ID. Only accessed by the main thread.
+	 */
+	vector<PoolOptions> registeredOptions;
+	
+	/**
+	 * Sessions that the client has closed, but that haven't been released
+	 * yet. Only accessed by the main thread.
+	 */
+	vector<Application::SessionPtr> closedSessions;
+	
+	void processClose(int sessionID) {
+		boost::mutex::scoped_lock l(sessionsLock);
+		map<int, Application::SessionPtr>::iterator it;
 		
-		try {
-			PoolOptions options(args, 1);
-			session = server.pool.get(options);
-			sessions[lastSessionID] = session;
-			lastSessionID++;
-		} catch (const SpawnException &e) {
-			UPDATE_TRACE_POINT();
-			this_thread::disable_syscall_interruption dsi;
-			
-			if (e.hasErrorPage()) {
-				P_TRACE(3, "Client " << this << ": SpawnException "
-					"occured (with error page)");
-				channel.write("SpawnException", e.what(), "true", NULL);
-				channel.writeScalar(e.getErrorPage());
-			} else {
-				P_TRACE(3, "Client " << this << ": SpawnException "
-					"occured (no error page)");
-				channel.write("SpawnException", e.what(), "false", NULL);
-			}
-			failed = true;
-		} catch (const BusyException &e) {
-			UPDATE_TRACE_POINT();
-			this_thread::disable_syscall_interruption dsi;
-			channel.write("BusyException", e.what(), NULL);
-			failed = true;
-		} catch (const IOException &e) {
-			UPDATE_TRACE_POINT();
-			this_thread::disable_syscall_interruption dsi;
-			channel.write("IOException", e.what(), NULL);
-			failed = true;
-		}
-		UPDATE_TRACE_POINT();
-		if (!failed) {
-			this_thread::disable_syscall_interruption dsi;
-			try {
-				UPDATE_TRACE_POINT();
-				channel.write("ok", toString(session->getPid()).c_str(),
-					toString(lastSessionID - 1).c_str(), NULL);
-				channel.writeFileDescriptor(session->getStream());
-				session->closeStream();
-			} catch (const exception &) {
-				UPDATE_TRACE_POINT();
-				P_TRACE(3, "Client " << this << ": something went wrong "
-					"while sending 'ok' back to the client.");
-				sessions.erase(lastSessionID - 1);
-				throw;
-			}
+		it = sessions.find(sessionID);
+		if (it != sessions.end()) {
+			closedSessions.push_back(it->second);
+			sessions.erase(it);
 		}
 	}
 	
-	void processClose(const vector<string> &args) {
+	void processClose(const vector<StaticString> &args) {
 		TRACE_POINT();
-		sessions.erase(atoi(args[1]));
+		vector<StaticString>::const_iterator it;
+		for (it = args.begin() + 1; it != args.end(); it++) {
+			processClose(atoi(*it));
+		}
+	}
+	
+	/**
+	 * Release all closed sessions, with a single pool lock acquisition.
+	 * Must be called before processing a message that might depend on
+	 * the pool's state.
+	 */
+	void releaseClosedSessions() {
+		if (!closedSessions.empty()) {
+			TRACE_POINT();
+			server.pool.closeSessions(closedSessions);
+		}
 	}
 	
-	void processClear(const vector<string> &args) {
+	void processClear(const vector<StaticString> &args) {
 		TRACE_POINT();
 		server.pool.clear();
 	}
 	
-	void processSetMaxIdleTime(const vector<string> &args) {
+	void processSetMaxIdleTime(const vector<StaticString> &args) {
 		TRACE_POINT();
 		server.pool.setMaxIdleTime(atoi(args[1]));
 	}
 	
-	void processSetMax(const vector<string> &args) {
+	void processSetMax(const vector<StaticString> &args) {
 		TRACE_POINT();
 		server.pool.setMax(atoi(args[1]));
 	}
 	
-	void processGetActive(const vector<string> &args) {
+	void processGetActive(const vector<StaticString> &args) {
 		TRACE_POINT();
-		channel.write(toString(server.pool.getActive()).c_str(), NULL);
+		server.publishCounters();
+		string active(toString(server.pool.getActive()));
+		boost::mutex::scoped_lock l(writeLock);
+		channel.write(args[1].toString().c_str(), active.c_str(), NULL);
 	}
 	
-	void processGetCount(const vector<string> &args) {
+	void processGetCount(const vector<StaticString> &args) {
 		TRACE_POINT();
-		channel.write(toString(server.pool.getCount()).c_str(), NULL);
+		server.publishCounters();
+		string count(toString(server.pool.getCount()));
+		boost::mutex::scoped_lock l(writeLock);
+		channel.write(args[1].toString().c_str(), count.c_str(), NULL);
 	}
 	
 	void processSetMaxPerApp(unsigned int maxPerApp) {
@@ -318,50 +647,211 @@ private:
 		server.pool.setMaxPerApp(maxPerApp);
 	}
 	
-	void processGetSpawnServerPid(const vector<string> &args) {
+	void processGetSpawnServerPid(const vector<StaticString> &args) {
+		TRACE_POINT();
+		server.publishCounters();
+		string pid(toString(server.pool.getSpawnServerPid()));
+		boost::mutex::scoped_lock l(writeLock);
+		channel.write(args[1].toString().c_str(), pid.c_str(), NULL);
+	}
+	
+	void processRegisterOptions(const vector<StaticString> &args) {
 		TRACE_POINT();
-		channel.write(toString(server.pool.getSpawnServerPid()).c_str(), NULL);
+		string optionsID(toString(registeredOptions.size()));
+		registeredOptions.push_back(PoolOptions(args, 2));
+		boost::mutex::scoped_lock l(writeLock);
+		channel.write(args[1].toString().c_str(), optionsID.c_str(), NULL);
 	}
 	
-	void processUnknownMessage(const vector<string> &args) {
+	void processFrameVersion(const vector<StaticString> &args) {
+		TRACE_POINT();
+		boost::mutex::scoped_lock l(writeLock);
+		frameVersion = channel.acceptFrameVersion(atoi(args[1]));
+	}
+	
+	void processUnknownMessage(const vector<StaticString> &args) {
 		TRACE_POINT();
 		string name;
 		if (args.empty()) {
 			name = "(null)";
 		} else {
-			name = args[0];
+			name = args[0].toString();
 		}
 		P_WARN("An ApplicationPool client sent an invalid command: "
 			<< name << " (" << args.size() << " elements)");
 	}
 	
 	/**
-	 * The entry point of the thread that handles the client connection.
+	 * Find the next complete message in the inbox, starting at the given
+	 * offset.
+	 *
+	 * @param offset The offset in the inbox at which the message starts.
+	 * @param start Set to the offset of the message body in the inbox.
+	 * @param end Set to the offset right after the message body.
+	 * @return Whether the inbox contains a complete message.
 	 */
-	void threadMain(const weak_ptr<Client> self) {
+	bool nextMessage(string::size_type offset, string::size_type &start,
+	                 string::size_type &end) const {
+		unsigned int headerSize = MessageChannel::frameHeaderSize(frameVersion);
+		unsigned int size;
+		
+		if (inbox.size() - offset < headerSize) {
+			return false;
+		}
+		size = MessageChannel::decodeFrameHeader(inbox.data() + offset, frameVersion);
+		if (inbox.size() - offset - headerSize < size) {
+			return false;
+		}
+		start = offset + headerSize;
+		end = start + size;
+		return true;
+	}
+	
+	/**
+	 * Parse the registered 'get' frame body between <tt>start</tt> and
+	 * <tt>end</tt> in the inbox, and process the closes that it contains.
+	 *
+	 * @return False if the frame refers to an unregistered option set.
+	 */
+	bool processRegisteredGet(string::size_type start, string::size_type end, Job &get) {
+		uint32_t requestID, optionsID, sessionID;
+		
+		memcpy(&requestID, inbox.data() + start + 1, sizeof(requestID));
+		memcpy(&optionsID, inbox.data() + start + 5, sizeof(optionsID));
+		optionsID = ntohl(optionsID);
+		if (optionsID >= registeredOptions.size()) {
+			return false;
+		}
+		get.requestID = toString(ntohl(requestID));
+		get.options = registeredOptions[optionsID];
+		for (start += REGISTERED_GET_BODY_SIZE; start < end; start += sizeof(sessionID)) {
+			memcpy(&sessionID, inbox.data() + start, sizeof(sessionID));
+			processClose(ntohl(sessionID));
+		}
+		return true;
+	}
+
+public:
+	/**
+	 * Whether an error occurred while a worker thread was sending a reply
+	 * to this client. Protected by the server's lock.
+	 */
+	bool broken;
+	
+	/**
+	 * Create a new Client object.
+	 *
+	 * @param the_server The Server object that this Client belongs to.
+	 * @param connection The connection to the ApplicationPool client.
+	 *
+	 * @note
+	 * <tt>connection</tt> will be closed upon destruction
+	 */
+	Client(Server &the_server, int connection)
+		: server(the_server),
+		  fd(connection),
+		  channel(connection) {
+		lastSessionID = 0;
+		frameVersion = MessageChannel::FRAME_VERSION_1;
+		broken = false;
+	}
+	
+	~Client() {
+		TRACE_POINT();
+		this_thread::disable_syscall_interruption dsi;
+		this_thread::disable_interruption di;
+		
+		// Close the sessions before closing the connection.
+		sessions.clear();
+		syscalls::close(fd);
+	}
+	
+	int getFd() const {
+		return fd;
+	}
+	
+	/**
+	 * Read the data that the client has sent, and append it to the inbox.
+	 * Must only be called when the connection is readable, so that this
+	 * doesn't block.
+	 *
+	 * @return False if the client closed the connection or if the
+	 *         connection is broken.
+	 */
+	bool receive() {
+		TRACE_POINT();
+		char buf[1024 * 8];
+		ssize_t ret;
+		
+		ret = syscalls::read(fd, buf, sizeof(buf));
+		if (ret == -1) {
+			P_TRACE(2, "Error while reading from ApplicationPool client " <<
+				this << ": " << strerror(errno));
+			return false;
+		} else if (ret == 0) {
+			// Client closed connection.
+			return false;
+		} else {
+			inbox.append(buf, ret);
+			return true;
+		}
+	}
+	
+	/**
+	 * Process all complete messages in the inbox, except for 'get'
+	 * requests, which are put in <tt>gets</tt> so that the caller can hand
+	 * them over to worker threads. Sessions that are closed by these
+	 * messages are released before this method returns.
+	 *
+	 * @return False if the connection should be closed.
+	 */
+	bool processMessages(vector<Job> &gets) {
 		TRACE_POINT();
-		vector<string> args;
+		string::size_type consumed = 0, start, end;
+		vector<StaticString> args;
 		try {
-			while (!this_thread::interruption_requested()) {
-				UPDATE_TRACE_POINT();
-				try {
-					if (!channel.read(args)) {
-						// Client closed connection.
-						break;
+			while (nextMessage(consumed, start, end)) {
+				consumed = end;
+				if (end - start >= REGISTERED_GET_BODY_SIZE
+				 && (end - start - REGISTERED_GET_BODY_SIZE) % sizeof(uint32_t) == 0
+				 && inbox[start] == REGISTERED_GET_MARKER) {
+					UPDATE_TRACE_POINT();
+					Job get;
+					if (!processRegisteredGet(start, end, get)) {
+						P_WARN("An ApplicationPool client sent a 'get' request "
+							"for an unregistered option set.");
+						return false;
 					}
-				} catch (const SystemException &e) {
-					P_TRACE(2, "Exception in ApplicationPoolServer client thread during "
-						"reading of a message: " << e.what());
-					break;
+					P_TRACE(4, "Client " << this << ": received registered "
+						"'get' request " << get.requestID);
+					gets.push_back(get);
+					continue;
 				}
-
+				
+				// The message's elements point into the inbox, which
+				// is left alone until all messages have been processed.
+				MessageChannel::parseArrayMessage(inbox.data() + start,
+					end - start, args);
 				P_TRACE(4, "Client " << this << ": received message: " <<
 					toString(args));
 				
 				UPDATE_TRACE_POINT();
-				if (args[0] == "get") {
-					processGet(args);
-				} else if (args[0] == "close" && args.size() == 2) {
+				if (!args.empty() && args[0] != "close" && args[0] != "get") {
+					releaseClosedSessions();
+				}
+				if (args.empty()) {
+					processUnknownMessage(args);
+					return false;
+				} else if (args[0] == "get" && args.size() == 2 + PoolOptions::VECTOR_SIZE) {
+					Job get;
+					get.requestID = args[1].toString();
+					get.options = PoolOptions(args, 2);
+					gets.push_back(get);
+				} else if (args[0] == "registerOptions"
+				        && args.size() == 2 + PoolOptions::VECTOR_SIZE
+				        && registeredOptions.size() < MAX_REGISTERED_OPTIONS) {
+					processRegisterOptions(args);
+				} else if (args[0] == "close" && args.size() >= 2) {
 					processClose(args);
 				} else if (args[0] == "clear" && args.size() == 1) {
 					processClear(args);
@@ -369,95 +859,392 @@ private:
 					processSetMaxIdleTime(args);
 				} else if (args[0] == "setMax" && args.size() == 2) {
 					processSetMax(args);
-				} else if (args[0] == "getActive" && args.size() == 1) {
+				} else if (args[0] == "getActive" && args.size() == 2) {
 					processGetActive(args);
-				} else if (args[0] == "getCount" && args.size() == 1) {
+				} else if (args[0] == "getCount" && args.size() == 2) {
 					processGetCount(args);
 				} else if (args[0] == "setMaxPerApp" && args.size() == 2) {
 					processSetMaxPerApp(atoi(args[1]));
-				} else if (args[0] == "getSpawnServerPid" && args.size() == 1) {
+				} else if (args[0] == "getSpawnServerPid" && args.size() == 2) {
 					processGetSpawnServerPid(args);
+				} else if (args[0] == "frame_version" && args.size() == 2) {
+					processFrameVersion(args);
 				} else {
 					processUnknownMessage(args);
-					break;
+					return false;
 				}
-				args.clear();
 			}
-		} catch (const boost::thread_interrupted &) {
-			P_TRACE(2, "Client thread " << this << " interrupted.");
+			inbox.erase(0, consumed);
+			releaseClosedSessions();
+			return true;
 		} catch (const tracable_exception &e) {
-			P_TRACE(2, "Uncaught exception in ApplicationPoolServer client thread:\n"
+			P_TRACE(2, "Uncaught exception while processing an ApplicationPool "
+				"client message:\n"
 				<< "   message: " << toString(args) << "\n"
 				<< "   exception: " << e.what() << "\n"
 				<< "   backtrace:\n" << e.backtrace());
+			return false;
 		} catch (const exception &e) {
-			P_TRACE(2, "Uncaught exception in ApplicationPoolServer client thread:\n"
+			P_TRACE(2, "Uncaught exception while processing an ApplicationPool "
+				"client message:\n"
 				<< "   message: " << toString(args) << "\n"
 				<< "   exception: " << e.what() << "\n"
 				<< "   backtrace: not available");
-		} catch (...) {
-			P_TRACE(2, "Uncaught unknown exception in ApplicationPool client thread.");
-			throw;
+			return false;
 		}
+	}
+	
+	/**
+	 * Process a 'get' request. This is called by a worker thread.
+	 *
+	 * @throws SystemException Something went wrong while sending the reply.
+	 * @throws boost::thread_interrupted
+	 */
+	void processGet(const Job &get) {
+		TRACE_POINT();
+		const char *requestID = get.requestID.c_str();
+		Application::SessionPtr session;
+		int sessionID;
+		bool failed = false;
 		
+		try {
+			session = server.pool.get(get.options);
+			server.publishCounters();
+		} catch (const SpawnException &e) {
+			UPDATE_TRACE_POINT();
+			this_thread::disable_syscall_interruption dsi;
+			server.publishCounters();
+			boost::mutex::scoped_lock l(writeLock);
+			
+			if (e.hasErrorPage()) {
+				P_TRACE(3, "Client " << this << ": SpawnException "
+					"occured (with error page)");
+				channel.write(requestID, "SpawnException", e.what(), "true", NULL);
+				channel.writeScalar(e.getErrorPage());
+			} else {
+				P_TRACE(3, "Client " << this << ": SpawnException "
+					"occured (no error page)");
+				channel.write(requestID, "SpawnException", e.what(), "false", NULL);
+			}
+			failed = true;
+		} catch (const BusyException &e) {
+			UPDATE_TRACE_POINT();
+			this_thread::disable_syscall_interruption dsi;
+			server.publishCounters();
+			boost::mutex::scoped_lock l(writeLock);
+			channel.write(requestID, "BusyException", e.what(), NULL);
+			failed = true;
+		} catch (const IOException &e) {
+			UPDATE_TRACE_POINT();
+			this_thread::disable_syscall_interruption dsi;
+			server.publishCounters();
+			boost::mutex::scoped_lock l(writeLock);
+			channel.write(requestID, "IOException", e.what(), NULL);
+			failed = true;
+		}
 		UPDATE_TRACE_POINT();
-		boost::mutex::scoped_lock l(server.lock);
-		ClientPtr myself(self.lock());
-		if (myself != NULL) {
-			server.clients.erase(myself);
+		if (!failed) {
+			this_thread::disable_syscall_interruption dsi;
+			
+			/* sessionsLock is held until we've dropped our reference to
+			 * the session. Otherwise the session might not be closed
+			 * right away if the client closes it immediately.
+			 */
+			boost::mutex::scoped_lock sl(sessionsLock);
+			sessionID = lastSessionID;
+			sessions[sessionID] = session;
+			lastSessionID++;
+			try {
+				UPDATE_TRACE_POINT();
+				boost::mutex::scoped_lock l(writeLock);
+				channel.write(requestID, "ok",
+					toString(session->getPid()).c_str(),
+					toString(sessionID).c_str(), NULL);
+				channel.writeFileDescriptor(session->getStream());
+				session->closeStream();
+				session.reset();
+			} catch (const exception &) {
+				UPDATE_TRACE_POINT();
+				P_TRACE(3, "Client " << this << ": something went wrong "
+					"while sending 'ok' back to the client.");
+				sessions.erase(sessionID);
+				throw;
+			}
 		}
 	}
+};
 
-public:
-	/**
-	 * Create a new Client object.
-	 *
-	 * @param the_server The Server object that this Client belongs to.
-	 * @param connection The connection to the ApplicationPool client.
-	 *
-	 * @note
-	 * <tt>connection</tt> will be closed upon destruction
-	 */
-	Client(Server &the_server, int connection)
-		: server(the_server),
-		  fd(connection),
-		  channel(connection) {
-		thr = NULL;
-		lastSessionID = 0;
+
+void
+Server::workerThreadMain() {
+	TRACE_POINT();
+	try {
+		while (true) {
+			Job job;
+			bool failed = false;
+			bool retire = false;
+			
+			UPDATE_TRACE_POINT();
+			{
+				boost::mutex::scoped_lock l(lock);
+				system_time deadline(get_system_time() +
+					posix_time::seconds(WORKER_IDLE_TIMEOUT));
+				while (jobs.empty() && !shuttingDown && !retire) {
+					bool timedOut;
+					
+					idleWorkers++;
+					try {
+						timedOut = !workAvailable.timed_wait(l, deadline);
+					} catch (...) {
+						idleWorkers--;
+						throw;
+					}
+					idleWorkers--;
+					if (timedOut && jobs.empty()) {
+						if (workerCount > MIN_WORKER_THREADS) {
+							retire = true;
+						} else {
+							deadline = get_system_time() +
+								posix_time::seconds(WORKER_IDLE_TIMEOUT);
+						}
+					}
+				}
+				if (shuttingDown) {
+					break;
+				}
+				if (retire) {
+					workerCount--;
+					retiredWorkers.push_back(boost::this_thread::get_id());
+				} else {
+					job = jobs.front();
+					jobs.pop_front();
+				}
+			}
+			
+			if (retire) {
+				P_TRACE(3, "Worker thread has been idle for " <<
+					WORKER_IDLE_TIMEOUT << " seconds; exiting.");
+				// Let the main thread join this thread.
+				this_thread::disable_syscall_interruption dsi;
+				char x = 'x';
+				syscalls::write(notificationPipe[1], &x, 1);
+				break;
+			}
+			
+			UPDATE_TRACE_POINT();
+			try {
+				job.client->processGet(job);
+			} catch (const tracable_exception &e) {
+				P_TRACE(2, "Uncaught exception in ApplicationPoolServer worker thread:\n"
+					<< "   request ID: " << job.requestID << "\n"
+					<< "   exception: " << e.what() << "\n"
+					<< "   backtrace:\n" << e.backtrace());
+				failed = true;
+			} catch (const exception &e) {
+				P_TRACE(2, "Uncaught exception in ApplicationPoolServer worker thread:\n"
+					<< "   request ID: " << job.requestID << "\n"
+					<< "   exception: " << e.what() << "\n"
+					<< "   backtrace: not available");
+				failed = true;
+			}
+			
+			UPDATE_TRACE_POINT();
+			{
+				boost::mutex::scoped_lock l(lock);
+				if (failed) {
+					job.client->broken = true;
+				}
+				finishedJobs.push_back(job.client);
+			}
+			job.client.reset();
+			
+			this_thread::disable_syscall_interruption dsi;
+			char x = 'x';
+			syscalls::write(notificationPipe[1], &x, 1);
+		}
+	} catch (const boost::thread_interrupted &) {
+		P_TRACE(2, "Worker thread interrupted.");
 	}
+}
+
+/**
+ * Hand the given 'get' request over to a worker thread, starting a new
+ * worker thread if all of them are busy.
+ */
+void
+Server::scheduleGet(const ClientPtr &client, const Job &get) {
+	TRACE_POINT();
+	Job job(get);
+	bool needWorker;
 	
-	/**
-	 * Start the thread for handling the connection with this client.
-	 *
-	 * @param self The iterator of this Client object inside the server's
-	 *        <tt>clients</tt> set. This is used to remove itself from
-	 *        the <tt>clients</tt> set once the client has closed the
-	 *        connection.
-	 */
-	void start(const weak_ptr<Client> self) {
-		stringstream name;
-		name << "Client " << fd;
-		thr = new oxt::thread(
-			bind(&Client::threadMain, this, self),
-			name.str(), CLIENT_THREAD_STACK_SIZE
-		);
+	job.client = client;
+	{
+		boost::mutex::scoped_lock l(lock);
+		jobs.push_back(job);
+		needWorker = jobs.size() > idleWorkers && workerCount < MAX_WORKER_THREADS;
+		workAvailable.notify_one();
 	}
+	if (needWorker) {
+		P_TRACE(3, "All " << workers.size() << " worker threads are busy; "
+			"starting another one.");
+		startWorker();
+	}
+}
+
+/**
+ * Process a connect request from an ApplicationPool client.
+ *
+ * @return False if all web server processes have disconnected.
+ */
+bool
+Server::acceptClient() {
+	TRACE_POINT();
+	int fds[2], ret;
+	char x;
 	
-	~Client() {
-		TRACE_POINT();
-		this_thread::disable_syscall_interruption dsi;
-		this_thread::disable_interruption di;
+	// The received data only serves to wake up the server socket,
+	// and is not important.
+	ret = syscalls::read(serverSocket, &x, 1);
+	if (ret == 0) {
+		// All web server processes disconnected from this server.
+		// So we can safely quit.
+		return false;
+	}
+	
+	this_thread::disable_interruption di;
+	this_thread::disable_syscall_interruption dsi;
+	
+	// We have an incoming connect request from an
+	// ApplicationPool client.
+	UPDATE_TRACE_POINT();
+	do {
+		ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == -1) {
+		UPDATE_TRACE_POINT();
+		throw SystemException("Cannot create an anonymous Unix socket", errno);
+	}
+	
+	UPDATE_TRACE_POINT();
+	MessageChannel(serverSocket).writeFileDescriptor(fds[1]);
+	syscalls::close(fds[1]);
+	
+	UPDATE_TRACE_POINT();
+	ClientPtr client(new Client(*this, fds[0]));
+	clients[fds[0]] = client;
+	poller.add(fds[0]);
+	return true;
+}
+
+/**
+ * Called when the given client connection has become readable.
+ */
+void
+Server::processClientEvent(int fd, vector<ClientPtr> &disconnected) {
+	TRACE_POINT();
+	map<int, ClientPtr>::iterator it = clients.find(fd);
+	
+	if (it == clients.end()) {
+		// This client has been disconnected while processing a
+		// previous event.
+		return;
+	}
+	
+	ClientPtr client(it->second);
+	vector<Job> gets;
+	vector<Job>::const_iterator get;
+	bool keep;
+	
+	keep = client->receive() && client->processMessages(gets);
+	for (get = gets.begin(); get != gets.end(); get++) {
+		scheduleGet(client, *get);
+	}
+	if (!keep) {
+		disconnect(client, disconnected);
+	}
+}
+
+/**
+ * Disconnect the clients to which worker threads failed to send a reply,
+ * release the worker threads' references to clients, and join the worker
+ * threads that have retired.
+ */
+void
+Server::processFinishedJobs(vector<ClientPtr> &disconnected) {
+	TRACE_POINT();
+	vector<ClientPtr> finished;
+	vector<ClientPtr>::iterator it;
+	char buf[64];
+	
+	// Any remaining bytes will make the pipe readable again, which
+	// is harmless.
+	syscalls::read(notificationPipe[0], buf, sizeof(buf));
+	{
+		boost::mutex::scoped_lock l(lock);
+		finished.swap(finishedJobs);
+	}
+	joinRetiredWorkers();
+	
+	for (it = finished.begin(); it != finished.end(); it++) {
+		ClientPtr &client(*it);
+		map<int, ClientPtr>::iterator c = clients.find(client->getFd());
+		bool broken;
 		
-		if (thr != NULL) {
-			if (thr->get_id() != this_thread::get_id()) {
-				thr->interrupt_and_join();
+		UPDATE_TRACE_POINT();
+		{
+			boost::mutex::scoped_lock l(lock);
+			broken = client->broken;
+		}
+		if (broken && c != clients.end() && c->second == client) {
+			disconnect(client, disconnected);
+		} else {
+			disconnected.push_back(client);
+		}
+	}
+}
+
+/**
+ * Join the worker threads that have exited because they were idle for too
+ * long, and remove them from <tt>workers</tt>.
+ */
+void
+Server::joinRetiredWorkers() {
+	TRACE_POINT();
+	vector<boost::thread::id> retired;
+	vector<boost::thread::id>::const_iterator id;
+	vector< shared_ptr<oxt::thread> >::iterator it;
+	
+	{
+		boost::mutex::scoped_lock l(lock);
+		retired.swap(retiredWorkers);
+	}
+	for (id = retired.begin(); id != retired.end(); id++) {
+		for (it = workers.begin(); it != workers.end(); it++) {
+			if ((*it)->get_id() == *id) {
+				// The thread only has to return.
+				(*it)->join();
+				workers.erase(it);
+				break;
 			}
-			delete thr;
 		}
-		syscalls::close(fd);
 	}
-};
+}
 
+/**
+ * Stop watching the given client and remove it from the client list.
+ *
+ * References to clients are released when <tt>disconnected</tt> is
+ * cleared, at the end of an event loop iteration. Until then their file
+ * descriptor numbers can't be reused for new clients, so file descriptors
+ * that were reported as readable during the current iteration can't refer
+ * to the wrong client.
+ */
+void
+Server::disconnect(const ClientPtr &client, vector<ClientPtr> &disconnected) {
+	poller.remove(client->getFd());
+	clients.erase(client->getFd());
+	disconnected.push_back(client);
+}
 
 int
 Server::start() {
@@ -474,49 +1261,42 @@ Server::start() {
 				)
 			);
 		}
+		for (unsigned int i = 0; i < MIN_WORKER_THREADS; i++) {
+			startWorker();
+		}
 		
-		while (!this_thread::interruption_requested()) {
-			int fds[2], ret;
-			char x;
-			
-			// The received data only serves to wake up the server socket,
-			// and is not important.
-			UPDATE_TRACE_POINT();
-			ret = syscalls::read(serverSocket, &x, 1);
-			if (ret == 0) {
-				// All web server processes disconnected from this server.
-				// So we can safely quit.
-				break;
-			}
-			
-			this_thread::disable_interruption di;
-			this_thread::disable_syscall_interruption dsi;
-			
-			// We have an incoming connect request from an
-			// ApplicationPool client.
+		vector<int> ready;
+		vector<int>::const_iterator it;
+		vector<ClientPtr> disconnected;
+		bool done = false;
+		time_t lastPublished = 0;
+		
+		publishStatistics();
+		poller.add(serverSocket);
+		poller.add(notificationPipe[0]);
+		while (!done && !this_thread::interruption_requested()) {
 			UPDATE_TRACE_POINT();
-			do {
-				ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
-			} while (ret == -1 && errno == EINTR);
-			if (ret == -1) {
-				UPDATE_TRACE_POINT();
-				throw SystemException("Cannot create an anonymous Unix socket", errno);
+			poller.wait(ready, STATISTICS_PUBLISH_INTERVAL);
+			for (it = ready.begin(); it != ready.end() && !done; it++) {
+				if (*it == serverSocket) {
+					done = !acceptClient();
+				} else if (*it == notificationPipe[0]) {
+					processFinishedJobs(disconnected);
+				} else {
+					processClientEvent(*it, disconnected);
+				}
 			}
 			
 			UPDATE_TRACE_POINT();
-			MessageChannel(serverSocket).writeFileDescriptor(fds[1]);
-			syscalls::close(fds[1]);
+			disconnected.clear();
 			
-			UPDATE_TRACE_POINT();
-			ClientPtr client(new Client(*this, fds[0]));
-			pair<set<ClientPtr>::iterator, bool> p;
-			{
-				UPDATE_TRACE_POINT();
-				boost::mutex::scoped_lock l(lock);
-				clients.insert(client);
+			// Publish changes that weren't caused by clients, e.g. by
+			// the pool's cleaner thread, and changes that other clients
+			// haven't asked about yet.
+			if (time(NULL) != lastPublished) {
+				publishStatistics();
+				lastPublished = time(NULL);
 			}
-			UPDATE_TRACE_POINT();
-			client->start(client);
 		}
 	} catch (const boost::thread_interrupted &) {
 		P_TRACE(2, "Main thread interrupted.");
@@ -528,7 +1308,8 @@ int
 main(int argc, char *argv[]) {
 	try {
 		Server server(SERVER_SOCKET_FD, atoi(argv[1]),
-			argv[2], argv[3], argv[4], argv[5], argv[6]);
+			argv[2], argv[3], argv[4], argv[5], argv[6],
+			atoi(argv[7]), strcmp(argv[8], "true") == 0, argv[9]);
 		return server.start();
 	} catch (const tracable_exception &e) {
 		P_ERROR(e.what() << "\n" << e.backtrace());
@@ -0,0 +1,629 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_BUFFERED_MESSAGE_CHANNEL_H_
+#define _PASSENGER_BUFFERED_MESSAGE_CHANNEL_H_
+
+#include <boost/noncopyable.hpp>
+#include <oxt/system_calls.hpp>
+
+#include <algorithm>
+#include <string>
+#include <list>
+#include <vector>
+#include <deque>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <cstdarg>
+#include <cstring>
+
+#include "MessageChannel.h"
+#include "StaticString.h"
+#include "Exceptions.h"
+
+namespace Passenger {
+
+using namespace std;
+using namespace oxt;
+
+/**
+ * A variant of MessageChannel which buffers reads and gathers writes,
+ * so that sending or receiving a typical message takes a single system
+ * call. The wire format is exactly the same as MessageChannel's, so it
+ * can talk to MessageChannel and to the Ruby implementation in
+ * <tt>lib/passenger/message_channel.rb</tt>.
+ *
+ * Writes aren't buffered: every write method sends its data with a
+ * single <tt>writev()</tt> call (unless the kernel accepts only part of
+ * it), without copying the message elements into a temporary string.
+ *
+ * Reads go through an internal buffer: as much data as is available is
+ * read at once, and subsequent read calls are served from the buffer.
+ * Because of that, the channel owns the reading side of the file
+ * descriptor: one must not mix reads through a BufferedMessageChannel
+ * with reads through other means. On Unix sockets, the buffer is filled
+ * with <tt>recvmsg()</tt>, so that file descriptors that are passed along
+ * with buffered data are kept until readFileDescriptor() is called.
+ *
+ * Unlike MessageChannel, a BufferedMessageChannel has state, so it must
+ * not be copied, and it should be kept around for as long as the file
+ * descriptor is used. File descriptors that have been received but not
+ * picked up by readFileDescriptor() are closed upon destruction. The
+ * wrapped file descriptor itself is not closed.
+ *
+ * @note BufferedMessageChannel is not thread-safe. However, one thread may
+ *    write while another one reads, as long as there's only one of each.
+ * @see MessageChannel
+ * @ingroup Support
+ */
+class BufferedMessageChannel: public boost::noncopyable {
+private:
+	/** The initial size of the read buffer. */
+	static const unsigned int READ_BUFFER_SIZE = 1024 * 16;
+	
+	/** The maximum number of file descriptors that can be received in one read. */
+	static const unsigned int MAX_RECEIVED_FDS = 16;
+	
+	/** The maximum number of iovecs that is passed to a single writev() call. */
+	static const unsigned int MAX_IOVECS = 64;
+	
+	#ifdef __OpenBSD__
+		typedef u_int32_t uint32_t;
+		typedef u_int16_t uint16_t;
+	#endif
+	
+	int fd;
+	
+	/**
+	 * Buffered data is in <tt>readBuffer[readStart, readEnd)</tt>. The buffer
+	 * is allocated upon the first read.
+	 */
+	vector<char> readBuffer;
+	unsigned int readStart;
+	unsigned int readEnd;
+	
+	/**
+	 * Whether the file descriptor doesn't support recvmsg(), e.g. because
+	 * it's a pipe.
+	 */
+	bool notASocket;
+	
+	/** The frame format that's used for array messages. */
+	unsigned int frameVersion;
+	
+	/** File descriptors that have been received, but not picked up yet. */
+	deque<int> receivedFds;
+	
+	unsigned int buffered() const {
+		return readEnd - readStart;
+	}
+	
+	/**
+	 * Read as much data as is available, but at least one byte, into the
+	 * free space at the end of the read buffer.
+	 *
+	 * @return False on end-of-file.
+	 * @throws SystemException
+	 * @throws boost::thread_interrupted
+	 */
+	bool fillBuffer() {
+		char *dest = &readBuffer[readEnd];
+		size_t size = readBuffer.size() - readEnd;
+		ssize_t ret;
+		
+		if (!notASocket) {
+			struct msghdr msg;
+			struct iovec vec;
+			char controlData[CMSG_SPACE(sizeof(int) * MAX_RECEIVED_FDS)];
+			
+			vec.iov_base = dest;
+			vec.iov_len = size;
+			msg.msg_name = NULL;
+			msg.msg_namelen = 0;
+			msg.msg_iov = &vec;
+			msg.msg_iovlen = 1;
+			msg.msg_control = (caddr_t) controlData;
+			msg.msg_controllen = sizeof(controlData);
+			msg.msg_flags = 0;
+			ret = syscalls::recvmsg(fd, &msg, 0);
+			if (ret == -1 && errno == ENOTSOCK) {
+				notASocket = true;
+			} else if (ret > 0 && msg.msg_controllen > 0) {
+				saveFileDescriptors(msg);
+			}
+		}
+		if (notASocket) {
+			ret = syscalls::read(fd, dest, size);
+		}
+		if (ret == -1) {
+			throw SystemException("read() failed", errno);
+		} else if (ret == 0) {
+			return false;
+		} else {
+			readEnd += ret;
+			return true;
+		}
+	}
+	
+	void saveFileDescriptors(struct msghdr &msg) {
+		struct cmsghdr *header;
+		
+		for (header = CMSG_FIRSTHDR(&msg); header != NULL; header = CMSG_NXTHDR(&msg, header)) {
+			if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+				unsigned int count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				int *fds = (int *) CMSG_DATA(header);
+				for (unsigned int i = 0; i < count; i++) {
+					receivedFds.push_back(fds[i]);
+				}
+			}
+		}
+	}
+	
+	/**
+	 * Make sure that at least <tt>size</tt> bytes are buffered.
+	 *
+	 * @return False if end-of-file was reached before that.
+	 * @throws SystemException
+	 * @throws boost::thread_interrupted
+	 */
+	bool fill(unsigned int size) {
+		if (buffered() >= size) {
+			return true;
+		}
+		if (readStart > 0) {
+			memmove(&readBuffer[0], &readBuffer[readStart], buffered());
+			readEnd -= readStart;
+			readStart = 0;
+		}
+		if (readBuffer.size() > READ_BUFFER_SIZE && max(size, readEnd) <= READ_BUFFER_SIZE) {
+			// The buffer was grown for a message that has been consumed by
+			// now. Give the memory back instead of keeping it for the
+			// lifetime of the connection.
+			vector<char>(readBuffer.begin(), readBuffer.begin() + READ_BUFFER_SIZE).swap(readBuffer);
+		}
+		if (readBuffer.size() < max(size, (unsigned int) READ_BUFFER_SIZE)) {
+			readBuffer.resize(max(size, (unsigned int) READ_BUFFER_SIZE));
+		}
+		while (readEnd < size) {
+			if (!fillBuffer()) {
+				return false;
+			}
+		}
+		return true;
+	}
+	
+	/**
+	 * Consume the next array message from the read buffer. <tt>body</tt> is
+	 * set to the message body, which stays in the buffer until the next
+	 * read operation.
+	 *
+	 * @return False if end-of-file has been reached.
+	 * @throws SystemException
+	 * @throws IOException The body is larger than MessageChannel::MAX_FRAME_SIZE.
+	 * @throws boost::thread_interrupted
+	 */
+	bool readArrayMessageBody(const char *&body, unsigned int &size) {
+		unsigned int headerSize = MessageChannel::frameHeaderSize(frameVersion);
+		
+		if (!fill(headerSize)) {
+			return false;
+		}
+		size = MessageChannel::decodeFrameHeader(&readBuffer[readStart], frameVersion);
+		MessageChannel::checkFrameSize(size);
+		if (!fill(headerSize + size)) {
+			return false;
+		}
+		body = &readBuffer[readStart + headerSize];
+		readStart += headerSize + size;
+		return true;
+	}
+	
+	/**
+	 * Write all data in the given iovecs. <tt>vec</tt> is modified.
+	 *
+	 * @throws SystemException
+	 * @throws boost::thread_interrupted
+	 */
+	void writeAll(struct iovec *vec, unsigned int count) {
+		while (count > 0) {
+			ssize_t ret = syscalls::writev(fd, vec, min(count, (unsigned int) MAX_IOVECS));
+			if (ret == -1) {
+				throw SystemException("writev() failed", errno);
+			}
+			// Skip the iovecs that have been written entirely, and
+			// adjust the one that has been written partially.
+			while (count > 0 && (size_t) ret >= vec->iov_len) {
+				ret -= vec->iov_len;
+				vec++;
+				count--;
+			}
+			if (count > 0) {
+				vec->iov_base = (char *) vec->iov_base + ret;
+				vec->iov_len -= ret;
+			}
+		}
+	}
+	
+	template<typename StringArrayType, typename StringArrayConstIteratorType>
+	void writeArray(const StringArrayType &args) {
+		StringArrayConstIteratorType it;
+		char delimiter = '\0';
+		unsigned int dataSize = 0;
+		string header;
+		vector<struct iovec> vec;
+		struct iovec v;
+		
+		vec.reserve(1 + args.size() * 2);
+		for (it = args.begin(); it != args.end(); it++) {
+			dataSize += it->size() + 1;
+		}
+		MessageChannel::appendFrameHeader(header, dataSize, frameVersion);
+		v.iov_base = (char *) header.data();
+		v.iov_len = header.size();
+		vec.push_back(v);
+		for (it = args.begin(); it != args.end(); it++) {
+			v.iov_base = (char *) it->data();
+			v.iov_len = it->size();
+			vec.push_back(v);
+			v.iov_base = &delimiter;
+			v.iov_len = 1;
+			vec.push_back(v);
+		}
+		writeAll(&vec[0], vec.size());
+	}
+
+public:
+	/**
+	 * Construct a new BufferedMessageChannel with the given file descriptor.
+	 */
+	BufferedMessageChannel(int fd) {
+		this->fd = fd;
+		readStart = 0;
+		readEnd = 0;
+		notASocket = false;
+		frameVersion = MessageChannel::FRAME_VERSION_1;
+	}
+	
+	~BufferedMessageChannel() {
+		this_thread::disable_syscall_interruption dsi;
+		deque<int>::iterator it;
+		for (it = receivedFds.begin(); it != receivedFds.end(); it++) {
+			syscalls::close(*it);
+		}
+	}
+	
+	/**
+	 * @see MessageChannel::getFrameVersion()
+	 */
+	unsigned int getFrameVersion() const {
+		return frameVersion;
+	}
+	
+	/**
+	 * @see MessageChannel::setFrameVersion()
+	 */
+	void setFrameVersion(unsigned int version) {
+		frameVersion = version;
+	}
+	
+	/**
+	 * Negotiate the frame format with the other side of the connection.
+	 *
+	 * @throws SystemException Something went wrong during reading or writing.
+	 * @throws IOException The other side closed the connection, or replied
+	 *                     with something unexpected.
+	 * @throws boost::thread_interrupted
+	 * @see MessageChannel::negotiateFrameVersion()
+	 */
+	unsigned int negotiateFrameVersion(unsigned int maxVersion = MessageChannel::LATEST_FRAME_VERSION) {
+		vector<string> args;
+		
+		write("frame_version", toString(maxVersion).c_str(), NULL);
+		if (!read(args)) {
+			throw IOException("The other side closed the connection while "
+				"negotiating the frame version.");
+		}
+		if (args.size() != 2 || args[0] != "frame_version"
+		 || atoi(args[1]) < (int) MessageChannel::FRAME_VERSION_1
+		 || atoi(args[1]) > (int) maxVersion) {
+			throw IOException("The other side sent an invalid reply while "
+				"negotiating the frame version: " + toString(args));
+		}
+		frameVersion = atoi(args[1]);
+		return frameVersion;
+	}
+	
+	/**
+	 * Reply to a <tt>frame_version</tt> message, and switch to the chosen
+	 * frame format.
+	 *
+	 * @throws SystemException Something went wrong during writing.
+	 * @throws boost::thread_interrupted
+	 * @see MessageChannel::acceptFrameVersion()
+	 */
+	unsigned int acceptFrameVersion(unsigned int proposed) {
+		unsigned int version = MessageChannel::chooseFrameVersion(proposed);
+		write("frame_version", toString(version).c_str(), NULL);
+		frameVersion = version;
+		return version;
+	}
+	
+	/**
+	 * Send an array message with a single system call.
+	 *
+	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws IOException The message is too large for the frame format.
+	 * @throws boost::thread_interrupted
+	 * @pre None of the message elements may contain a NUL character (<tt>'\\0'</tt>).
+	 * @see MessageChannel::write(const vector<string> &)
+	 */
+	void write(const vector<string> &args) {
+		writeArray<vector<string>, vector<string>::const_iterator>(args);
+	}
+	
+	/**
+	 * Send an array message with a single system call.
+	 *
+	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws IOException The message is too large for the frame format.
+	 * @throws boost::thread_interrupted
+	 * @pre None of the message elements may contain a NUL character (<tt>'\\0'</tt>).
+	 * @see MessageChannel::write(const list<string> &)
+	 */
+	void write(const list<string> &args) {
+		writeArray<list<string>, list<string>::const_iterator>(args);
+	}
+	
+	/**
+	 * Send an array message, which consists of the given strings, with a
+	 * single system call. The argument list must be terminated with a NULL.
+	 *
+	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws IOException The message is too large for the frame format.
+	 * @throws boost::thread_interrupted
+	 * @pre None of the message elements may contain a NUL character (<tt>'\\0'</tt>).
+	 * @see MessageChannel::write(const char *, ...)
+	 */
+	void write(const char *name, ...) {
+		struct iovec vec[MAX_IOVECS];
+		unsigned int count = 1;
+		char delimiter = '\0';
+		unsigned int dataSize = 0;
+		string header;
+		const char *arg = name;
+		va_list ap;
+		
+		va_start(ap, name);
+		while (arg != NULL && count + 2 <= MAX_IOVECS) {
+			vec[count].iov_base = (char *) arg;
+			vec[count].iov_len = strlen(arg);
+			vec[count + 1].iov_base = &delimiter;
+			vec[count + 1].iov_len = 1;
+			dataSize += vec[count].iov_len + 1;
+			count += 2;
+			arg = va_arg(ap, const char *);
+		}
+		if (arg != NULL) {
+			// Too many elements to fit in the iovec array.
+			list<string> args;
+			for (unsigned int i = 1; i < count; i += 2) {
+				args.push_back((const char *) vec[i].iov_base);
+			}
+			for (; arg != NULL; arg = va_arg(ap, const char *)) {
+				args.push_back(arg);
+			}
+			va_end(ap);
+			write(args);
+			return;
+		}
+		va_end(ap);
+		
+		MessageChannel::appendFrameHeader(header, dataSize, frameVersion);
+		vec[0].iov_base = (char *) header.data();
+		vec[0].iov_len = header.size();
+		writeAll(vec, count);
+	}
+	
+	/**
+	 * Send a scalar message with a single system call.
+	 *
+	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws boost::thread_interrupted
+	 * @see MessageChannel::writeScalar()
+	 */
+	void writeScalar(const char *data, unsigned int size) {
+		uint32_t l = htonl(size);
+		struct iovec vec[2];
+		
+		vec[0].iov_base = (char *) &l;
+		vec[0].iov_len = sizeof(l);
+		vec[1].iov_base = (char *) data;
+		vec[1].iov_len = size;
+		writeAll(vec, 2);
+	}
+	
+	void writeScalar(const string &str) {
+		writeScalar(str.data(), str.size());
+	}
+	
+	/**
+	 * Send a block of data. This method blocks until everything is sent.
+	 *
+	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws boost::thread_interrupted
+	 */
+	void writeRaw(const char *data, unsigned int size) {
+		MessageChannel(fd).writeRaw(data, size);
+	}
+	
+	void writeRaw(const string &data) {
+		writeRaw(data.data(), data.size());
+	}
+	
+	/**
+	 * Pass a file descriptor. This only works if the underlying file
+	 * descriptor is a Unix socket.
+	 *
+	 * @throws SystemException Something went wrong during file descriptor passing.
+	 * @throws boost::thread_interrupted
+	 * @see MessageChannel::writeFileDescriptor()
+	 */
+	void writeFileDescriptor(int fileDescriptor) {
+		MessageChannel(fd).writeFileDescriptor(fileDescriptor);
+	}
+	
+	/**
+	 * Read an array message.
+	 *
+	 * @return Whether end-of-file has been reached. If so, then the contents
+	 *         of <tt>args</tt> will be undefined.
+	 * @throws SystemException If an error occured while receiving the message.
+	 * @throws IOException The message is larger than MessageChannel::MAX_FRAME_SIZE.
+	 * @throws boost::thread_interrupted
+	 * @see MessageChannel::read()
+	 */
+	bool read(vector<string> &args) {
+		const char *body;
+		unsigned int size;
+		
+		if (!readArrayMessageBody(body, size)) {
+			return false;
+		}
+		MessageChannel::parseArrayMessage(body, size, args);
+		return true;
+	}
+	
+	/**
+	 * Read an array message, without copying its elements. The elements
+	 * in <tt>args</tt> point into the read buffer: they stay valid until
+	 * the next read operation on this channel, or until it's destroyed.
+	 *
+	 * @return Whether end-of-file has been reached. If so, then the contents
+	 *         of <tt>args</tt> will be undefined.
+	 * @throws SystemException If an error occured while receiving the message.
+	 * @throws IOException The message is larger than MessageChannel::MAX_FRAME_SIZE.
+	 * @throws boost::thread_interrupted
+	 * @see MessageChannel::read(vector<StaticString> &)
+	 */
+	bool read(vector<StaticString> &args) {
+		const char *body;
+		unsigned int size;
+		
+		if (!readArrayMessageBody(body, size)) {
+			return false;
+		}
+		MessageChannel::parseArrayMessage(body, size, args);
+		return true;
+	}
+	
+	/**
+	 * Read exactly <tt>size</tt> bytes of data.
+	 *
+	 * @return Whether reading was successful or whether EOF was reached.
+	 * @throws SystemException Something went wrong during reading.
+	 * @throws boost::thread_interrupted
+	 * @see MessageChannel::readRaw()
+	 */
+	bool readRaw(void *buf, unsigned int size) {
+		unsigned int fromBuffer = min(size, buffered());
+		
+		if (fromBuffer > 0) {
+			memcpy(buf, &readBuffer[readStart], fromBuffer);
+			readStart += fromBuffer;
+		}
+		// Read the rest directly into the caller's buffer, so that we
+		// don't read past the requested data.
+		return fromBuffer == size
+			|| MessageChannel(fd).readRaw((char *) buf + fromBuffer, size - fromBuffer);
+	}
+	
+	/**
+	 * Read a scalar message.
+	 *
+	 * @returns Whether end-of-file was reached during reading.
+	 * @throws SystemException An error occured while reading the data.
+	 * @throws IOException The message is larger than MessageChannel::MAX_FRAME_SIZE.
+	 * @throws boost::thread_interrupted
+	 * @see MessageChannel::readScalar()
+	 */
+	bool readScalar(string &output) {
+		uint32_t size;
+		
+		if (!fill(sizeof(size))) {
+			return false;
+		}
+		memcpy(&size, &readBuffer[readStart], sizeof(size));
+		readStart += sizeof(size);
+		size = ntohl(size);
+		MessageChannel::checkFrameSize(size);
+		
+		output.resize(size);
+		return size == 0 || readRaw(&output[0], size);
+	}
+	
+	/**
+	 * Receive a file descriptor, which had been passed over the underlying
+	 * file descriptor.
+	 *
+	 * @throws SystemException If something went wrong during the
+	 *            receiving of a file descriptor. Perhaps the underlying
+	 *            file descriptor isn't a Unix socket.
+	 * @throws IOException Whatever was received doesn't seem to be a
+	 *            file descriptor.
+	 * @throws boost::thread_interrupted
+	 * @see MessageChannel::readFileDescriptor()
+	 */
+	int readFileDescriptor() {
+		// A passed file descriptor is accompanied by a single dummy byte.
+		if (!fill(1)) {
+			throw IOException("No valid file descriptor received.");
+		}
+		readStart++;
+		if (receivedFds.empty()) {
+			throw IOException("No valid file descriptor received.");
+		}
+		int result = receivedFds.front();
+		receivedFds.pop_front();
+		return result;
+	}
+	
+	/**
+	 * @see MessageChannel::setReadTimeout()
+	 */
+	void setReadTimeout(unsigned int msec) {
+		MessageChannel(fd).setReadTimeout(msec);
+	}
+	
+	/**
+	 * @see MessageChannel::setWriteTimeout()
+	 */
+	void setWriteTimeout(unsigned int msec) {
+		MessageChannel(fd).setWriteTimeout(msec);
+	}
+};
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_BUFFERED_MESSAGE_CHANNEL_H_ */
@@ -31,6 +31,7 @@ extern "C" module AP_MODULE_DECLARE_DATA passenger_module;
 #define DEFAULT_MAX_POOL_SIZE 6
 #define DEFAULT_POOL_IDLE_TIME 300
 #define DEFAULT_MAX_INSTANCES_PER_APP 0
+#define DEFAULT_MAX_CONCURRENT_SPAWNS 1
 
 
 template<typename T> static apr_status_t
@@ -73,8 +74,23 @@ passenger_config_create_dir(apr_pool_t *p, char *dirspec) {
 	config->maxRequestsSpecified = false;
 	config->memoryLimit = 0;
 	config->memoryLimitSpecified = false;
+	config->minInstances = 0;
+	config->minInstancesSpecified = false;
+	config->statThrottleRate = 0;
+	config->statThrottleRateSpecified = false;
+	config->rollingRestartConcurrency = 0;
+	config->rollingRestartConcurrencySpecified = false;
+	config->maxQueueLength = 0;
+	config->maxQueueLengthSpecified = false;
+	config->maxQueueTime = 0;
+	config->maxQueueTimeSpecified = false;
+	config->poolWeight = 1;
+	config->poolWeightSpecified = false;
+	config->instanceConcurrency = 1;
+	config->instanceConcurrencySpecified = false;
 	config->highPerformance = DirConfig::UNSET;
 	config->useGlobalQueue = DirConfig::UNSET;
+	config->predictiveSpawning = DirConfig::UNSET;
 	return config;
 }
 
@@ -109,8 +125,23 @@ passenger_config_merge_dir(apr_pool_t *p, void *basev, void *addv) {
 	config->maxRequestsSpecified = base->maxRequestsSpecified || add->maxRequestsSpecified;
 	config->memoryLimit = (add->memoryLimitSpecified) ? add->memoryLimit : base->memoryLimit;
 	config->memoryLimitSpecified = base->memoryLimitSpecified || add->memoryLimitSpecified;
+	config->minInstances = (add->minInstancesSpecified) ? add->minInstances : base->minInstances;
+	config->minInstancesSpecified = base->minInstancesSpecified || add->minInstancesSpecified;
+	config->statThrottleRate = (add->statThrottleRateSpecified) ? add->statThrottleRate : base->statThrottleRate;
+	config->statThrottleRateSpecified = base->statThrottleRateSpecified || add->statThrottleRateSpecified;
+	config->rollingRestartConcurrency = (add->rollingRestartConcurrencySpecified) ? add->rollingRestartConcurrency : base->rollingRestartConcurrency;
+	config->rollingRestartConcurrencySpecified = base->rollingRestartConcurrencySpecified || add->rollingRestartConcurrencySpecified;
+	config->maxQueueLength = (add->maxQueueLengthSpecified) ? add->maxQueueLength : base->maxQueueLength;
+	config->maxQueueLengthSpecified = base->maxQueueLengthSpecified || add->maxQueueLengthSpecified;
+	config->maxQueueTime = (add->maxQueueTimeSpecified) ? add->maxQueueTime : base->maxQueueTime;
+	config->maxQueueTimeSpecified = base->maxQueueTimeSpecified || add->maxQueueTimeSpecified;
+	config->poolWeight = (add->poolWeightSpecified) ? add->poolWeight : base->poolWeight;
+	config->poolWeightSpecified = base->poolWeightSpecified || add->poolWeightSpecified;
+	config->instanceConcurrency = (add->instanceConcurrencySpecified) ? add->instanceConcurrency : base->instanceConcurrency;
+	config->instanceConcurrencySpecified = base->instanceConcurrencySpecified || add->instanceConcurrencySpecified;
 	config->highPerformance = (add->highPerformance == DirConfig::UNSET) ? base->highPerformance : add->highPerformance;
 	config->useGlobalQueue = (add->useGlobalQueue == DirConfig::UNSET) ? base->useGlobalQueue : add->useGlobalQueue;
+	config->predictiveSpawning = (add->predictiveSpawning == DirConfig::UNSET) ? base->predictiveSpawning : add->predictiveSpawning;
 	return config;
 }
 
@@ -126,8 +157,12 @@ passenger_config_create_server(apr_pool_t *p, server_rec *s) {
 	config->maxInstancesPerAppSpecified = false;
 	config->poolIdleTime = DEFAULT_POOL_IDLE_TIME;
 	config->poolIdleTimeSpecified = false;
+	config->maxConcurrentSpawns = DEFAULT_MAX_CONCURRENT_SPAWNS;
+	config->maxConcurrentSpawnsSpecified = false;
 	config->userSwitching = true;
 	config->userSwitchingSpecified = false;
+	config->watchRestartFiles = false;
+	config->watchRestartFilesSpecified = false;
 	config->defaultUser = NULL;
 	return config;
 }
@@ -147,8 +182,12 @@ passenger_config_merge_server(apr_pool_t *p, void *basev, void *addv) {
 	config->maxInstancesPerAppSpecified = base->maxInstancesPerAppSpecified || add->maxInstancesPerAppSpecified;
 	config->poolIdleTime = (add->poolIdleTime) ? base->poolIdleTime : add->poolIdleTime;
 	config->poolIdleTimeSpecified = base->poolIdleTimeSpecified || add->poolIdleTimeSpecified;
+	config->maxConcurrentSpawns = (add->maxConcurrentSpawnsSpecified) ? add->maxConcurrentSpawns : base->maxConcurrentSpawns;
+	config->maxConcurrentSpawnsSpecified = base->maxConcurrentSpawnsSpecified || add->maxConcurrentSpawnsSpecified;
 	config->userSwitching = (add->userSwitchingSpecified) ? add->userSwitching : base->userSwitching;
 	config->userSwitchingSpecified = base->userSwitchingSpecified || add->userSwitchingSpecified;
+	config->watchRestartFiles = (add->watchRestartFilesSpecified) ? add->watchRestartFiles : base->watchRestartFiles;
+	config->watchRestartFilesSpecified = base->watchRestartFilesSpecified || add->watchRestartFilesSpecified;
 	config->defaultUser = (add->defaultUser == NULL) ? base->defaultUser : add->defaultUser;
 	return config;
 }
@@ -169,8 +208,12 @@ passenger_config_merge_all_servers(apr_pool_t *pool, server_rec *main_server) {
 		final->maxInstancesPerAppSpecified = final->maxInstancesPerAppSpecified || config->maxInstancesPerAppSpecified;
 		final->poolIdleTime = (final->poolIdleTimeSpecified) ? final->poolIdleTime : config->poolIdleTime;
 		final->poolIdleTimeSpecified = final->poolIdleTimeSpecified || config->poolIdleTimeSpecified;
+		final->maxConcurrentSpawns = (final->maxConcurrentSpawnsSpecified) ? final->maxConcurrentSpawns : config->maxConcurrentSpawns;
+		final->maxConcurrentSpawnsSpecified = final->maxConcurrentSpawnsSpecified || config->maxConcurrentSpawnsSpecified;
 		final->userSwitching = (config->userSwitchingSpecified) ? config->userSwitching : final->userSwitching;
 		final->userSwitchingSpecified = final->userSwitchingSpecified || config->userSwitchingSpecified;
+		final->watchRestartFiles = (config->watchRestartFilesSpecified) ? config->watchRestartFiles : final->watchRestartFiles;
+		final->watchRestartFilesSpecified = final->watchRestartFilesSpecified || config->watchRestartFilesSpecified;
 		final->defaultUser = (final->defaultUser != NULL) ? final->defaultUser : config->defaultUser;
 	}
 	for (s = main_server; s != NULL; s = s->next) {
@@ -273,6 +316,25 @@ cmd_passenger_pool_idle_time(cmd_parms *cmd, void *pcfg, const char *arg) {
 	}
 }
 
+static const char *
+cmd_passenger_max_concurrent_spawns(cmd_parms *cmd, void *pcfg, const char *arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerMaxConcurrentSpawns.";
+	} else if (result <= 0) {
+		return "Value for PassengerMaxConcurrentSpawns must be greater than 0.";
+	} else {
+		config->maxConcurrentSpawns = (unsigned int) result;
+		config->maxConcurrentSpawnsSpecified = true;
+		return NULL;
+	}
+}
+
 static const char *
 cmd_passenger_use_global_queue(cmd_parms *cmd, void *pcfg, int arg) {
 	DirConfig *config = (DirConfig *) pcfg;
@@ -284,6 +346,17 @@ cmd_passenger_use_global_queue(cmd_parms *cmd, void *pcfg, int arg) {
 	return NULL;
 }
 
+static const char *
+cmd_passenger_predictive_spawning(cmd_parms *cmd, void *pcfg, int arg) {
+	DirConfig *config = (DirConfig *) pcfg;
+	if (arg) {
+		config->predictiveSpawning = DirConfig::ENABLED;
+	} else {
+		config->predictiveSpawning = DirConfig::DISABLED;
+	}
+	return NULL;
+}
+
 static const char *
 cmd_passenger_user_switching(cmd_parms *cmd, void *pcfg, int arg) {
 	ServerConfig *config = (ServerConfig *) ap_get_module_config(
@@ -293,6 +366,15 @@ cmd_passenger_user_switching(cmd_parms *cmd, void *pcfg, int arg) {
 	return NULL;
 }
 
+static const char *
+cmd_passenger_watch_restart_files(cmd_parms *cmd, void *pcfg, int arg) {
+	ServerConfig *config = (ServerConfig *) ap_get_module_config(
+		cmd->server->module_config, &passenger_module);
+	config->watchRestartFiles = arg;
+	config->watchRestartFilesSpecified = true;
+	return NULL;
+}
+
 static const char *
 cmd_passenger_default_user(cmd_parms *cmd, void *dummy, const char *arg) {
 	ServerConfig *config = (ServerConfig *) ap_get_module_config(
@@ -319,6 +401,150 @@ cmd_passenger_max_requests(cmd_parms *cmd, void *pcfg, const char *arg) {
 	}
 }
 
+static const char *
+cmd_passenger_min_instances(cmd_parms *cmd, void *pcfg, const char *arg) {
+	DirConfig *config = (DirConfig *) pcfg;
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerMinInstances.";
+	} else if (result < 0) {
+		return "Value for PassengerMinInstances must be greater than or equal to 0.";
+	} else {
+		config->minInstances = (unsigned long) result;
+		config->minInstancesSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_memory_limit(cmd_parms *cmd, void *pcfg, const char *arg) {
+	DirConfig *config = (DirConfig *) pcfg;
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerMemoryLimit.";
+	} else if (result < 0) {
+		return "Value for PassengerMemoryLimit must be greater than or equal to 0.";
+	} else {
+		config->memoryLimit = (unsigned long) result;
+		config->memoryLimitSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_stat_throttle_rate(cmd_parms *cmd, void *pcfg, const char *arg) {
+	DirConfig *config = (DirConfig *) pcfg;
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerStatThrottleRate.";
+	} else if (result < 0) {
+		return "Value for PassengerStatThrottleRate must be greater than or equal to 0.";
+	} else {
+		config->statThrottleRate = (unsigned long) result;
+		config->statThrottleRateSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_rolling_restart_concurrency(cmd_parms *cmd, void *pcfg, const char *arg) {
+	DirConfig *config = (DirConfig *) pcfg;
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerRollingRestartConcurrency.";
+	} else if (result < 0) {
+		return "Value for PassengerRollingRestartConcurrency must be greater than or equal to 0.";
+	} else {
+		config->rollingRestartConcurrency = (unsigned long) result;
+		config->rollingRestartConcurrencySpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_max_request_queue_length(cmd_parms *cmd, void *pcfg, const char *arg) {
+	DirConfig *config = (DirConfig *) pcfg;
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerMaxRequestQueueLength.";
+	} else if (result < 0) {
+		return "Value for PassengerMaxRequestQueueLength must be greater than or equal to 0.";
+	} else {
+		config->maxQueueLength = (unsigned long) result;
+		config->maxQueueLengthSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_max_request_queue_time(cmd_parms *cmd, void *pcfg, const char *arg) {
+	DirConfig *config = (DirConfig *) pcfg;
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerMaxRequestQueueTime.";
+	} else if (result < 0) {
+		return "Value for PassengerMaxRequestQueueTime must be greater than or equal to 0.";
+	} else {
+		config->maxQueueTime = (unsigned long) result;
+		config->maxQueueTimeSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_pool_weight(cmd_parms *cmd, void *pcfg, const char *arg) {
+	DirConfig *config = (DirConfig *) pcfg;
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerPoolWeight.";
+	} else if (result < 1) {
+		return "Value for PassengerPoolWeight must be greater than or equal to 1.";
+	} else {
+		config->poolWeight = (unsigned long) result;
+		config->poolWeightSpecified = true;
+		return NULL;
+	}
+}
+
+static const char *
+cmd_passenger_instance_concurrency(cmd_parms *cmd, void *pcfg, const char *arg) {
+	DirConfig *config = (DirConfig *) pcfg;
+	char *end;
+	long int result;
+	
+	result = strtol(arg, &end, 10);
+	if (*end != '\0') {
+		return "Invalid number specified for PassengerInstanceConcurrency.";
+	} else if (result < 1) {
+		return "Value for PassengerInstanceConcurrency must be greater than or equal to 1.";
+	} else {
+		config->instanceConcurrency = (unsigned long) result;
+		config->instanceConcurrencySpecified = true;
+		return NULL;
+	}
+}
+
 static const char *
 cmd_passenger_high_performance(cmd_parms *cmd, void *pcfg, int arg) {
 	DirConfig *config = (DirConfig *) pcfg;
@@ -519,6 +745,11 @@ const command_rec passenger_commands[] = {
 		NULL,
 		RSRC_CONF,
 		"The maximum number of seconds that an application may be idle before it gets terminated."),
+	AP_INIT_TAKE1("PassengerMaxConcurrentSpawns",
+		(Take1Func) cmd_passenger_max_concurrent_spawns,
+		NULL,
+		RSRC_CONF,
+		"The maximum number of application instances that may be spawned concurrently."),
 	AP_INIT_FLAG("PassengerUseGlobalQueue",
 		(Take1Func) cmd_passenger_use_global_queue,
 		NULL,
@@ -529,6 +760,11 @@ const command_rec passenger_commands[] = {
 		NULL,
 		RSRC_CONF,
 		"Whether to enable user switching support."),
+	AP_INIT_FLAG("PassengerWatchRestartFiles",
+		(Take1Func) cmd_passenger_watch_restart_files,
+		NULL,
+		RSRC_CONF,
+		"Whether to watch applications' tmp directories for changes to restart.txt."),
 	AP_INIT_TAKE1("PassengerDefaultUser",
 		(Take1Func) cmd_passenger_default_user,
 		NULL,
@@ -539,6 +775,51 @@ const command_rec passenger_commands[] = {
 		NULL,
 		OR_LIMIT | ACCESS_CONF | RSRC_CONF,
 		"The maximum number of requests that an application instance may process."),
+	AP_INIT_TAKE1("PassengerMinInstances",
+		(Take1Func) cmd_passenger_min_instances,
+		NULL,
+		OR_LIMIT | ACCESS_CONF | RSRC_CONF,
+		"The minimum number of application instances to keep around for an application."),
+	AP_INIT_TAKE1("PassengerMemoryLimit",
+		(Take1Func) cmd_passenger_memory_limit,
+		NULL,
+		OR_LIMIT | ACCESS_CONF | RSRC_CONF,
+		"The maximum amount of memory in MB that an application instance may use."),
+	AP_INIT_TAKE1("PassengerStatThrottleRate",
+		(Take1Func) cmd_passenger_stat_throttle_rate,
+		NULL,
+		OR_LIMIT | ACCESS_CONF | RSRC_CONF,
+		"The minimum number of seconds between two checks of an application's restart.txt."),
+	AP_INIT_TAKE1("PassengerRollingRestartConcurrency",
+		(Take1Func) cmd_passenger_rolling_restart_concurrency,
+		NULL,
+		OR_LIMIT | ACCESS_CONF | RSRC_CONF,
+		"The maximum number of replacement instances to spawn concurrently when restarting an application."),
+	AP_INIT_TAKE1("PassengerMaxRequestQueueLength",
+		(Take1Func) cmd_passenger_max_request_queue_length,
+		NULL,
+		OR_LIMIT | ACCESS_CONF | RSRC_CONF,
+		"The maximum number of requests that may be waiting for an application instance."),
+	AP_INIT_TAKE1("PassengerMaxRequestQueueTime",
+		(Take1Func) cmd_passenger_max_request_queue_time,
+		NULL,
+		OR_LIMIT | ACCESS_CONF | RSRC_CONF,
+		"The maximum number of milliseconds that a request may be waiting for an application instance."),
+	AP_INIT_TAKE1("PassengerPoolWeight",
+		(Take1Func) cmd_passenger_pool_weight,
+		NULL,
+		OR_LIMIT | ACCESS_CONF | RSRC_CONF,
+		"The application's weight when the pool's capacity is divided among applications."),
+	AP_INIT_TAKE1("PassengerInstanceConcurrency",
+		(Take1Func) cmd_passenger_instance_concurrency,
+		NULL,
+		OR_LIMIT | ACCESS_CONF | RSRC_CONF,
+		"The number of requests that each application instance can handle concurrently."),
+	AP_INIT_FLAG("PassengerPredictiveSpawning",
+		(Take1Func) cmd_passenger_predictive_spawning,
+		NULL,
+		OR_LIMIT | ACCESS_CONF | RSRC_CONF,
+		"Enable or disable spawning application instances ahead of predicted demand."),
 	AP_INIT_FLAG("PassengerHighPerformance", // TODO: document this
 		(Take1Func) cmd_passenger_high_performance,
 		NULL,
@@ -117,11 +117,87 @@
 			 * in the directory configuration. */
 			bool memoryLimitSpecified;
 			
+			/**
+			 * The minimum number of application instances that should be kept
+			 * around for the application. A value of 0 means no minimum.
+			 */
+			unsigned long minInstances;
+			
+			/** Indicates whether the minInstances option was explicitly specified
+			 * in the directory configuration. */
+			bool minInstancesSpecified;
+			
+			/**
+			 * The minimum number of seconds between two checks of an
+			 * application's restart.txt. A value of 0 means that it's
+			 * checked on every request.
+			 */
+			unsigned long statThrottleRate;
+			
+			/** Indicates whether the statThrottleRate option was explicitly
+			 * specified in the directory configuration. */
+			bool statThrottleRateSpecified;
+			
+			/**
+			 * The maximum number of replacement instances that may be
+			 * spawned concurrently during a rolling restart. A value of 0
+			 * means that rolling restarts are disabled.
+			 */
+			unsigned long rollingRestartConcurrency;
+			
+			/** Indicates whether the rollingRestartConcurrency option was
+			 * explicitly specified in the directory configuration. */
+			bool rollingRestartConcurrencySpecified;
+			
+			/**
+			 * The maximum number of requests that may be waiting for an
+			 * application instance. A value of 0 means unlimited.
+			 */
+			unsigned long maxQueueLength;
+			
+			/** Indicates whether the maxQueueLength option was explicitly
+			 * specified in the directory configuration. */
+			bool maxQueueLengthSpecified;
+			
+			/**
+			 * The maximum number of milliseconds that a request may be
+			 * waiting for an application instance. A value of 0 means
+			 * unlimited.
+			 */
+			unsigned long maxQueueTime;
+			
+			/** Indicates whether the maxQueueTime option was explicitly
+			 * specified in the directory configuration. */
+			bool maxQueueTimeSpecified;
+			
+			/**
+			 * The application's weight when the pool's capacity is
+			 * divided among applications. At least 1.
+			 */
+			unsigned long poolWeight;
+			
+			/** Indicates whether the poolWeight option was explicitly
+			 * specified in the directory configuration. */
+			bool poolWeightSpecified;
+			
+			/**
+			 * The number of sessions that each application instance can
+			 * handle concurrently. At least 1.
+			 */
+			unsigned long instanceConcurrency;
+			
+			/** Indicates whether the instanceConcurrency option was
+			 * explicitly specified in the directory configuration. */
+			bool instanceConcurrencySpecified;
+			
 			Threeway highPerformance;
 			
 			/** Whether global queuing should be used. */
 			Threeway useGlobalQueue;
 			
+			/** Whether instances should be spawned ahead of predicted demand. */
+			Threeway predictiveSpawning;
+			
 			bool isEnabled() const {
 				return enabled != DISABLED;
 			}
@@ -163,11 +239,67 @@
 				}
 			}
 			
+			unsigned long getMinInstances() {
+				if (minInstancesSpecified) {
+					return minInstances;
+				} else {
+					return 0;
+				}
+			}
+			
+			unsigned long getStatThrottleRate() {
+				if (statThrottleRateSpecified) {
+					return statThrottleRate;
+				} else {
+					return 0;
+				}
+			}
+			
+			unsigned long getRollingRestartConcurrency() {
+				if (rollingRestartConcurrencySpecified) {
+					return rollingRestartConcurrency;
+				} else {
+					return 0;
+				}
+			}
+			
+			unsigned long getMaxQueueLength() {
+				if (maxQueueLengthSpecified) {
+					return maxQueueLength;
+				} else {
+					return 0;
+				}
+			}
+			
+			unsigned long getMaxQueueTime() {
+				if (maxQueueTimeSpecified) {
+					return maxQueueTime;
+				} else {
+					return 0;
+				}
+			}
+			
+			unsigned long getPoolWeight() {
+				if (poolWeightSpecified) {
+					return poolWeight;
+				} else {
+					return 1;
+				}
+			}
+			
+			unsigned long getInstanceConcurrency() {
+				if (instanceConcurrencySpecified) {
+					return instanceConcurrency;
+				} else {
+					return 1;
+				}
+			}
+			
 			unsigned long getMemoryLimit() {
 				if (memoryLimitSpecified) {
 					return memoryLimit;
 				} else {
-					return 200;
+					return 0;
 				}
 			}
 			
@@ -178,6 +310,10 @@
 			bool usingGlobalQueue() const {
 				return useGlobalQueue == ENABLED;
 			}
+			
+			bool usingPredictiveSpawning() const {
+				return predictiveSpawning == ENABLED;
+			}
 		};
 		
 		/**
@@ -220,12 +356,28 @@
 			 * this server config. */
 			bool poolIdleTimeSpecified;
 			
+			/** The maximum number of application instances that may be
+			 * spawned concurrently. */
+			unsigned int maxConcurrentSpawns;
+			
+			/** Whether the maxConcurrentSpawns option was explicitly specified in
+			 * this server config. */
+			bool maxConcurrentSpawnsSpecified;
+			
 			/** Whether user switching support is enabled. */
 			bool userSwitching;
 			
 			/** Whether the userSwitching option was explicitly specified in
 			 * this server config. */
 			bool userSwitchingSpecified;
+			
+			/** Whether applications' tmp directories should be watched for
+			 * changes to restart.txt, instead of being checked on requests. */
+			bool watchRestartFiles;
+			
+			/** Whether the watchRestartFiles option was explicitly specified in
+			 * this server config. */
+			bool watchRestartFilesSpecified;
 
 			/** The user that applications must run as if user switching
 			 * fails or is disabled. NULL means the option is not specified.
@@ -0,0 +1,132 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_EVICTION_POLICY_H_
+#define _PASSENGER_EVICTION_POLICY_H_
+
+#include <boost/shared_ptr.hpp>
+
+namespace Passenger {
+
+using namespace boost;
+
+/**
+ * What an application pool knows about an idle application instance that
+ * could be shut down in order to make room for another one.
+ */
+struct EvictionCandidate {
+	/**
+	 * The number of seconds that it took to spawn an instance of the
+	 * application, averaged over recent spawns. 0 if unknown.
+	 */
+	double spawnTime;
+	
+	/**
+	 * The number of requests per second that the application has recently
+	 * received, over all of its instances.
+	 */
+	double requestRate;
+	
+	/** The number of seconds that the instance has been idle. */
+	double idleTime;
+	
+	/** The number of instances of the application in the pool. */
+	unsigned int instances;
+	
+	EvictionCandidate() {
+		spawnTime = 0;
+		requestRate = 0;
+		idleTime = 0;
+		instances = 0;
+	}
+};
+
+/**
+ * Decides which idle application instance an application pool should shut
+ * down when the pool is full and another application needs a slot.
+ *
+ * The pool asks the policy to score every candidate, and shuts down the one
+ * with the lowest score. Candidates are offered in order of last use, least
+ * recently used first; if several candidates have the lowest score, then the
+ * least recently used one is shut down.
+ *
+ * Policies must be thread-safe: they may be consulted from multiple threads,
+ * though always while the pool is locked.
+ *
+ * @ingroup Support
+ */
+class EvictionPolicy {
+public:
+	virtual ~EvictionPolicy() { }
+	
+	/**
+	 * Returns how valuable it is to keep the given candidate in the pool.
+	 * Only the order of the returned values is significant.
+	 */
+	virtual double keepValue(const EvictionCandidate &candidate) const = 0;
+};
+
+typedef shared_ptr<EvictionPolicy> EvictionPolicyPtr;
+
+/**
+ * Always shuts down the least recently used instance.
+ *
+ * @ingroup Support
+ */
+class LruEvictionPolicy: public EvictionPolicy {
+public:
+	virtual double keepValue(const EvictionCandidate &candidate) const {
+		return -candidate.idleTime;
+	}
+};
+
+/**
+ * Shuts down the instance whose application is the cheapest to bring back.
+ *
+ * A candidate's value is the time that would be spent on respawning it,
+ * multiplied by how often it's needed, i.e. by its application's recent
+ * request rate per instance. The request rate decays while the application
+ * is idle, so an application that takes 30 seconds to start is kept in favor
+ * of one that starts in a second, unless the former is used 30 times less
+ * often. If the spawn time is unknown, then one second is assumed; if the
+ * request rate is unknown, then the inverse of the idle time is used.
+ *
+ * @ingroup Support
+ */
+class SpawnCostEvictionPolicy: public EvictionPolicy {
+public:
+	virtual double keepValue(const EvictionCandidate &candidate) const {
+		double spawnTime = candidate.spawnTime;
+		double usage;
+		
+		if (spawnTime <= 0) {
+			spawnTime = 1.0;
+		}
+		if (candidate.requestRate > 0 && candidate.instances > 0) {
+			usage = candidate.requestRate / candidate.instances;
+		} else {
+			usage = 1.0 / (candidate.idleTime + 1.0);
+		}
+		return spawnTime * usage;
+	}
+};
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_EVICTION_POLICY_H_ */
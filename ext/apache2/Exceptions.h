@@ -144,6 +144,18 @@ public:
 	virtual const char *what() const throw() { return msg.c_str(); }
 };
 
+/**
+ * Thrown when an I/O operation could not be completed within the
+ * allotted time.
+ *
+ * @ingroup Exceptions
+ */
+class TimeoutException: public IOException {
+public:
+	TimeoutException(const string &message): IOException(message) {}
+	virtual ~TimeoutException() throw() {}
+};
+
 /**
  * Thrown when a certain file cannot be found.
  */
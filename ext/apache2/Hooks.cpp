@@ -398,7 +398,15 @@ private:
 					config->appSpawnerTimeout,
 					config->getMaxRequests(),
 					config->getMemoryLimit(),
-					config->usingGlobalQueue()));
+					config->usingGlobalQueue(),
+					config->getMinInstances(),
+					config->getStatThrottleRate(),
+					config->getRollingRestartConcurrency(),
+					config->getMaxQueueLength(),
+					config->getMaxQueueTime(),
+					config->getPoolWeight(),
+					config->getInstanceConcurrency(),
+					config->usingPredictiveSpawning()));
 				P_TRACE(3, "Forwarding " << r->uri << " to PID " << session->getPid());
 			} catch (const SpawnException &e) {
 				r->status = 500;
@@ -462,6 +470,11 @@ private:
 				e.backtrace());
 			return HTTP_INTERNAL_SERVER_ERROR;
 			
+		} catch (const TimeoutException &e) {
+			P_ERROR("Timeout while forwarding " << r->uri << " to the application: " <<
+				e.what());
+			return HTTP_GATEWAY_TIME_OUT;
+			
 		} catch (const tracable_exception &e) {
 			P_ERROR("Unexpected error in mod_passenger: " <<
 				e.what() << "\n" << "  Backtrace:\n" << e.backtrace());
@@ -616,7 +629,8 @@ private:
 		 */
 		buffer.append("_\0_\0", 4);
 		
-		session->sendHeaders(buffer);
+		unsigned long long timeout = r->server->timeout;
+		session->sendHeaders(buffer, &timeout);
 		return APR_SUCCESS;
 	}
 	
@@ -655,7 +669,8 @@ private:
 			
 			size = fread(buf, 1, sizeof(buf), uploadData->handle);
 			
-			session->sendBodyBlock(buf, size);
+			unsigned long long timeout = r->server->timeout;
+			session->sendBodyBlock(buf, size, &timeout);
 		}
 	}
 	
@@ -664,7 +679,8 @@ private:
 		apr_off_t len;
 
 		while ((len = ap_get_client_block(r, buf, sizeof(buf))) > 0) {
-			session->sendBodyBlock(buf, len);
+			unsigned long long timeout = r->server->timeout;
+			session->sendBodyBlock(buf, len, &timeout);
 		}
 		if (len == -1) {
 			throw IOException("An error occurred while receiving HTTP upload data.");
@@ -733,7 +749,8 @@ public:
 		applicationPoolServer = ptr(
 			new ApplicationPoolServer(
 				applicationPoolServerExe, spawnServer, "",
-				ruby, user)
+				ruby, user, config->maxConcurrentSpawns,
+				config->watchRestartFiles)
 		);
 	}
 	
@@ -30,9 +30,12 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <cstdarg>
+#include <cstring>
 #ifdef __OpenBSD__
 	// OpenBSD needs this for 'struct iovec'. Apparently it isn't
 	// always included by unistd.h and sys/types.h.
@@ -41,6 +44,7 @@
 
 #include "Exceptions.h"
 #include "Utils.h"
+#include "StaticString.h"
 
 namespace Passenger {
 
@@ -66,6 +70,19 @@ using namespace oxt;
  * The protocol is designed to be low overhead, easy to implement and
  * easy to parse.
  *
+ * Array messages start with a size header. It's 16 bits in the original
+ * frame format, FRAME_VERSION_1, and 32 bits in FRAME_VERSION_2. A new
+ * connection uses FRAME_VERSION_1; the two sides can agree on a newer frame
+ * format with negotiateFrameVersion() and acceptFrameVersion(). Scalar
+ * messages always have a 32-bit size header.
+ *
+ * readRaw(), readScalar(), writeRaw() and writeScalar() accept an optional
+ * timeout, in microseconds, which limits the time that the entire operation
+ * may take, no matter how many system calls it needs. This is unlike
+ * setReadTimeout() and setWriteTimeout(), which limit the time that a single
+ * system call may block: a peer that sends or receives one byte at a time
+ * never triggers those.
+ *
  * MessageChannel is to be wrapped around a file descriptor. For example:
  * @code
  *    int p[2];
@@ -106,13 +123,136 @@ class MessageChannel {
 private:
 	const static char DELIMITER = '\0';
 	int fd;
+	unsigned int frameVersion;
+	
+	/** The body of the last array message that has been read. */
+	string readBuffer;
 	
 	#ifdef __OpenBSD__
 		typedef u_int32_t uint32_t;
 		typedef u_int16_t uint16_t;
 	#endif
+	
+	/**
+	 * Temporarily puts a file descriptor in non-blocking mode, and restores
+	 * its original mode upon destruction.
+	 */
+	class NonBlockingScope {
+	private:
+		int fd;
+		int oldFlags;
+	public:
+		NonBlockingScope(int fd) {
+			this->fd = fd;
+			oldFlags = fcntl(fd, F_GETFL);
+			if (oldFlags == -1) {
+				throw SystemException("Cannot get file descriptor flags", errno);
+			}
+			if (!(oldFlags & O_NONBLOCK)
+			 && fcntl(fd, F_SETFL, oldFlags | O_NONBLOCK) == -1) {
+				throw SystemException("Cannot set the file descriptor to non-blocking mode", errno);
+			}
+		}
+		
+		~NonBlockingScope() {
+			if (!(oldFlags & O_NONBLOCK)) {
+				fcntl(fd, F_SETFL, oldFlags);
+			}
+		}
+	};
+	
+	/**
+	 * Wait until the file descriptor is ready for the given poll() events,
+	 * but no longer than <tt>*timeout</tt> microseconds. The time spent
+	 * waiting is deducted from <tt>*timeout</tt>.
+	 *
+	 * @throws TimeoutException The file descriptor didn't become ready in time.
+	 * @throws SystemException Something went wrong while waiting.
+	 * @throws boost::thread_interrupted
+	 */
+	void waitUntilReady(short events, unsigned long long *timeout) {
+		struct pollfd pfd;
+		unsigned long long begin, elapsed, msec;
+		int ret;
+		
+		pfd.fd = fd;
+		pfd.events = events;
+		do {
+			// poll() works with milliseconds; round up so that we don't
+			// return early when less than a millisecond is left.
+			msec = min((*timeout + 999) / 1000, (unsigned long long) INT_MAX);
+			pfd.revents = 0;
+			begin = getMonotonicUsec();
+			ret = syscalls::poll(&pfd, 1, (int) msec);
+			if (ret == -1) {
+				throw SystemException("poll() failed", errno);
+			}
+			elapsed = getMonotonicUsec() - begin;
+			if (elapsed < *timeout) {
+				*timeout -= elapsed;
+			} else {
+				*timeout = 0;
+			}
+		} while (ret == 0 && *timeout > 0);
+		if (ret == 0) {
+			throw TimeoutException("Timeout expired while waiting for I/O on the channel");
+		}
+	}
+	
+	/**
+	 * Read the next array message's body into <tt>readBuffer</tt>.
+	 *
+	 * @return False if end-of-file has been reached.
+	 * @throws SystemException
+	 * @throws IOException The body is larger than MAX_FRAME_SIZE.
+	 * @throws boost::thread_interrupted
+	 */
+	bool readArrayMessageBody() {
+		char header[sizeof(uint32_t)];
+		unsigned int size;
+		
+		if (!readRaw(header, frameHeaderSize(frameVersion))) {
+			return false;
+		}
+		size = decodeFrameHeader(header, frameVersion);
+		checkFrameSize(size);
+		readBuffer.resize(size);
+		return size == 0 || readRaw(&readBuffer[0], size);
+	}
+	
+	template<typename StringType>
+	static void parseArrayMessage(const char *data, unsigned int size, vector<StringType> &args) {
+		const char *end = data + size;
+		const char *pos;
+		
+		args.clear();
+		while (data < end && (pos = (const char *) memchr(data, DELIMITER, end - data)) != NULL) {
+			args.push_back(StringType(data, pos - data));
+			data = pos + 1;
+		}
+	}
 
 public:
+	/**
+	 * The original frame format, in which an array message starts with a
+	 * 16-bit size header. Array messages are thus limited to 65535 bytes.
+	 */
+	static const unsigned int FRAME_VERSION_1 = 1;
+	
+	/** A frame format in which an array message starts with a 32-bit size header. */
+	static const unsigned int FRAME_VERSION_2 = 2;
+	
+	/** The latest frame format that this implementation supports. */
+	static const unsigned int LATEST_FRAME_VERSION = FRAME_VERSION_2;
+	
+	/**
+	 * The largest array message body that may be sent or received. A size
+	 * header that announces more than this means that the stream is corrupt
+	 * or out of sync, so reading fails instead of allocating a buffer of
+	 * that size.
+	 */
+	static const unsigned int MAX_FRAME_SIZE = 1024 * 1024 * 16;
+	
 	/**
 	 * Construct a new MessageChannel with no underlying file descriptor.
 	 * Thus the resulting MessageChannel object will not be usable.
@@ -121,13 +261,164 @@ public:
 	 */
 	MessageChannel() {
 		this->fd = -1;
+		frameVersion = FRAME_VERSION_1;
 	}
 
 	/**
 	 * Construct a new MessageChannel with the given file descriptor.
+	 * It uses FRAME_VERSION_1 until another frame version is negotiated.
 	 */
 	MessageChannel(int fd) {
 		this->fd = fd;
+		frameVersion = FRAME_VERSION_1;
+	}
+	
+	/**
+	 * Returns the frame format that's used for array messages.
+	 */
+	unsigned int getFrameVersion() const {
+		return frameVersion;
+	}
+	
+	/**
+	 * Set the frame format that's used for array messages. Both sides of
+	 * the connection must use the same frame format, so this should only
+	 * be called when both sides have agreed on it.
+	 *
+	 * @see negotiateFrameVersion()
+	 */
+	void setFrameVersion(unsigned int version) {
+		frameVersion = version;
+	}
+	
+	/**
+	 * Negotiate the frame format with the other side of the connection.
+	 * This sends a <tt>frame_version</tt> message with the latest frame
+	 * version that this side supports, and waits until the other side
+	 * has replied with the frame version that both sides will use from
+	 * then on, as done by acceptFrameVersion(). Both messages use the
+	 * frame format that was in use before.
+	 *
+	 * This must be done at the start of the connection, when no other
+	 * messages are underway in either direction. A connection on which
+	 * nothing is negotiated keeps using FRAME_VERSION_1.
+	 *
+	 * @param maxVersion The latest frame version to propose.
+	 * @return The negotiated frame version.
+	 * @throws SystemException Something went wrong during reading or writing.
+	 * @throws IOException The other side closed the connection, or replied
+	 *                     with something unexpected.
+	 * @throws boost::thread_interrupted
+	 */
+	unsigned int negotiateFrameVersion(unsigned int maxVersion = LATEST_FRAME_VERSION) {
+		vector<string> args;
+		
+		write("frame_version", toString(maxVersion).c_str(), NULL);
+		if (!read(args)) {
+			throw IOException("The other side closed the connection while "
+				"negotiating the frame version.");
+		}
+		if (args.size() != 2 || args[0] != "frame_version"
+		 || atoi(args[1]) < (int) FRAME_VERSION_1 || atoi(args[1]) > (int) maxVersion) {
+			throw IOException("The other side sent an invalid reply while "
+				"negotiating the frame version: " + toString(args));
+		}
+		frameVersion = atoi(args[1]);
+		return frameVersion;
+	}
+	
+	/**
+	 * Reply to a <tt>frame_version</tt> message that was sent by
+	 * negotiateFrameVersion(), and switch to the chosen frame format.
+	 *
+	 * @param proposed The frame version in the <tt>frame_version</tt> message.
+	 * @return The chosen frame version.
+	 * @throws SystemException Something went wrong during writing.
+	 * @throws boost::thread_interrupted
+	 */
+	unsigned int acceptFrameVersion(unsigned int proposed) {
+		unsigned int version = chooseFrameVersion(proposed);
+		write("frame_version", toString(version).c_str(), NULL);
+		frameVersion = version;
+		return version;
+	}
+	
+	/**
+	 * Returns the frame version that should be used if the other side
+	 * supports frame versions up to and including <tt>proposed</tt>.
+	 */
+	static unsigned int chooseFrameVersion(unsigned int proposed) {
+		if (proposed < FRAME_VERSION_1) {
+			return FRAME_VERSION_1;
+		} else if (proposed > LATEST_FRAME_VERSION) {
+			return LATEST_FRAME_VERSION;
+		} else {
+			return proposed;
+		}
+	}
+	
+	/**
+	 * Returns the size of the header of an array message in the given
+	 * frame format.
+	 */
+	static unsigned int frameHeaderSize(unsigned int frameVersion) {
+		if (frameVersion == FRAME_VERSION_1) {
+			return sizeof(uint16_t);
+		} else {
+			return sizeof(uint32_t);
+		}
+	}
+	
+	/**
+	 * Throw an IOException if the other side announced a message body,
+	 * with the given size, that is larger than MAX_FRAME_SIZE.
+	 */
+	static void checkFrameSize(unsigned int size) {
+		if (size > MAX_FRAME_SIZE) {
+			throw IOException("The other side sent a frame that is too large (" +
+				toString(size) + " bytes).");
+		}
+	}
+	
+	/**
+	 * Append the header of an array message with the given body size to
+	 * <tt>output</tt>.
+	 *
+	 * @throws IOException The body is too large for the given frame format,
+	 *                     or larger than MAX_FRAME_SIZE.
+	 */
+	static void appendFrameHeader(string &output, unsigned int size, unsigned int frameVersion) {
+		if (frameVersion == FRAME_VERSION_1) {
+			if (size > 0xFFFF) {
+				throw IOException("The array message is too large (" + toString(size) +
+					" bytes) for frame version 1. Please negotiate a newer frame version.");
+			}
+			uint16_t header = htons(size);
+			output.append((const char *) &header, sizeof(header));
+		} else {
+			if (size > MAX_FRAME_SIZE) {
+				throw IOException("The array message is too large (" + toString(size) +
+					" bytes). The maximum size is " + toString(MAX_FRAME_SIZE) + " bytes.");
+			}
+			uint32_t header = htonl(size);
+			output.append((const char *) &header, sizeof(header));
+		}
+	}
+	
+	/**
+	 * Decode the header of an array message, which must be
+	 * frameHeaderSize() bytes, and return the body size.
+	 */
+	static unsigned int decodeFrameHeader(const char *header, unsigned int frameVersion) {
+		if (frameVersion == FRAME_VERSION_1) {
+			uint16_t size;
+			memcpy(&size, header, sizeof(size));
+			return ntohs(size);
+		} else {
+			uint32_t size;
+			memcpy(&size, header, sizeof(size));
+			return ntohl(size);
+		}
 	}
 	
 	/**
@@ -156,28 +447,59 @@ public:
 	 *             std::string as value. Use the StringArrayType and
 	 *             StringArrayConstIteratorType template parameters to specify the exact type names.
 	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws IOException The message is too large for the frame format.
 	 * @throws boost::thread_interrupted
 	 * @pre None of the message elements may contain a NUL character (<tt>'\\0'</tt>).
 	 * @see read(), write(const char *, ...)
 	 */
 	template<typename StringArrayType, typename StringArrayConstIteratorType>
 	void write(const StringArrayType &args) {
-		StringArrayConstIteratorType it;
 		string data;
-		uint16_t dataSize = 0;
+		appendArrayMessage<StringArrayType, StringArrayConstIteratorType>(data, args, frameVersion);
+		writeRaw(data);
+	}
+	
+	/**
+	 * Append the encoded form of an array message, which consists of the given
+	 * elements, to <tt>output</tt>. This allows one to send multiple messages
+	 * with a single writeRaw() call.
+	 *
+	 * @param output The string to append the message to.
+	 * @param args An object which contains the message elements. See
+	 *             write(const StringArrayType &) for the requirements.
+	 * @param frameVersion The frame format to use.
+	 * @throws IOException The message is too large for the frame format.
+	 * @pre None of the message elements may contain a NUL character (<tt>'\\0'</tt>).
+	 */
+	template<typename StringArrayType, typename StringArrayConstIteratorType>
+	static void appendArrayMessage(string &output, const StringArrayType &args,
+	                               unsigned int frameVersion = FRAME_VERSION_1) {
+		StringArrayConstIteratorType it;
+		unsigned int dataSize = 0;
 
 		for (it = args.begin(); it != args.end(); it++) {
 			dataSize += it->size() + 1;
 		}
-		data.reserve(dataSize + sizeof(dataSize));
-		dataSize = htons(dataSize);
-		data.append((const char *) &dataSize, sizeof(dataSize));
+		output.reserve(output.size() + dataSize + frameHeaderSize(frameVersion));
+		appendFrameHeader(output, dataSize, frameVersion);
 		for (it = args.begin(); it != args.end(); it++) {
-			data.append(*it);
-			data.append(1, DELIMITER);
+			output.append(*it);
+			output.append(1, DELIMITER);
 		}
-		
-		writeRaw(data);
+	}
+	
+	/**
+	 * Append the encoded form of an array message, which consists of the given
+	 * elements, to <tt>output</tt>.
+	 *
+	 * @throws IOException The message is too large for the frame format.
+	 * @pre None of the message elements may contain a NUL character (<tt>'\\0'</tt>).
+	 * @see appendArrayMessage(string &, const StringArrayType &, unsigned int)
+	 */
+	static void appendArrayMessage(string &output, const vector<string> &args,
+	                               unsigned int frameVersion = FRAME_VERSION_1) {
+		appendArrayMessage<vector<string>, vector<string>::const_iterator>(output,
+			args, frameVersion);
 	}
 	
 	/**
@@ -186,6 +508,7 @@ public:
 	 *
 	 * @param args The message elements.
 	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws IOException The message is too large for the frame format.
 	 * @throws boost::thread_interrupted
 	 * @pre None of the message elements may contain a NUL character (<tt>'\\0'</tt>).
 	 * @see read(), write(const char *, ...)
@@ -200,6 +523,7 @@ public:
 	 *
 	 * @param args The message elements.
 	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws IOException The message is too large for the frame format.
 	 * @throws boost::thread_interrupted
 	 * @pre None of the message elements may contain a NUL character (<tt>'\\0'</tt>).
 	 * @see read(), write(const char *, ...)
@@ -216,6 +540,7 @@ public:
 	 * @param ... Other elements of the message. These *must* be strings, i.e. of type char*.
 	 *            It is also required to terminate this list with a NULL.
 	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws IOException The message is too large for the frame format.
 	 * @throws boost::thread_interrupted
 	 * @pre None of the message elements may contain a NUL character (<tt>'\\0'</tt>).
 	 * @see read(), write(const list<string> &)
@@ -242,12 +567,16 @@ public:
 	 * Send a scalar message over the underlying file descriptor.
 	 *
 	 * @param str The scalar message's content.
+	 * @param timeout A pointer to the maximum number of microseconds that
+	 *                writing may take, or NULL if there's no limit. See
+	 *                writeRaw(const char *, unsigned int, unsigned long long *).
 	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws TimeoutException The message could not be written within the timeout.
 	 * @throws boost::thread_interrupted
-	 * @see readScalar(), writeScalar(const char *, unsigned int)
+	 * @see readScalar(), writeScalar(const char *, unsigned int, unsigned long long *)
 	 */
-	void writeScalar(const string &str) {
-		writeScalar(str.c_str(), str.size());
+	void writeScalar(const string &str, unsigned long long *timeout = NULL) {
+		writeScalar(str.c_str(), str.size(), timeout);
 	}
 	
 	/**
@@ -255,39 +584,68 @@ public:
 	 *
 	 * @param data The scalar message's content.
 	 * @param size The number of bytes in <tt>data</tt>.
+	 * @param timeout A pointer to the maximum number of microseconds that
+	 *                writing may take, or NULL if there's no limit. See
+	 *                writeRaw(const char *, unsigned int, unsigned long long *).
 	 * @pre <tt>data != NULL</tt>
 	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws TimeoutException The message could not be written within the timeout.
 	 * @throws boost::thread_interrupted
-	 * @see readScalar(), writeScalar(const string &)
+	 * @see readScalar(), writeScalar(const string &, unsigned long long *)
 	 */
-	void writeScalar(const char *data, unsigned int size) {
+	void writeScalar(const char *data, unsigned int size, unsigned long long *timeout = NULL) {
 		uint32_t l = htonl(size);
-		writeRaw((const char *) &l, sizeof(uint32_t));
-		writeRaw(data, size);
+		writeRaw((const char *) &l, sizeof(uint32_t), timeout);
+		writeRaw(data, size, timeout);
 	}
 	
 	/**
 	 * Send a block of data over the underlying file descriptor.
 	 * This method blocks until everything is sent.
 	 *
+	 * If <tt>timeout</tt> is not NULL, then the file descriptor is put in
+	 * non-blocking mode for the duration of the call, and the time spent
+	 * waiting for the file descriptor to become writable is deducted from
+	 * <tt>*timeout</tt>. When it drops to 0 before everything is sent, a
+	 * TimeoutException is thrown; part of the data may have been sent by
+	 * then.
+	 *
 	 * @param data The data to send.
 	 * @param size The number of bytes in <tt>data</tt>.
+	 * @param timeout A pointer to the maximum number of microseconds that
+	 *                writing may take, or NULL if there's no limit.
 	 * @pre <tt>data != NULL</tt>
 	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws TimeoutException The data could not be written within the timeout.
 	 * @throws boost::thread_interrupted
 	 * @see readRaw()
 	 */
-	void writeRaw(const char *data, unsigned int size) {
+	void writeRaw(const char *data, unsigned int size, unsigned long long *timeout = NULL) {
 		ssize_t ret;
 		unsigned int written = 0;
-		do {
-			ret = syscalls::write(fd, data + written, size - written);
-			if (ret == -1) {
-				throw SystemException("write() failed", errno);
-			} else {
-				written += ret;
-			}
-		} while (written < size);
+		
+		if (timeout == NULL) {
+			do {
+				ret = syscalls::write(fd, data + written, size - written);
+				if (ret == -1) {
+					throw SystemException("write() failed", errno);
+				} else {
+					written += ret;
+				}
+			} while (written < size);
+		} else {
+			NonBlockingScope scope(fd);
+			do {
+				ret = syscalls::write(fd, data + written, size - written);
+				if (ret != -1) {
+					written += ret;
+				} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					waitUntilReady(POLLOUT, timeout);
+				} else {
+					throw SystemException("write() failed", errno);
+				}
+			} while (written < size);
+		}
 	}
 	
 	/**
@@ -295,12 +653,16 @@ public:
 	 * This method blocks until everything is sent.
 	 *
 	 * @param data The data to send.
+	 * @param timeout A pointer to the maximum number of microseconds that
+	 *                writing may take, or NULL if there's no limit. See
+	 *                writeRaw(const char *, unsigned int, unsigned long long *).
 	 * @pre <tt>data != NULL</tt>
 	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws TimeoutException The data could not be written within the timeout.
 	 * @throws boost::thread_interrupted
 	 */
-	void writeRaw(const string &data) {
-		writeRaw(data.c_str(), data.size());
+	void writeRaw(const string &data, unsigned long long *timeout = NULL) {
+		writeRaw(data.c_str(), data.size(), timeout);
 	}
 	
 	/**
@@ -366,64 +728,75 @@ public:
 	 * @return Whether end-of-file has been reached. If so, then the contents
 	 *         of <tt>args</tt> will be undefined.
 	 * @throws SystemException If an error occured while receiving the message.
+	 * @throws IOException The message is larger than MAX_FRAME_SIZE.
 	 * @throws boost::thread_interrupted
 	 * @see write()
 	 */
 	bool read(vector<string> &args) {
-		uint16_t size;
-		int ret;
-		unsigned int alreadyRead = 0;
-		
-		do {
-			ret = syscalls::read(fd, (char *) &size + alreadyRead, sizeof(size) - alreadyRead);
-			if (ret == -1) {
-				throw SystemException("read() failed", errno);
-			} else if (ret == 0) {
-				return false;
-			}
-			alreadyRead += ret;
-		} while (alreadyRead < sizeof(size));
-		size = ntohs(size);
-		
-		string buffer;
-		args.clear();
-		buffer.reserve(size);
-		while (buffer.size() < size) {
-			char tmp[1024 * 8];
-			ret = syscalls::read(fd, tmp, min(size - buffer.size(), sizeof(tmp)));
-			if (ret == -1) {
-				throw SystemException("read() failed", errno);
-			} else if (ret == 0) {
-				return false;
-			}
-			buffer.append(tmp, ret);
+		if (!readArrayMessageBody()) {
+			return false;
 		}
-		
-		if (!buffer.empty()) {
-			string::size_type start = 0, pos;
-			const string &const_buffer(buffer);
-			while ((pos = const_buffer.find('\0', start)) != string::npos) {
-				args.push_back(const_buffer.substr(start, pos - start));
-				start = pos + 1;
-			}
+		parseArrayMessage(readBuffer.data(), readBuffer.size(), args);
+		return true;
+	}
+	
+	/**
+	 * Read an array message from the underlying file descriptor, without
+	 * copying its elements. The elements in <tt>args</tt> point into a
+	 * buffer that belongs to this MessageChannel, and that is reused: they
+	 * stay valid until the next read() call on this MessageChannel, or
+	 * until it's destroyed.
+	 *
+	 * @param args The message will be put in this variable.
+	 * @return Whether end-of-file has been reached. If so, then the contents
+	 *         of <tt>args</tt> will be undefined.
+	 * @throws SystemException If an error occured while receiving the message.
+	 * @throws IOException The message is larger than MAX_FRAME_SIZE.
+	 * @throws boost::thread_interrupted
+	 * @see write()
+	 */
+	bool read(vector<StaticString> &args) {
+		if (!readArrayMessageBody()) {
+			return false;
 		}
+		parseArrayMessage(readBuffer.data(), readBuffer.size(), args);
 		return true;
 	}
 	
+	/**
+	 * Split the body of an array message, i.e. the part after the size
+	 * header, into its elements.
+	 */
+	static void parseArrayMessage(const char *data, unsigned int size, vector<string> &args) {
+		parseArrayMessage<string>(data, size, args);
+	}
+	
+	/**
+	 * Split the body of an array message into its elements, without
+	 * copying them. The elements point into <tt>data</tt>.
+	 */
+	static void parseArrayMessage(const char *data, unsigned int size, vector<StaticString> &args) {
+		parseArrayMessage<StaticString>(data, size, args);
+	}
+	
 	/**
 	 * Read a scalar message from the underlying file descriptor.
 	 *
 	 * @param output The message will be put in here.
+	 * @param timeout A pointer to the maximum number of microseconds that
+	 *                reading may take, or NULL if there's no limit. See
+	 *                readRaw().
 	 * @returns Whether end-of-file was reached during reading.
 	 * @throws SystemException An error occured while writing the data to the file descriptor.
+	 * @throws TimeoutException The message could not be read within the timeout.
 	 * @throws boost::thread_interrupted
 	 * @see writeScalar()
 	 */
-	bool readScalar(string &output) {
+	bool readScalar(string &output, unsigned long long *timeout = NULL) {
 		uint32_t size;
 		unsigned int remaining;
 		
-		if (!readRaw(&size, sizeof(uint32_t))) {
+		if (!readRaw(&size, sizeof(uint32_t), timeout)) {
 			return false;
 		}
 		size = ntohl(size);
@@ -435,7 +808,7 @@ public:
 			char buf[1024 * 32];
 			unsigned int blockSize = min((unsigned int) sizeof(buf), remaining);
 			
-			if (!readRaw(buf, blockSize)) {
+			if (!readRaw(buf, blockSize, timeout)) {
 				return false;
 			}
 			output.append(buf, blockSize);
@@ -451,20 +824,32 @@ public:
 	 * <tt>false</tt> will be returned. Otherwise (i.e. if the read was successful),
 	 * <tt>true</tt> will be returned.
 	 *
+	 * If <tt>timeout</tt> is not NULL, then this method waits with poll()
+	 * before every read, and the time spent waiting is deducted from
+	 * <tt>*timeout</tt>. When it drops to 0 before <tt>size</tt> bytes have
+	 * been read, a TimeoutException is thrown; <tt>buf</tt> may have been
+	 * partially filled by then.
+	 *
 	 * @param buf The buffer to place the read data in. This buffer must be at least
 	 *            <tt>size</tt> bytes long.
 	 * @param size The number of bytes to read.
+	 * @param timeout A pointer to the maximum number of microseconds that
+	 *                reading may take, or NULL if there's no limit.
 	 * @return Whether reading was successful or whether EOF was reached.
 	 * @pre buf != NULL
 	 * @throws SystemException Something went wrong during reading.
+	 * @throws TimeoutException The data could not be read within the timeout.
 	 * @throws boost::thread_interrupted
 	 * @see writeRaw()
 	 */
-	bool readRaw(void *buf, unsigned int size) {
+	bool readRaw(void *buf, unsigned int size, unsigned long long *timeout = NULL) {
 		ssize_t ret;
 		unsigned int alreadyRead = 0;
 		
 		while (alreadyRead < size) {
+			if (timeout != NULL) {
+				waitUntilReady(POLLIN, timeout);
+			}
 			ret = syscalls::read(fd, (char *) buf + alreadyRead, size - alreadyRead);
 			if (ret == -1) {
 				throw SystemException("read() failed", errno);
@@ -545,6 +930,10 @@ public:
 	 * SystemException will be thrown by one of the read methods,
 	 * with error code EAGAIN or EWOULDBLOCK.
 	 *
+	 * This timeout applies to every read system call separately. Pass a
+	 * timeout to readRaw() or readScalar() to limit the duration of an
+	 * entire read operation.
+	 *
 	 * @param msec The timeout, in milliseconds. If 0 is given,
 	 *             there will be no timeout.
 	 * @throws SystemException Cannot set the timeout.
@@ -573,6 +962,10 @@ public:
 	 * SystemException will be thrown, with error code EAGAIN or
 	 * EWOULDBLOCK.
 	 *
+	 * This timeout applies to every write system call separately. Pass a
+	 * timeout to writeRaw() or writeScalar() to limit the duration of an
+	 * entire write operation.
+	 *
 	 * @param msec The timeout, in milliseconds. If 0 is given,
 	 *             there will be no timeout.
 	 * @throws SystemException Cannot set the timeout.
@@ -22,6 +22,7 @@
 
 #include <string>
 #include "Utils.h"
+#include "StaticString.h"
 
 namespace Passenger {
 
@@ -53,6 +54,12 @@ using namespace std;
  * a detailed explanation.
  */
 struct PoolOptions {
+	/**
+	 * The number of elements that toVector() appends, and that the
+	 * vector constructor reads starting from its start index.
+	 */
+	static const unsigned int VECTOR_SIZE = 38;
+	
 	/**
 	 * The root directory of the application to spawn. In case of a Ruby on Rails
 	 * application, this is the folder that contains 'app/', 'public/', 'config/',
@@ -129,6 +136,76 @@ struct PoolOptions {
 	 */
 	bool useGlobalQueue;
 	
+	/**
+	 * The minimum number of application instances that the pool should keep
+	 * around for this application. These instances are pre-spawned in the
+	 * background, and are not shut down when they've been idle for too long.
+	 * A value of 0 means that there is no minimum. This option is only used
+	 * by ApplicationPool::get().
+	 */
+	unsigned long minInstances;
+	
+	/**
+	 * The minimum number of seconds between two checks of the application's
+	 * <tt>tmp/restart.txt</tt>. A value of 0 means that it's checked on every
+	 * ApplicationPool::get() call. This option is only used by
+	 * ApplicationPool::get(), and only if the application's <tt>tmp</tt>
+	 * directory isn't being watched for changes.
+	 */
+	unsigned long statThrottleRate;
+	
+	/**
+	 * The maximum number of replacement instances that may be spawned
+	 * concurrently while the application is being restarted. A value of 0
+	 * means that the application is not restarted in a rolling manner:
+	 * all of its instances are shut down at once, and a new instance is
+	 * spawned immediately. This option is only used by
+	 * ApplicationPool::get().
+	 */
+	unsigned long rollingRestartConcurrency;
+	
+	/**
+	 * The maximum number of threads that may be waiting in a queue for an
+	 * application instance, or for a free slot in the pool. If the queue
+	 * is full, then ApplicationPool::get() throws BusyException immediately.
+	 * A value of 0 means that the queue length is unlimited.
+	 */
+	unsigned long maxQueueLength;
+	
+	/**
+	 * The maximum number of milliseconds that ApplicationPool::get() may
+	 * spend waiting in queues. If this time has passed, then it throws
+	 * BusyException. A value of 0 means that it may wait indefinitely.
+	 */
+	unsigned long maxQueueTime;
+	
+	/**
+	 * The weight of this application when the pool's capacity is divided
+	 * among the applications in the pool. Each application is entitled to a
+	 * share of the pool that's proportional to its weight; instances of
+	 * applications that use more than their share are shut down first when
+	 * another application needs a slot. Must be at least 1. This option is
+	 * only used by ApplicationPool::get().
+	 */
+	unsigned long poolWeight;
+	
+	/**
+	 * The number of sessions that each application instance can handle
+	 * concurrently, e.g. because the application is multi-threaded. New
+	 * sessions are opened on existing instances until they have this many
+	 * sessions, before new instances are spawned. Must be at least 1. This
+	 * option is only used by ApplicationPool::get().
+	 */
+	unsigned long instanceConcurrency;
+	
+	/**
+	 * Whether instances should be spawned ahead of demand, and surplus
+	 * instances shut down early, based on the trend of the application's
+	 * request rate and on its requests' duration. This option is only used
+	 * by ApplicationPool::get().
+	 */
+	bool predictiveSpawning;
+	
 	/**
 	 * Creates a new PoolOptions object with the default values filled in.
 	 * One must still set appRoot manually, after having used this constructor.
@@ -144,6 +221,14 @@ struct PoolOptions {
 		maxRequests    = 0;
 		memoryLimit    = 0;
 		useGlobalQueue = false;
+		minInstances   = 0;
+		statThrottleRate = 0;
+		rollingRestartConcurrency = 0;
+		maxQueueLength = 0;
+		maxQueueTime   = 0;
+		poolWeight     = 1;
+		instanceConcurrency = 1;
+		predictiveSpawning = false;
 	}
 	
 	/**
@@ -159,7 +244,15 @@ struct PoolOptions {
 		long appSpawnerTimeout       = -1,
 		unsigned long maxRequests    = 0,
 		unsigned long memoryLimit    = 0,
-		bool useGlobalQueue          = false) {
+		bool useGlobalQueue          = false,
+		unsigned long minInstances   = 0,
+		unsigned long statThrottleRate = 0,
+		unsigned long rollingRestartConcurrency = 0,
+		unsigned long maxQueueLength = 0,
+		unsigned long maxQueueTime   = 0,
+		unsigned long poolWeight     = 1,
+		unsigned long instanceConcurrency = 1,
+		bool predictiveSpawning      = false) {
 		this->appRoot        = appRoot;
 		this->lowerPrivilege = lowerPrivilege;
 		this->lowestUser     = lowestUser;
@@ -171,6 +264,14 @@ struct PoolOptions {
 		this->maxRequests    = maxRequests;
 		this->memoryLimit    = memoryLimit;
 		this->useGlobalQueue = useGlobalQueue;
+		this->minInstances   = minInstances;
+		this->statThrottleRate = statThrottleRate;
+		this->rollingRestartConcurrency = rollingRestartConcurrency;
+		this->maxQueueLength = maxQueueLength;
+		this->maxQueueTime   = maxQueueTime;
+		this->poolWeight     = poolWeight;
+		this->instanceConcurrency = instanceConcurrency;
+		this->predictiveSpawning = predictiveSpawning;
 	}
 	
 	/**
@@ -193,17 +294,20 @@ struct PoolOptions {
 	 * @param startIndex The index in vec at which the information starts.
 	 */
 	PoolOptions(const vector<string> &vec, unsigned int startIndex = 0) {
-		appRoot        = vec[startIndex + 1];
-		lowerPrivilege = vec[startIndex + 3] == "true";
-		lowestUser     = vec[startIndex + 5];
-		environment    = vec[startIndex + 7];
-		spawnMethod    = vec[startIndex + 9];
-		appType        = vec[startIndex + 11];
-		frameworkSpawnerTimeout = atol(vec[startIndex + 13]);
-		appSpawnerTimeout       = atol(vec[startIndex + 15]);
-		maxRequests    = atol(vec[startIndex + 17]);
-		memoryLimit    = atol(vec[startIndex + 19]);
-		useGlobalQueue = vec[startIndex + 21] == "true";
+		vector<StaticString> views(vec.begin() + startIndex, vec.end());
+		fromVector(views);
+	}
+	
+	/**
+	 * Creates a new PoolOptions object from the given vector of string
+	 * views, e.g. as read by MessageChannel::read(vector<StaticString> &).
+	 * The views don't have to stay valid after construction.
+	 *
+	 * @param vec The vector containing spawn options information.
+	 * @param startIndex The index in vec at which the information starts.
+	 */
+	PoolOptions(const vector<StaticString> &vec, unsigned int startIndex = 0) {
+		fromVector(vec, startIndex);
 	}
 	
 	/**
@@ -212,8 +316,8 @@ struct PoolOptions {
 	 * as a message to be sent to the spawn server.
 	 */
 	void toVector(vector<string> &vec) const {
-		if (vec.capacity() < vec.size() + 10) {
-			vec.reserve(vec.size() + 10);
+		if (vec.capacity() < vec.size() + VECTOR_SIZE) {
+			vec.reserve(vec.size() + VECTOR_SIZE);
 		}
 		appendKeyValue (vec, "app_root",        appRoot);
 		appendKeyValue (vec, "lower_privilege", lowerPrivilege ? "true" : "false");
@@ -226,9 +330,73 @@ struct PoolOptions {
 		appendKeyValue3(vec, "max_requests",    maxRequests);
 		appendKeyValue3(vec, "memory_limit",    memoryLimit);
 		appendKeyValue (vec, "use_global_queue", useGlobalQueue ? "true" : "false");
+		appendKeyValue3(vec, "min_instances",   minInstances);
+		appendKeyValue3(vec, "stat_throttle_rate", statThrottleRate);
+		appendKeyValue3(vec, "rolling_restart_concurrency", rollingRestartConcurrency);
+		appendKeyValue3(vec, "max_queue_length", maxQueueLength);
+		appendKeyValue3(vec, "max_queue_time",   maxQueueTime);
+		appendKeyValue3(vec, "pool_weight",      poolWeight);
+		appendKeyValue3(vec, "instance_concurrency", instanceConcurrency);
+		appendKeyValue (vec, "predictive_spawning", predictiveSpawning ? "true" : "false");
+	}
+	
+	/**
+	 * Orders PoolOptions objects by all the information that toVector()
+	 * writes, so that they can be used as keys in sorted containers.
+	 * Two objects are equivalent under this ordering if and only if
+	 * toVector() writes the same information for them.
+	 */
+	bool operator<(const PoolOptions &other) const {
+		#define COMPARE_FIELD(field) \
+			if (field != other.field) { \
+				return field < other.field; \
+			}
+		COMPARE_FIELD(appRoot);
+		COMPARE_FIELD(lowerPrivilege);
+		COMPARE_FIELD(lowestUser);
+		COMPARE_FIELD(environment);
+		COMPARE_FIELD(spawnMethod);
+		COMPARE_FIELD(appType);
+		COMPARE_FIELD(frameworkSpawnerTimeout);
+		COMPARE_FIELD(appSpawnerTimeout);
+		COMPARE_FIELD(maxRequests);
+		COMPARE_FIELD(memoryLimit);
+		COMPARE_FIELD(useGlobalQueue);
+		COMPARE_FIELD(minInstances);
+		COMPARE_FIELD(statThrottleRate);
+		COMPARE_FIELD(rollingRestartConcurrency);
+		COMPARE_FIELD(maxQueueLength);
+		COMPARE_FIELD(maxQueueTime);
+		COMPARE_FIELD(poolWeight);
+		COMPARE_FIELD(instanceConcurrency);
+		COMPARE_FIELD(predictiveSpawning);
+		#undef COMPARE_FIELD
+		return false;
 	}
 
 private:
+	void fromVector(const vector<StaticString> &vec, unsigned int startIndex = 0) {
+		appRoot        = vec[startIndex + 1].toString();
+		lowerPrivilege = vec[startIndex + 3] == "true";
+		lowestUser     = vec[startIndex + 5].toString();
+		environment    = vec[startIndex + 7].toString();
+		spawnMethod    = vec[startIndex + 9].toString();
+		appType        = vec[startIndex + 11].toString();
+		frameworkSpawnerTimeout = atol(vec[startIndex + 13]);
+		appSpawnerTimeout       = atol(vec[startIndex + 15]);
+		maxRequests    = atol(vec[startIndex + 17]);
+		memoryLimit    = atol(vec[startIndex + 19]);
+		useGlobalQueue = vec[startIndex + 21] == "true";
+		minInstances   = atol(vec[startIndex + 23]);
+		statThrottleRate = atol(vec[startIndex + 25]);
+		rollingRestartConcurrency = atol(vec[startIndex + 27]);
+		maxQueueLength = atol(vec[startIndex + 29]);
+		maxQueueTime   = atol(vec[startIndex + 31]);
+		poolWeight     = atol(vec[startIndex + 33]);
+		instanceConcurrency = atol(vec[startIndex + 35]);
+		predictiveSpawning = vec[startIndex + 37] == "true";
+	}
+	
 	static inline void
 	appendKeyValue(vector<string> &vec, const char *key, const string &value) {
 		vec.push_back(key);
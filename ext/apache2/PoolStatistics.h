@@ -0,0 +1,245 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_POOL_STATISTICS_H_
+#define _PASSENGER_POOL_STATISTICS_H_
+
+#include <boost/shared_ptr.hpp>
+#include <oxt/system_calls.hpp>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <cstring>
+#include <cerrno>
+#include <string>
+
+#include "Exceptions.h"
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+using namespace oxt;
+
+/**
+ * A snapshot of an application pool's state, which is published in a
+ * memory mapped file so that other processes can read it without
+ * communicating with the process that owns the pool.
+ *
+ * The file contains a PoolStatistics::Data structure, in the native byte
+ * order. It's protected by a sequence lock: the writer increments
+ * <tt>sequence</tt> before and after every update, so readers know that
+ * they've read a consistent snapshot if <tt>sequence</tt> was even and
+ * didn't change while they were reading. There must be only one writer
+ * at a time. Readers never block the writer.
+ *
+ * The layout only contains fixed-size fields with natural alignment, so
+ * that non-C++ readers can unpack it easily. <tt>layoutVersion</tt> is
+ * incremented whenever the layout changes.
+ *
+ * @ingroup Support
+ */
+class PoolStatistics {
+public:
+	static const uint32_t MAGIC = 0x50505354; // "PPST"
+	static const uint32_t LAYOUT_VERSION = 1;
+	static const unsigned int MAX_DOMAINS = 100;
+	static const unsigned int MAX_INSTANCES = 500;
+	static const unsigned int MAX_APP_ROOT_SIZE = 256;
+	
+	/** Pool-wide counters. */
+	struct Counters {
+		uint32_t magic;
+		uint32_t layoutVersion;
+		/** Odd while an update is in progress. */
+		volatile uint32_t sequence;
+		uint32_t spawnServerPid;
+		uint32_t max;
+		uint32_t count;
+		uint32_t active;
+		/** The number of used entries in Data::domains. */
+		uint32_t domainCount;
+		/** The number of used entries in Data::instances. */
+		uint32_t instanceCount;
+		uint32_t reserved;
+		/**
+		 * The time at which the domains and instances were published.
+		 * The other counters may have been published more recently.
+		 */
+		uint64_t updateTime;
+	};
+	
+	struct Domain {
+		/** The application root, NUL-terminated and possibly truncated. */
+		char appRoot[MAX_APP_ROOT_SIZE];
+		/** The number of slots, i.e. instances plus spawning instances. */
+		uint32_t size;
+		uint32_t weight;
+		uint32_t quota;
+		/** The number of requests that are waiting for an instance. */
+		uint32_t waiters;
+		double spawnTime;
+		double requestRate;
+		double serviceTime;
+	};
+	
+	struct Instance {
+		/** The index of this instance's domain in Data::domains. */
+		uint32_t domain;
+		uint32_t pid;
+		uint32_t sessions;
+		uint32_t processed;
+		uint64_t startTime;
+		/** Private dirty memory usage in KB, or 0 if unknown. */
+		uint64_t memory;
+	};
+	
+	struct Data {
+		Counters counters;
+		Domain domains[MAX_DOMAINS];
+		Instance instances[MAX_INSTANCES];
+	};
+
+private:
+	static const unsigned int MAX_READ_ATTEMPTS = 1000;
+	
+	Data *data;
+	
+	/**
+	 * Copy <tt>size</tt> bytes at the beginning of the shared data into
+	 * <tt>output</tt>, retrying until the copy is consistent.
+	 */
+	bool readConsistently(void *output, size_t size) const {
+		for (unsigned int i = 0; i < MAX_READ_ATTEMPTS; i++) {
+			uint32_t before = data->counters.sequence;
+			if (before % 2 == 1) {
+				continue;
+			}
+			__sync_synchronize();
+			memcpy(output, data, size);
+			__sync_synchronize();
+			if (data->counters.sequence == before) {
+				const Counters *counters = (const Counters *) output;
+				return counters->magic == MAGIC
+					&& counters->layoutVersion == LAYOUT_VERSION;
+			}
+		}
+		return false;
+	}
+
+public:
+	/**
+	 * Map the given statistics file into memory.
+	 *
+	 * @param filename The file to map.
+	 * @param create Whether the file should be created (or truncated) and
+	 *               initialized. Otherwise it must already exist.
+	 * @throws SystemException Something went wrong.
+	 */
+	PoolStatistics(const string &filename, bool create) {
+		this_thread::disable_syscall_interruption dsi;
+		int fd, flags, ret;
+		void *address;
+		
+		if (create) {
+			flags = O_RDWR | O_CREAT | O_TRUNC;
+		} else {
+			flags = O_RDWR;
+		}
+		do {
+			fd = open(filename.c_str(), flags, S_IRUSR | S_IWUSR);
+		} while (fd == -1 && errno == EINTR);
+		if (fd == -1) {
+			throw SystemException("Cannot open the pool statistics file '" +
+				filename + "'", errno);
+		}
+		if (create) {
+			do {
+				ret = ftruncate(fd, sizeof(Data));
+			} while (ret == -1 && errno == EINTR);
+			if (ret == -1) {
+				int e = errno;
+				syscalls::close(fd);
+				throw SystemException("Cannot resize the pool statistics file '" +
+					filename + "'", e);
+			}
+		}
+		address = mmap(NULL, sizeof(Data), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (address == MAP_FAILED) {
+			int e = errno;
+			syscalls::close(fd);
+			throw SystemException("Cannot map the pool statistics file '" +
+				filename + "'", e);
+		}
+		syscalls::close(fd);
+		
+		data = (Data *) address;
+		if (create) {
+			data->counters.magic = MAGIC;
+			data->counters.layoutVersion = LAYOUT_VERSION;
+		}
+	}
+	
+	~PoolStatistics() {
+		munmap(data, sizeof(Data));
+	}
+	
+	/**
+	 * Start updating the snapshot. The returned data may be modified until
+	 * endUpdate() is called. <tt>sequence</tt> must not be modified.
+	 */
+	Data &beginUpdate() {
+		data->counters.sequence++;
+		__sync_synchronize();
+		return *data;
+	}
+	
+	void endUpdate() {
+		__sync_synchronize();
+		data->counters.sequence++;
+	}
+	
+	/**
+	 * Read the pool-wide counters.
+	 *
+	 * @return Whether a consistent, valid snapshot could be read.
+	 */
+	bool readCounters(Counters &counters) const {
+		return readConsistently(&counters, sizeof(Counters));
+	}
+	
+	/**
+	 * Read the entire snapshot.
+	 *
+	 * @return Whether a consistent, valid snapshot could be read.
+	 */
+	bool read(Data &snapshot) const {
+		return readConsistently(&snapshot, sizeof(Data));
+	}
+};
+
+typedef shared_ptr<PoolStatistics> PoolStatisticsPtr;
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_POOL_STATISTICS_H_ */
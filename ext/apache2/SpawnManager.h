@@ -22,6 +22,7 @@
 
 #include <string>
 #include <list>
+#include <set>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <oxt/system_calls.hpp>
@@ -72,6 +73,15 @@ using namespace oxt;
  * can access the communication channel, so communication is guaranteed to be safe
  * (unless, of course, if the spawn server itself is a trojan).
  *
+ * A spawn server can only handle one spawn request at a time. In order to be able
+ * to spawn multiple applications concurrently, SpawnManager can start up to
+ * <tt>maxConcurrentSpawns</tt> spawn servers, each with its own communication channel.
+ * Additional spawn servers are only started when all existing ones are busy. Spawn
+ * requests are preferably sent to an idle spawn server that has spawned the same
+ * application root before, so that its cached framework and application code is
+ * reused. If there is no such spawn server, then another idle spawn server is used,
+ * so that several instances of the same application can be spawned concurrently.
+ *
  * The server will try to keep the spawning time as small as possible, by keeping
  * corresponding Ruby on Rails frameworks and application code in memory. So the second
  * time an instance of the same application is spawned, the spawn time is significantly
@@ -86,27 +96,73 @@ using namespace oxt;
 class SpawnManager {
 private:
 	static const int SPAWN_SERVER_INPUT_FD = 3;
+	
+	/**
+	 * A spawn server process and the communication channel with it.
+	 */
+	struct SpawnServer {
+		MessageChannel channel;
+		pid_t pid;
+		bool serverNeedsRestart;
+		/**
+		 * Whether the frame format has been negotiated since the spawn
+		 * server was (re)started.
+		 */
+		bool frameVersionNegotiated;
+		/** Whether a thread is currently using this spawn server. */
+		bool busy;
+		/** The application root that was last spawned by this spawn server. */
+		string lastAppRoot;
+		/**
+		 * Application roots for which a reload command must be sent
+		 * before the next spawn command.
+		 */
+		set<string> pendingReloads;
+		
+		SpawnServer() {
+			pid = 0;
+			serverNeedsRestart = false;
+			frameVersionNegotiated = false;
+			busy = false;
+		}
+	};
+	
+	typedef shared_ptr<SpawnServer> SpawnServerPtr;
 
 	string spawnServerCommand;
 	string logFile;
 	string rubyCommand;
 	string user;
+	unsigned int maxConcurrentSpawns;
 	
+	/** Protects _servers_, _startingServers_ and the <tt>busy</tt>,
+	 * <tt>lastAppRoot</tt> and <tt>pendingReloads</tt> members of each
+	 * SpawnServer. */
 	boost::mutex lock;
+	condition serverReleased;
 	
-	MessageChannel channel;
-	pid_t pid;
-	bool serverNeedsRestart;
+	/** Never empty. The first spawn server is started by the constructor. */
+	list<SpawnServerPtr> servers;
+	
+	/**
+	 * The number of spawn servers that are being started, but that haven't
+	 * been added to _servers_ yet. They're started without holding the lock.
+	 */
+	unsigned int startingServers;
 
 	/**
-	 * Restarts the spawn server.
+	 * Restarts the given spawn server.
 	 *
 	 * @pre System call interruption is disabled.
 	 * @throws SystemException An error occured while trying to setup the spawn server.
 	 * @throws IOException The specified log file could not be opened.
 	 */
-	void restartServer() {
+	void restartServer(SpawnServer &server) {
 		TRACE_POINT();
+		pid_t &pid = server.pid;
+		MessageChannel &channel = server.channel;
+		bool &serverNeedsRestart = server.serverNeedsRestart;
+		
 		if (pid != 0) {
 			UPDATE_TRACE_POINT();
 			channel.close();
@@ -234,6 +290,7 @@ private:
 			}
 			channel = MessageChannel(fds[0]);
 			serverNeedsRestart = false;
+			server.frameVersionNegotiated = false;
 			
 			#ifdef TESTING_SPAWN_MANAGER
 				if (nextRestartShouldFail) {
@@ -244,6 +301,119 @@ private:
 		}
 	}
 	
+	/**
+	 * Wait until a spawn server is available for spawning the given application
+	 * root, and mark it as busy. An idle spawn server that has last spawned the
+	 * same application root is preferred, after that any other idle spawn server.
+	 * A new spawn server is started if all existing ones are busy, and if there
+	 * are less than <tt>maxConcurrentSpawns</tt> spawn servers. It is started
+	 * without holding the lock, so that other threads can acquire and release
+	 * spawn servers in the mean time.
+	 *
+	 * @throws boost::thread_interrupted
+	 */
+	SpawnServerPtr acquireServer(const string &appRoot) {
+		TRACE_POINT();
+		boost::mutex::scoped_lock l(lock);
+		list<SpawnServerPtr>::iterator it;
+		
+		while (true) {
+			SpawnServerPtr appRootServer;
+			SpawnServerPtr idleServer;
+			
+			for (it = servers.begin(); it != servers.end() && appRootServer == NULL; it++) {
+				SpawnServerPtr &server = *it;
+				if (server->busy) {
+					continue;
+				} else if (server->lastAppRoot == appRoot) {
+					appRootServer = server;
+				} else if (idleServer == NULL) {
+					idleServer = server;
+				}
+			}
+			
+			if (appRootServer != NULL) {
+				appRootServer->busy = true;
+				return appRootServer;
+			} else if (idleServer != NULL) {
+				idleServer->busy = true;
+				idleServer->lastAppRoot = appRoot;
+				return idleServer;
+			} else if (servers.size() + startingServers < maxConcurrentSpawns) {
+				SpawnServerPtr server(new SpawnServer());
+				string error;
+				
+				server->busy = true;
+				server->lastAppRoot = appRoot;
+				startingServers++;
+				l.unlock();
+				try {
+					this_thread::disable_syscall_interruption dsi;
+					restartServer(*server);
+				} catch (const IOException &e) {
+					error = e.what();
+				} catch (const SystemException &e) {
+					error = e.what();
+				} catch (...) {
+					l.lock();
+					startingServers--;
+					throw;
+				}
+				l.lock();
+				startingServers--;
+				
+				if (error.empty()) {
+					servers.push_back(server);
+					P_DEBUG("Started spawn server #" << servers.size() <<
+						" (PID " << server->pid << ")");
+					return server;
+				} else {
+					P_WARN("Could not start an additional spawn server: " << error);
+					maxConcurrentSpawns = servers.size() + startingServers;
+					continue;
+				}
+			}
+			
+			UPDATE_TRACE_POINT();
+			serverReleased.wait(l);
+		}
+	}
+	
+	void releaseServer(SpawnServerPtr &server) {
+		boost::mutex::scoped_lock l(lock);
+		server->busy = false;
+		serverReleased.notify_all();
+	}
+	
+	/**
+	 * Send the reload commands that have been queued for the given
+	 * spawn server while it was busy.
+	 *
+	 * @pre The current thread has acquired the spawn server.
+	 * @throws SystemException Something went wrong.
+	 * @throws SpawnException The spawn server died unexpectedly, and a
+	 *         restart was attempted, but it failed.
+	 */
+	void sendPendingReloadCommands(SpawnServer &server) {
+		TRACE_POINT();
+		set<string> appRoots;
+		set<string>::const_iterator it;
+		{
+			boost::mutex::scoped_lock l(lock);
+			appRoots.swap(server.pendingReloads);
+		}
+		
+		this_thread::disable_interruption di;
+		this_thread::disable_syscall_interruption dsi;
+		for (it = appRoots.begin(); it != appRoots.end(); it++) {
+			try {
+				sendReloadCommand(server, *it);
+			} catch (const SystemException &e) {
+				handleReloadException(server, e, *it);
+			}
+		}
+	}
+	
 	/**
 	 * Send the spawn command to the spawn server.
 	 *
@@ -251,18 +421,30 @@ private:
 	 * @return An Application smart pointer, representing the spawned application.
 	 * @throws SpawnException Something went wrong.
 	 */
-	ApplicationPtr sendSpawnCommand(const PoolOptions &PoolOptions) {
+	ApplicationPtr sendSpawnCommand(SpawnServer &server, const PoolOptions &PoolOptions) {
 		TRACE_POINT();
+		MessageChannel &channel = server.channel;
 		vector<string> args;
 		int ownerPipe;
 		
 		try {
+			// The frame format is negotiated before the first spawn
+			// command instead of right after starting the spawn server,
+			// so that restarting doesn't wait for the spawn server to
+			// finish loading. No replies are underway at this point.
+			if (!server.frameVersionNegotiated) {
+				channel.negotiateFrameVersion();
+				server.frameVersionNegotiated = true;
+			}
 			args.push_back("spawn_application");
 			PoolOptions.toVector(args);
 			channel.write(args);
 		} catch (const SystemException &e) {
 			throw SpawnException(string("Could not write 'spawn_application' "
 				"command to the spawn server: ") + e.sys());
+		} catch (const IOException &e) {
+			throw SpawnException(string("Could not negotiate the frame "
+				"version with the spawn server: ") + e.what());
 		}
 		
 		try {
@@ -333,13 +515,14 @@ private:
 	 * @throws boost::thread_interrupted
 	 */
 	ApplicationPtr
-	handleSpawnException(const SpawnException &e, const PoolOptions &PoolOptions) {
+	handleSpawnException(SpawnServer &server, const SpawnException &e,
+	                     const PoolOptions &PoolOptions) {
 		TRACE_POINT();
 		bool restarted;
 		try {
 			P_DEBUG("Spawn server died. Attempting to restart it...");
 			this_thread::disable_syscall_interruption dsi;
-			restartServer();
+			restartServer(server);
 			P_DEBUG("Restart seems to be successful.");
 			restarted = true;
 		} catch (const IOException &e) {
@@ -350,7 +533,7 @@ private:
 			restarted = false;
 		}
 		if (restarted) {
-			return sendSpawnCommand(PoolOptions);
+			return sendSpawnCommand(server, PoolOptions);
 		} else {
 			throw SpawnException("The spawn server died unexpectedly, and restarting it failed.");
 		}
@@ -362,22 +545,23 @@ private:
 	 * @param appRoot The application root to reload.
 	 * @throws SystemException Something went wrong.
 	 */
-	void sendReloadCommand(const string &appRoot) {
+	void sendReloadCommand(SpawnServer &server, const string &appRoot) {
 		TRACE_POINT();
 		try {
-			channel.write("reload", appRoot.c_str(), NULL);
+			server.channel.write("reload", appRoot.c_str(), NULL);
 		} catch (const SystemException &e) {
 			throw SystemException("Could not write 'reload' command "
 				"to the spawn server", e.code());
 		}
 	}
 	
-	void handleReloadException(const SystemException &e, const string &appRoot) {
+	void handleReloadException(SpawnServer &server, const SystemException &e,
+	                           const string &appRoot) {
 		TRACE_POINT();
 		bool restarted;
 		try {
 			P_DEBUG("Spawn server died. Attempting to restart it...");
-			restartServer();
+			restartServer(server);
 			P_DEBUG("Restart seems to be successful.");
 			restarted = true;
 		} catch (const IOException &e) {
@@ -388,7 +572,7 @@ private:
 			restarted = false;
 		}
 		if (restarted) {
-			return sendReloadCommand(appRoot);
+			return sendReloadCommand(server, appRoot);
 		} else {
 			throw SpawnException("The spawn server died unexpectedly, and restarting it failed.");
 		}
@@ -423,26 +607,37 @@ public:
 	 *             running as root. If the empty string is given, or if
 	 *             the <tt>user</tt> is not a valid username, then
 	 *             the spawn manager will be run as the current user.
+	 * @param maxConcurrentSpawns The maximum number of spawn servers, i.e. the
+	 *             maximum number of applications that may be spawned concurrently.
+	 *             A value of 0 is treated as 1.
 	 * @throws SystemException An error occured while trying to setup the spawn server.
 	 * @throws IOException The specified log file could not be opened.
 	 */
 	SpawnManager(const string &spawnServerCommand,
 	             const string &logFile = "",
 	             const string &rubyCommand = "ruby",
-	             const string &user = "") {
+	             const string &user = "",
+	             unsigned int maxConcurrentSpawns = 1) {
 		TRACE_POINT();
 		this->spawnServerCommand = spawnServerCommand;
 		this->logFile = logFile;
 		this->rubyCommand = rubyCommand;
 		this->user = user;
-		pid = 0;
+		startingServers = 0;
+		if (maxConcurrentSpawns == 0) {
+			this->maxConcurrentSpawns = 1;
+		} else {
+			this->maxConcurrentSpawns = maxConcurrentSpawns;
+		}
 		#ifdef TESTING_SPAWN_MANAGER
 			nextRestartShouldFail = false;
 		#endif
 		this_thread::disable_interruption di;
 		this_thread::disable_syscall_interruption dsi;
 		try {
-			restartServer();
+			SpawnServerPtr server(new SpawnServer());
+			restartServer(*server);
+			servers.push_back(server);
 		} catch (const IOException &e) {
 			throw prependMessageToException(e, "Could not start the spawn server");
 		} catch (const SystemException &e) {
@@ -452,14 +647,26 @@ public:
 	
 	~SpawnManager() throw() {
 		TRACE_POINT();
-		if (pid != 0) {
-			UPDATE_TRACE_POINT();
-			this_thread::disable_interruption di;
-			this_thread::disable_syscall_interruption dsi;
-			P_TRACE(2, "Shutting down spawn manager (PID " << pid << ").");
-			channel.close();
-			syscalls::waitpid(pid, NULL, 0);
-			P_TRACE(2, "Spawn manager exited.");
+		this_thread::disable_interruption di;
+		this_thread::disable_syscall_interruption dsi;
+		list<SpawnServerPtr>::iterator it;
+		
+		// Close all channels first, so that the spawn servers can
+		// shut down in parallel.
+		for (it = servers.begin(); it != servers.end(); it++) {
+			SpawnServer *server = it->get();
+			if (server->pid != 0) {
+				P_TRACE(2, "Shutting down spawn manager (PID " << server->pid << ").");
+				server->channel.close();
+			}
+		}
+		for (it = servers.begin(); it != servers.end(); it++) {
+			SpawnServer *server = it->get();
+			if (server->pid != 0) {
+				UPDATE_TRACE_POINT();
+				syscalls::waitpid(server->pid, NULL, 0);
+				P_TRACE(2, "Spawn manager exited.");
+			}
 		}
 	}
 	
@@ -472,6 +679,10 @@ public:
 	 * If restarting the server fails, or if the second spawn attempt fails,
 	 * then an exception will be thrown.
 	 *
+	 * If all spawn servers are busy, then this method will start a new spawn
+	 * server, or block until one becomes available if <tt>maxConcurrentSpawns</tt>
+	 * spawn servers are already running.
+	 *
 	 * @param PoolOptions An object containing the details for this spawn operation,
 	 *                     such as which application to spawn. See PoolOptions for details.
 	 * @return A smart pointer to an Application object, which represents the application
@@ -482,15 +693,25 @@ public:
 	 */
 	ApplicationPtr spawn(const PoolOptions &PoolOptions) {
 		TRACE_POINT();
-		boost::mutex::scoped_lock l(lock);
+		SpawnServerPtr server(acquireServer(PoolOptions.appRoot));
 		try {
-			return sendSpawnCommand(PoolOptions);
-		} catch (const SpawnException &e) {
-			if (e.hasErrorPage()) {
-				throw;
-			} else {
-				return handleSpawnException(e, PoolOptions);
+			ApplicationPtr app;
+			
+			sendPendingReloadCommands(*server);
+			try {
+				app = sendSpawnCommand(*server, PoolOptions);
+			} catch (const SpawnException &e) {
+				if (e.hasErrorPage()) {
+					throw;
+				} else {
+					app = handleSpawnException(*server, e, PoolOptions);
+				}
 			}
+			releaseServer(server);
+			return app;
+		} catch (...) {
+			releaseServer(server);
+			throw;
 		}
 	}
 	
@@ -513,19 +734,51 @@ public:
 		TRACE_POINT();
 		this_thread::disable_interruption di;
 		this_thread::disable_syscall_interruption dsi;
-		try {
-			return sendReloadCommand(appRoot);
-		} catch (const SystemException &e) {
-			return handleReloadException(e, appRoot);
+		list<SpawnServerPtr> idleServers;
+		list<SpawnServerPtr>::iterator it;
+		
+		{
+			boost::mutex::scoped_lock l(lock);
+			for (it = servers.begin(); it != servers.end(); it++) {
+				SpawnServerPtr &server = *it;
+				if (server->busy) {
+					// Another thread is using this spawn server's channel.
+					// That thread will send the reload command before
+					// sending its next spawn command.
+					server->pendingReloads.insert(appRoot);
+				} else {
+					server->busy = true;
+					idleServers.push_back(server);
+				}
+			}
+		}
+		
+		// The idle spawn servers have been marked as busy, so the reload
+		// commands can be sent, and dead spawn servers can be restarted,
+		// without holding the lock.
+		for (it = idleServers.begin(); it != idleServers.end(); it++) {
+			try {
+				try {
+					sendReloadCommand(**it, appRoot);
+				} catch (const SystemException &e) {
+					handleReloadException(**it, e, appRoot);
+				}
+			} catch (...) {
+				for (; it != idleServers.end(); it++) {
+					releaseServer(*it);
+				}
+				throw;
+			}
+			releaseServer(*it);
 		}
 	}
 	
 	/**
-	 * Get the Process ID of the spawn server. This method is used in the unit tests
-	 * and should not be used directly.
+	 * Get the Process ID of the first spawn server. This method is used in the
+	 * unit tests and should not be used directly.
 	 */
 	pid_t getServerPid() const {
-		return pid;
+		return servers.front()->pid;
 	}
 };
 
@@ -34,18 +34,29 @@
 #include <sstream>
 #include <map>
 #include <list>
+#include <deque>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef __linux__
+	#include <sys/inotify.h>
+	#include <poll.h>
+	#include <limits.h>
+	#define PASSENGER_HAS_INOTIFY
+#endif
 #include <stdio.h>
 #include <unistd.h>
 #include <ctime>
 #include <cerrno>
+#include <cmath>
 #ifdef TESTING_APPLICATION_POOL
 	#include <cstdlib>
 #endif
 
 #include "ApplicationPool.h"
+#include "EvictionPolicy.h"
+#include "PoolStatistics.h"
 #include "Logging.h"
 #ifdef PASSENGER_USE_DUMMY_SPAWN_MANAGER
 	#include "DummySpawnManager.h"
@@ -97,37 +108,416 @@ private:
 	static const int DEFAULT_MAX_IDLE_TIME = 120;
 	static const int DEFAULT_MAX_POOL_SIZE = 20;
 	static const int DEFAULT_MAX_INSTANCES_PER_APP = 0;
+	static const int DEFAULT_MEMORY_SAMPLING_INTERVAL = 10;
+	static const int DEFAULT_PREDICTION_INTERVAL = 5;
 	static const int CLEANER_THREAD_STACK_SIZE = 1024 * 128;
+	static const int PRESPAWNER_THREAD_STACK_SIZE = 1024 * 128;
+	static const int RESTART_FILE_WATCHER_THREAD_STACK_SIZE = 1024 * 128;
+	static const int MEMORY_SAMPLER_THREAD_STACK_SIZE = 1024 * 128;
+	static const int DEMAND_PREDICTOR_THREAD_STACK_SIZE = 1024 * 128;
+	static const int REPLACEMENT_THREAD_STACK_SIZE = 1024 * 128;
 	static const unsigned int MAX_GET_ATTEMPTS = 10;
-	static const unsigned int GET_TIMEOUT = 5000; // In milliseconds.
 
 	friend class ApplicationPoolServer;
 	struct Domain;
 	struct AppContainer;
+	struct Waiter;
+	class PooledSession;
 	
 	typedef shared_ptr<Domain> DomainPtr;
 	typedef shared_ptr<AppContainer> AppContainerPtr;
 	typedef list<AppContainerPtr> AppContainerList;
-	typedef map<string, DomainPtr> DomainMap;
+	typedef vector<DomainPtr> DomainTable;
+	typedef deque<AppContainerList> SessionBuckets;
+	typedef list<Waiter *> WaiterList;
+	
+	/**
+	 * A thread that's waiting in one of the pool's wait queues. Each waiter
+	 * has its own condition variable, so that waking up a thread doesn't
+	 * wake up all the other waiting threads as well.
+	 */
+	struct Waiter {
+		condition cond;
+		bool woken;
+		/**
+		 * Determines the waiter's position in a queue. Tickets are handed
+		 * out in order of arrival, and a thread keeps its ticket when it
+		 * has to wait again, so that it doesn't lose its turn.
+		 */
+		unsigned long long ticket;
+		/**
+		 * Whether this thread waits for an idle instance, as opposed to
+		 * queueing up on a busy instance once there is one.
+		 * See PoolOptions::useGlobalQueue.
+		 */
+		bool useGlobalQueue;
+		/**
+		 * The AppContainer that has been handed over to this waiter, if any.
+		 * A session has already been reserved on it for the waiter.
+		 */
+		AppContainerPtr container;
+		
+		Waiter(unsigned long long ticket, bool useGlobalQueue) {
+			woken = false;
+			this->ticket = ticket;
+			this->useGlobalQueue = useGlobalQueue;
+		}
+	};
+	
+	/**
+	 * Wake up the thread that has been waiting the longest in the given
+	 * queue, optionally handing over an AppContainer to it.
+	 */
+	static void wakeUpWaiter(WaiterList &waiters,
+	                         const AppContainerPtr &container = AppContainerPtr()) {
+		if (!waiters.empty()) {
+			Waiter *waiter = waiters.front();
+			waiters.pop_front();
+			waiter->woken = true;
+			waiter->container = container;
+			waiter->cond.notify_one();
+		}
+	}
+	
+	static void wakeUpAllWaiters(WaiterList &waiters) {
+		while (!waiters.empty()) {
+			wakeUpWaiter(waiters);
+		}
+	}
 	
 	struct Domain {
+		unsigned int appId;
+		string appRoot;
+		/** All instances, including the ones that are still being spawned. */
 		AppContainerList instances;
+		/**
+		 * buckets[n] contains the instances that have n open sessions.
+		 * Instances that are still being spawned are not in any bucket.
+		 * Empty buckets are kept around, so that moving an instance to
+		 * another bucket never allocates memory.
+		 */
+		SessionBuckets buckets;
+		/**
+		 * The index of the first nonempty bucket, i.e. the bucket with the
+		 * least busy instances, or NO_BUCKET if all buckets are empty.
+		 */
+		unsigned int leastBusyBucket;
 		unsigned int size;
+		/** The number of instances in _instances_ that are still being spawned. */
+		unsigned int spawning;
+		/**
+		 * Incremented when a rolling restart begins. Instances that were
+		 * spawned for an older generation are to be replaced.
+		 */
+		unsigned int generation;
+		/** The number of replacement instances that are being spawned. */
+		unsigned int replacing;
+		/**
+		 * The number of instances in _instances_ that are being retired,
+		 * i.e. that may not be used for new sessions and that will be
+		 * removed as soon as their last session has been closed.
+		 */
+		unsigned int retiring;
 		unsigned long maxRequests;
+		unsigned long minInstances;
+		/**
+		 * The maximum amount of private dirty memory, in MB, that each
+		 * instance may use. 0 means unlimited.
+		 */
+		unsigned long memoryLimit;
+		/**
+		 * This application's weight when the pool's capacity is divided
+		 * among applications. See quota().
+		 */
+		unsigned long weight;
+		/**
+		 * The number of sessions that each instance can handle concurrently.
+		 * Instances with fewer sessions are used before new ones are spawned.
+		 */
+		unsigned long concurrency;
+		/**
+		 * The number of seconds that it took to spawn an instance, as an
+		 * exponentially weighted moving average. 0 if unknown.
+		 */
+		double spawnTime;
+		/**
+		 * The number of requests per second as of <tt>rateUpdated</tt>,
+		 * as exponentially decaying averages over the long term and over
+		 * the recent past. See currentRequestRate().
+		 */
+		double requestRate;
+		double recentRequestRate;
+		time_t rateUpdated;
+		/**
+		 * The number of seconds that a session stays open, as an
+		 * exponentially weighted moving average. 0 if unknown.
+		 */
+		double serviceTime;
+		/** Whether instances are spawned ahead of predicted demand. */
+		bool predictiveSpawning;
+		/**
+		 * The number of instances that this domain is predicted to need,
+		 * as of the last time that the demand predictor thread checked.
+		 * See predictedDemand().
+		 */
+		unsigned int predictedSize;
+		/** The filename of this application's restart.txt. */
+		string restartFile;
+		/** The directory that contains _restartFile_. */
+		string restartDir;
+		/** Threads that are waiting for an instance of this domain, oldest first. */
+		WaiterList waiters;
+		
+		static const unsigned int NO_BUCKET = (unsigned int) -1;
+		/** The time constants, in seconds, of the request rates' decay. */
+		static const int REQUEST_RATE_PERIOD = 300;
+		static const int RECENT_REQUEST_RATE_PERIOD = 30;
+		
+		Domain() {
+			leastBusyBucket = NO_BUCKET;
+			generation = 0;
+			replacing = 0;
+			retiring = 0;
+			spawnTime = 0;
+			requestRate = 0;
+			recentRequestRate = 0;
+			rateUpdated = 0;
+			serviceTime = 0;
+			predictiveSpawning = false;
+			predictedSize = 0;
+		}
+		
+		~Domain() {
+			// This domain has been removed from the pool.
+			wakeUpAllWaiters(waiters);
+		}
+		
+		/**
+		 * Returns the bucket for the given number of sessions, creating it
+		 * (and all buckets before it) if necessary.
+		 */
+		AppContainerList &bucket(unsigned int sessions) {
+			while (buckets.size() <= sessions) {
+				buckets.push_back(AppContainerList());
+			}
+			return buckets[sessions];
+		}
+		
+		/**
+		 * Must be called after an instance has been removed from the bucket
+		 * for the given number of sessions.
+		 */
+		void bucketShrunk(unsigned int sessions) {
+			if (sessions == leastBusyBucket && buckets[sessions].empty()) {
+				do {
+					leastBusyBucket++;
+				} while (leastBusyBucket < buckets.size()
+				      && buckets[leastBusyBucket].empty());
+				if (leastBusyBucket == buckets.size()) {
+					leastBusyBucket = NO_BUCKET;
+				}
+			}
+		}
+		
+		void addToBucket(const AppContainerPtr &container) {
+			AppContainerList &b(bucket(container->sessions));
+			b.push_front(container);
+			container->b_iterator = b.begin();
+			if (container->sessions < leastBusyBucket) {
+				leastBusyBucket = container->sessions;
+			}
+		}
+		
+		void removeFromBucket(const AppContainerPtr &container) {
+			buckets[container->sessions].erase(container->b_iterator);
+			bucketShrunk(container->sessions);
+		}
+		
+		/**
+		 * Change the number of open sessions of the given instance, and move
+		 * it to the front of the corresponding bucket. This doesn't allocate
+		 * memory unless a bucket has to be created, and takes O(1) time unless
+		 * the least busy bucket became empty.
+		 */
+		void setSessions(const AppContainerPtr &container, unsigned int sessions) {
+			unsigned int oldSessions = container->sessions;
+			AppContainerList &to(bucket(sessions));
+			
+			// Splicing keeps b_iterator valid.
+			to.splice(to.begin(), buckets[oldSessions], container->b_iterator);
+			container->sessions = sessions;
+			if (sessions < leastBusyBucket) {
+				leastBusyBucket = sessions;
+			}
+			bucketShrunk(oldSessions);
+		}
+		
+		bool hasIdleInstance() const {
+			return leastBusyBucket == 0;
+		}
+		
+		/**
+		 * Whether this domain has a usable instance with fewer than
+		 * _concurrency_ open sessions, i.e. one that can handle another
+		 * session without it having to wait inside the instance.
+		 */
+		bool hasSpareCapacity() const {
+			return leastBusyBucket != NO_BUCKET && leastBusyBucket < concurrency;
+		}
+		
+		/**
+		 * Whether this domain has an instance that may be used for new
+		 * sessions, i.e. one that's neither being spawned nor being retired.
+		 */
+		bool hasUsableInstance() const {
+			return leastBusyBucket != NO_BUCKET;
+		}
+		
+		/**
+		 * Returns the instance with the least number of open sessions.
+		 *
+		 * @pre leastBusyBucket != NO_BUCKET
+		 */
+		const AppContainerPtr &leastBusyInstance() const {
+			return buckets[leastBusyBucket].front();
+		}
+		
+		/**
+		 * Returns the given request rate, decayed from <tt>rateUpdated</tt>
+		 * up to the given time with the given time constant.
+		 */
+		double decayedRate(double rate, int period, time_t now) const {
+			if (now > rateUpdated) {
+				return rate * exp(-double(now - rateUpdated) / period);
+			} else {
+				return rate;
+			}
+		}
+		
+		/**
+		 * Returns the long-term request rate, decayed up to the given time.
+		 */
+		double currentRequestRate(time_t now) const {
+			return decayedRate(requestRate, REQUEST_RATE_PERIOD, now);
+		}
+		
+		/** Account for a request that has been made at the given time. */
+		void recordRequest(time_t now) {
+			requestRate = currentRequestRate(now) + 1.0 / REQUEST_RATE_PERIOD;
+			recentRequestRate = decayedRate(recentRequestRate,
+				RECENT_REQUEST_RATE_PERIOD, now) + 1.0 / RECENT_REQUEST_RATE_PERIOD;
+			rateUpdated = now;
+		}
+		
+		/** Account for a session that has been open for the given number of seconds. */
+		void recordServiceTime(double seconds) {
+			if (serviceTime == 0) {
+				serviceTime = seconds;
+			} else {
+				serviceTime = 0.8 * serviceTime + 0.2 * seconds;
+			}
+		}
+		
+		/**
+		 * Returns the number of instances that this domain is expected to
+		 * need by the time that an instance which is spawned now is ready.
+		 *
+		 * The request rate at that time is extrapolated from the recent and
+		 * the long-term request rates: if the request rate changes linearly,
+		 * then each of them lags behind it by its time constant, so their
+		 * difference yields the slope. By Little's law, the expected number
+		 * of open sessions is the request rate times the service time.
+		 */
+		unsigned int predictedDemand(time_t now) const {
+			double recent = decayedRate(recentRequestRate, RECENT_REQUEST_RATE_PERIOD, now);
+			double slope = (recent - currentRequestRate(now)) /
+				(REQUEST_RATE_PERIOD - RECENT_REQUEST_RATE_PERIOD);
+			double rate = recent + slope * (RECENT_REQUEST_RATE_PERIOD + spawnTime);
+			double demand = ceil(rate * serviceTime / concurrency);
+			
+			if (demand <= 0) {
+				return 0;
+			} else if (demand >= 65535) {
+				return 65535;
+			} else {
+				return (unsigned int) demand;
+			}
+		}
+		
+		/**
+		 * Returns the number of instances that the pre-spawner thread
+		 * should keep around for this domain.
+		 */
+		unsigned long prespawnTarget() const {
+			if (predictiveSpawning && predictedSize > minInstances) {
+				return predictedSize;
+			} else {
+				return minInstances;
+			}
+		}
+		
+		/** Account for an instance that took the given number of seconds to spawn. */
+		void recordSpawnTime(double seconds) {
+			if (spawnTime == 0) {
+				spawnTime = seconds;
+			} else {
+				spawnTime = 0.7 * spawnTime + 0.3 * seconds;
+			}
+		}
 	};
 	
 	struct AppContainer {
 		ApplicationPtr app;
+		/** The application ID of the domain that this container belongs to. */
+		unsigned int appId;
 		time_t startTime;
 		time_t lastUsed;
+		/**
+		 * The time at which this instance was last appended to
+		 * _inactiveApps_, from which its idle deadline is computed.
+		 * Usually equal to _lastUsed_, but an instance that is kept because
+		 * of its domain's minimum number of instances gets a new deadline.
+		 */
+		time_t idleSince;
 		unsigned int sessions;
 		unsigned int processed;
+		/**
+		 * Whether this container is a placeholder for an application
+		 * instance that's still being spawned. If so, then _app_ is NULL.
+		 */
+		bool spawning;
+		/** The domain generation for which this instance has been spawned. */
+		unsigned int generation;
+		/**
+		 * Whether this instance is being retired because of a rolling
+		 * restart. If so, then it's not in any bucket.
+		 */
+		bool retiring;
+		/**
+		 * The private dirty memory usage of this instance, in KB, as of
+		 * the last time that the memory sampler thread checked. 0 if unknown.
+		 */
+		unsigned long memory;
 		AppContainerList::iterator iterator;
 		AppContainerList::iterator ia_iterator;
+		/** The iterator in domain->buckets[sessions]. Invalid while spawning or retiring. */
+		AppContainerList::iterator b_iterator;
 		
 		AppContainer() {
 			startTime = time(NULL);
 			processed = 0;
+			spawning = false;
+			generation = 0;
+			retiring = false;
+			memory = 0;
+		}
+		
+		/**
+		 * Whether this container is active, i.e. whether it has open
+		 * sessions or is still being spawned.
+		 */
+		bool isActive() const {
+			return sessions > 0 || spawning;
 		}
 		
 		/**
@@ -153,18 +543,283 @@ private:
 		}
 	};
 	
+	/**
+	 * What the pool knows about an application's restart.txt.
+	 */
+	struct RestartFileInfo {
+		/** The last known modification time of restart.txt, or 0 if unknown. */
+		time_t mtime;
+		/** The last time that restart.txt has been checked, or 0 if never. */
+		time_t lastChecked;
+		/**
+		 * The inotify watch descriptor of the directory that contains
+		 * restart.txt, or -1 if that directory isn't being watched.
+		 */
+		int watch;
+		/**
+		 * Whether the watched directory might have changed since restart.txt
+		 * has last been checked.
+		 */
+		bool changed;
+		
+		RestartFileInfo() {
+			mtime = 0;
+			lastChecked = 0;
+			watch = -1;
+			changed = true;
+		}
+	};
+	
 	struct SharedData {
 		boost::mutex lock;
-		condition activeOrMaxChanged;
 		
-		DomainMap domains;
+		/**
+		 * Maps an application ID to its Domain, or to NULL if the application
+		 * has no instances in the pool. This table is never shrunk, so every
+		 * application ID that has been handed out is a valid index.
+		 */
+		DomainTable domains;
 		unsigned int max;
 		unsigned int count;
 		unsigned int active;
 		unsigned int maxPerApp;
 		AppContainerList inactiveApps;
-		map<string, time_t> restartFileTimes;
+		/** Maps an application ID to information about its restart.txt. */
+		vector<RestartFileInfo> restartFiles;
 		map<string, unsigned int> appInstanceCount;
+		
+		/**
+		 * Maps application IDs for which a minimum number of instances
+		 * has been set, to the options with which the pre-spawner thread
+		 * should spawn their instances.
+		 */
+		map<unsigned int, PoolOptions> prespawnOptions;
+		/**
+		 * Maps the IDs of applications for which a rolling restart is in
+		 * progress, to the options with which the pre-spawner thread should
+		 * spawn replacement instances.
+		 */
+		map<unsigned int, PoolOptions> rollingRestarts;
+		/** Notified when the pre-spawner thread might have work to do. */
+		condition prespawnerThreadSleeper;
+		
+		/**
+		 * Threads that are waiting for <tt>active</tt> to drop below
+		 * <tt>max</tt>, oldest first.
+		 */
+		WaiterList globalWaiters;
+		
+		/**
+		 * List nodes that have been removed from _inactiveApps_. They are
+		 * reused when an instance becomes inactive, so that this doesn't
+		 * allocate memory.
+		 */
+		AppContainerList spareNodes;
+		
+		struct FreeBlock {
+			FreeBlock *next;
+		};
+		
+		/**
+		 * Protects the free lists below. Sessions are closed without
+		 * holding _lock_, so a separate lock is used.
+		 */
+		boost::mutex freeListLock;
+		/** Session objects that can be reused, linked through their _nextFree_. */
+		PooledSession *freeSessions;
+		/**
+		 * Memory blocks of <tt>blockSize</tt> bytes that can be reused for
+		 * the reference counts of Application::SessionPtr objects.
+		 */
+		FreeBlock *freeBlocks;
+		size_t blockSize;
+		
+		SharedData() {
+			freeSessions = NULL;
+			freeBlocks = NULL;
+			blockSize = 0;
+		}
+		
+		~SharedData() {
+			while (freeSessions != NULL) {
+				PooledSession *next = freeSessions->nextFree;
+				delete freeSessions;
+				freeSessions = next;
+			}
+			while (freeBlocks != NULL) {
+				FreeBlock *next = freeBlocks->next;
+				operator delete(freeBlocks);
+				freeBlocks = next;
+			}
+		}
+		
+		void addToInactiveApps(const AppContainerPtr &container) {
+			if (spareNodes.empty()) {
+				inactiveApps.push_back(container);
+			} else {
+				inactiveApps.splice(inactiveApps.end(), spareNodes,
+					spareNodes.begin());
+				inactiveApps.back() = container;
+			}
+			container->ia_iterator = inactiveApps.end();
+			container->ia_iterator--;
+			container->idleSince = time(NULL);
+		}
+		
+		void removeFromInactiveApps(const AppContainerPtr &container) {
+			AppContainerList::iterator it(container->ia_iterator);
+			// Don't use _container_ after this point: it might refer
+			// to the element that's being reset.
+			it->reset();
+			spareNodes.splice(spareNodes.begin(), inactiveApps, it);
+		}
+		
+		/**
+		 * Returns a session object that's not in use, reusing one from the
+		 * free list if possible.
+		 */
+		PooledSession *acquireSession() {
+			boost::mutex::scoped_lock l(freeListLock);
+			if (freeSessions == NULL) {
+				l.unlock();
+				return new PooledSession();
+			} else {
+				PooledSession *session = freeSessions;
+				freeSessions = session->nextFree;
+				session->nextFree = NULL;
+				return session;
+			}
+		}
+		
+		void releaseSession(PooledSession *session) {
+			boost::mutex::scoped_lock l(freeListLock);
+			session->nextFree = freeSessions;
+			freeSessions = session;
+		}
+		
+		void *allocateBlock(size_t size) {
+			boost::mutex::scoped_lock l(freeListLock);
+			if (size == blockSize && freeBlocks != NULL) {
+				FreeBlock *block = freeBlocks;
+				freeBlocks = block->next;
+				return block;
+			} else {
+				if (blockSize == 0 && size >= sizeof(FreeBlock)) {
+					blockSize = size;
+				}
+				l.unlock();
+				return operator new(size);
+			}
+		}
+		
+		void deallocateBlock(void *p, size_t size) {
+			boost::mutex::scoped_lock l(freeListLock);
+			if (size == blockSize) {
+				FreeBlock *block = (FreeBlock *) p;
+				block->next = freeBlocks;
+				freeBlocks = block;
+			} else {
+				l.unlock();
+				operator delete(p);
+			}
+		}
+		
+		/**
+		 * Hand the given usable container over to the threads that have been
+		 * waiting the longest for an instance of its domain, reserving a
+		 * session for each of them, until the container has _concurrency_
+		 * sessions or until no thread is waiting anymore.
+		 */
+		void handOverToWaiters(Domain *domain, const AppContainerPtr &container) {
+			while (container->sessions < domain->concurrency && !domain->waiters.empty()) {
+				domain->setSessions(container, container->sessions + 1);
+				wakeUpWaiter(domain->waiters, container);
+			}
+		}
+		
+		/**
+		 * Wake up as many of the threads that are waiting for an instance of
+		 * the given domain as may spawn one without exceeding <tt>max</tt>
+		 * or <tt>maxPerApp</tt>, oldest first. If the domain has a usable
+		 * instance, then the threads that don't use the global queue are
+		 * woken up as well, so that they can queue up on it. The others keep
+		 * waiting for an instance to be handed over to them.
+		 */
+		void wakeUpServableWaiters(Domain *domain) {
+			WaiterList &waiters = domain->waiters;
+			unsigned int room = (count < max) ? max - count : 0;
+			
+			if (maxPerApp != 0) {
+				room = min(room, (domain->size < maxPerApp) ? maxPerApp - domain->size : 0);
+			}
+			while (room > 0 && !waiters.empty()) {
+				wakeUpWaiter(waiters);
+				room--;
+			}
+			if (domain->hasUsableInstance()) {
+				WaiterList::iterator it = waiters.begin();
+				while (it != waiters.end()) {
+					Waiter *waiter = *it;
+					if (waiter->useGlobalQueue) {
+						it++;
+					} else {
+						it = waiters.erase(it);
+						waiter->woken = true;
+						waiter->cond.notify_one();
+					}
+				}
+			}
+		}
+		
+		/**
+		 * Called when the last session of the given active container has
+		 * been closed, or when a new instance is ready. The container is
+		 * handed over to the threads that have been waiting the longest for
+		 * an instance of its domain. If there are no such threads, then the
+		 * container becomes inactive and the oldest thread in _globalWaiters_
+		 * is woken up.
+		 *
+		 * @pre container->sessions == 0 && !container->spawning
+		 */
+		void containerBecameIdle(Domain *domain, const AppContainerPtr &container) {
+			container->lastUsed = time(NULL);
+			if (!domain->waiters.empty()) {
+				handOverToWaiters(domain, container);
+			} else {
+				addToInactiveApps(container);
+				active--;
+				wakeUpWaiter(globalWaiters);
+				if (container->generation != domain->generation) {
+					// A rolling restart is in progress, and this
+					// old instance can now be retired.
+					prespawnerThreadSleeper.notify_one();
+				}
+			}
+		}
+		
+		/**
+		 * Called when an active container has been removed from the given
+		 * domain. One thread that's waiting for an instance of this domain
+		 * may now spawn one, and one thread in _globalWaiters_ may now use
+		 * the freed slot.
+		 */
+		void activeContainerRemoved(Domain *domain) {
+			wakeUpWaiter(domain->waiters);
+			wakeUpWaiter(globalWaiters);
+		}
+		
+		/**
+		 * Wake up all waiting threads, e.g. because the limits have changed.
+		 */
+		void wakeUpEverybody() {
+			DomainTable::iterator it;
+			for (it = domains.begin(); it != domains.end(); it++) {
+				if (*it != NULL) {
+					wakeUpAllWaiters((*it)->waiters);
+				}
+			}
+			wakeUpAllWaiters(globalWaiters);
+		}
 	};
 	
 	typedef shared_ptr<SharedData> SharedDataPtr;
@@ -175,79 +830,260 @@ private:
 	struct SessionCloseCallback {
 		SharedDataPtr data;
 		weak_ptr<AppContainer> container;
+		/** The time at which the session has been opened. */
+		system_time opened;
+		
+		SessionCloseCallback() { }
 		
 		SessionCloseCallback(SharedDataPtr data,
 		                     const weak_ptr<AppContainer> &container) {
 			this->data = data;
 			this->container = container;
+			opened = get_system_time();
 		}
 		
 		void operator()() {
 			boost::mutex::scoped_lock l(data->lock);
+			closeLocked();
+		}
+		
+		/**
+		 * @pre <tt>data->lock</tt> is locked.
+		 */
+		void closeLocked() {
 			AppContainerPtr container(this->container.lock());
 			
 			if (container == NULL) {
 				return;
 			}
 			
-			DomainMap::iterator it;
-			it = data->domains.find(container->app->getAppRoot());
-			if (it != data->domains.end()) {
-				Domain *domain = it->second.get();
+			Domain *domain = data->domains[container->appId].get();
+			if (domain != NULL) {
 				AppContainerList *instances = &domain->instances;
 				
+				domain->recordServiceTime((get_system_time() - opened)
+					.total_microseconds() / 1000000.0);
 				container->processed++;
-				if (domain->maxRequests > 0 && container->processed >= domain->maxRequests) {
+				if (container->retiring) {
+					container->sessions--;
+					if (container->sessions == 0) {
+						instances->erase(container->iterator);
+						domain->size--;
+						domain->retiring--;
+						data->count--;
+						data->active--;
+						data->activeContainerRemoved(domain);
+						// The rolling restart might be waiting for a
+						// free slot.
+						data->prespawnerThreadSleeper.notify_one();
+						if (instances->empty()) {
+							data->domains[container->appId].reset();
+						}
+					}
+				} else if (domain->maxRequests > 0 && container->processed >= domain->maxRequests) {
 					instances->erase(container->iterator);
+					domain->removeFromBucket(container);
 					domain->size--;
-					if (instances->empty()) {
-						data->domains.erase(container->app->getAppRoot());
+					if (domain->prespawnTarget() > 0) {
+						data->prespawnerThreadSleeper.notify_one();
 					}
 					data->count--;
 					data->active--;
-					data->activeOrMaxChanged.notify_all();
+					data->activeContainerRemoved(domain);
+					if (instances->empty()) {
+						data->domains[container->appId].reset();
+					}
 				} else {
 					container->lastUsed = time(NULL);
-					container->sessions--;
+					domain->setSessions(container, container->sessions - 1);
 					if (container->sessions == 0) {
-						instances->erase(container->iterator);
-						instances->push_front(container);
-						container->iterator = instances->begin();
-						data->inactiveApps.push_back(container);
-						container->ia_iterator = data->inactiveApps.end();
-						container->ia_iterator--;
-						data->active--;
-						data->activeOrMaxChanged.notify_all();
+						data->containerBecameIdle(domain, container);
+					} else {
+						// The instance can take another session.
+						data->handOverToWaiters(domain, container);
 					}
 				}
 			}
 		}
 	};
-
-	#ifdef PASSENGER_USE_DUMMY_SPAWN_MANAGER
-		DummySpawnManager spawnManager;
-	#else
-		SpawnManager spawnManager;
-	#endif
-	SharedDataPtr data;
-	boost::thread *cleanerThread;
-	bool detached;
-	bool done;
-	unsigned int maxIdleTime;
-	unsigned int waitingOnGlobalQueue;
-	condition cleanerThreadSleeper;
+	
+	/**
+	 * A session object that is put back on SharedData's free list, instead of
+	 * being destroyed, when the last Application::SessionPtr to it is gone.
+	 * This way the request path doesn't have to allocate memory for sessions.
+	 */
+	class PooledSession: public Application::StandardSession {
+	public:
+		/**
+		 * Called when the session has been closed. Its _data_ is NULL if
+		 * the session hasn't been opened.
+		 */
+		SessionCloseCallback onClose;
+		PooledSession *nextFree;
+		
+		PooledSession(): StandardSession(0, function<void()>(), -1) {
+			nextFree = NULL;
+		}
+		
+		void open(pid_t pid, int fd, const SessionCloseCallback &onClose) {
+			this->pid = pid;
+			this->fd = fd;
+			this->onClose = onClose;
+		}
+	};
+	
+	/**
+	 * The deleter of Application::SessionPtr objects that point to a
+	 * PooledSession. Closes the session and puts it back on the free list.
+	 */
+	struct SessionRecycler {
+		SharedDataPtr data;
+		
+		SessionRecycler(const SharedDataPtr &data) {
+			this->data = data;
+		}
+		
+		void operator()(PooledSession *session) {
+			SessionCloseCallback onClose(session->onClose);
+			
+			// The free list mustn't keep the pool's data alive.
+			session->onClose = SessionCloseCallback();
+			try {
+				session->closeStream();
+			} catch (const exception &e) {
+				P_WARN("Cannot close a session: " << e.what());
+				session->discardStream();
+			}
+			data->releaseSession(session);
+			if (onClose.data != NULL) {
+				onClose();
+			}
+		}
+	};
+	
+	/**
+	 * An allocator for the reference counts of Application::SessionPtr objects.
+	 * It takes memory blocks from SharedData's free list.
+	 */
+	template<typename T>
+	struct SessionBlockAllocator {
+		typedef T value_type;
+		typedef T *pointer;
+		typedef const T *const_pointer;
+		typedef T &reference;
+		typedef const T &const_reference;
+		typedef size_t size_type;
+		typedef ptrdiff_t difference_type;
+		
+		template<typename U>
+		struct rebind {
+			typedef SessionBlockAllocator<U> other;
+		};
+		
+		SharedDataPtr data;
+		
+		SessionBlockAllocator(const SharedDataPtr &data) {
+			this->data = data;
+		}
+		
+		template<typename U>
+		SessionBlockAllocator(const SessionBlockAllocator<U> &other) {
+			data = other.data;
+		}
+		
+		T *allocate(size_t n, const void *hint = 0) {
+			return (T *) data->allocateBlock(n * sizeof(T));
+		}
+		
+		void deallocate(T *p, size_t n) {
+			data->deallocateBlock(p, n * sizeof(T));
+		}
+	};
+	
+	#ifdef PASSENGER_USE_DUMMY_SPAWN_MANAGER
+		DummySpawnManager spawnManager;
+	#else
+		SpawnManager spawnManager;
+	#endif
+	SharedDataPtr data;
+	boost::thread *cleanerThread;
+	boost::thread *prespawnerThread;
+	/**
+	 * Threads that spawn replacement instances for rolling restarts. Each
+	 * replacement is spawned by its own thread, so that several of them can
+	 * be spawned at the same time. Protected by _lock_.
+	 */
+	list<boost::thread *> replacementThreads;
+	/**
+	 * The IDs of the threads in _replacementThreads_ that have finished and
+	 * have yet to be joined by the pre-spawner thread.
+	 */
+	vector<boost::thread::id> finishedReplacementThreads;
+	/**
+	 * The number of replacement threads that have been started, but that
+	 * haven't reserved a slot in the pool yet.
+	 */
+	unsigned int startingReplacements;
+	boost::thread *memorySamplerThread;
+	/** NULL if restart files aren't being watched. */
+	boost::thread *restartFileWatcherThread;
+	/**
+	 * The inotify file descriptor with which application's tmp directories
+	 * are watched for changes to restart.txt, or -1 if they aren't watched.
+	 */
+	int inotifyFd;
+	/** Written to in order to stop the restart file watcher thread. */
+	int restartFileWatcherShutdownPipe[2];
+	/** Maps an inotify watch descriptor to the application IDs that use it. */
+	multimap<int, unsigned int> watchedApps;
+	bool detached;
+	bool done;
+	unsigned int maxIdleTime;
+	unsigned int waitingOnGlobalQueue;
+	/** The number of times that a thread has been woken up from a wait queue. */
+	unsigned long long wakeups;
+	/**
+	 * The number of times that a woken up thread obtained an instance
+	 * without having to wait again.
+	 */
+	unsigned long long usefulWakeups;
+	/** The ticket that will be handed out to the next waiter. See Waiter. */
+	unsigned long long nextTicket;
+	condition cleanerThreadSleeper;
+	/** The number of seconds between two memory usage samples. */
+	unsigned int memorySamplingInterval;
+	condition memorySamplerThreadSleeper;
+	boost::thread *demandPredictorThread;
+	/** The number of seconds between two demand predictions. */
+	unsigned int predictionInterval;
+	condition demandPredictorThreadSleeper;
+	/** Decides which inactive instance is shut down when the pool is full. */
+	EvictionPolicyPtr evictionPolicy;
+	
+	/**
+	 * Maps application roots to application IDs. Application IDs are small
+	 * integers that are handed out in order of first use and are never
+	 * reused, so that the pool's data structures can be indexed by them.
+	 * Protected by _appIdsLock_ instead of _lock_, so that application roots
+	 * are looked up outside the global lock.
+	 */
+	map<string, unsigned int> appIds;
+	boost::mutex appIdsLock;
 	
 	// Shortcuts for instance variables in SharedData. Saves typing in get().
 	boost::mutex &lock;
-	condition &activeOrMaxChanged;
-	DomainMap &domains;
+	DomainTable &domains;
 	unsigned int &max;
 	unsigned int &count;
 	unsigned int &active;
 	unsigned int &maxPerApp;
 	AppContainerList &inactiveApps;
-	map<string, time_t> &restartFileTimes;
+	vector<RestartFileInfo> &restartFiles;
 	map<string, unsigned int> &appInstanceCount;
+	map<unsigned int, PoolOptions> &prespawnOptions;
+	map<unsigned int, PoolOptions> &rollingRestarts;
+	condition &prespawnerThreadSleeper;
+	WaiterList &globalWaiters;
 	
 	/**
 	 * Verify that all the invariants are correct.
@@ -255,182 +1091,1259 @@ private:
 	bool inline verifyState() {
 	#if PASSENGER_DEBUG
 		// Invariants for _domains_.
-		DomainMap::const_iterator it;
+		unsigned int i;
 		unsigned int totalSize = 0;
-		for (it = domains.begin(); it != domains.end(); it++) {
-			const string &appRoot = it->first;
-			Domain *domain = it->second.get();
+		for (i = 0; i < domains.size(); i++) {
+			Domain *domain = domains[i].get();
+			if (domain == NULL) {
+				continue;
+			}
+			const string &appRoot = domain->appRoot;
 			AppContainerList *instances = &domain->instances;
 			
+			P_ASSERT(domain->appId == i, false,
+				"domains['" << appRoot << "'].appId (" << domain->appId <<
+				") == " << i);
+			
 			P_ASSERT(domain->size <= count, false,
 				"domains['" << appRoot << "'].size (" << domain->size <<
 				") <= count (" << count << ")");
+			P_ASSERT(domain->spawning <= domain->size, false,
+				"domains['" << appRoot << "'].spawning (" << domain->spawning <<
+				") <= domains['" << appRoot << "'].size (" << domain->size << ")");
 			totalSize += domain->size;
 			
 			// Invariants for Domain.
 			
-			P_ASSERT(!instances->empty(), false,
-				"domains['" << appRoot << "'].instances is nonempty.");
+			P_ASSERT(!instances->empty(), false,
+				"domains['" << appRoot << "'].instances is nonempty.");
+			
+			AppContainerList::const_iterator lit;
+			unsigned int bucketsSize = 0;
+			for (lit = instances->begin(); lit != instances->end(); lit++) {
+				const AppContainerPtr &container(*lit);
+				if (!container->spawning && !container->retiring) {
+					P_ASSERT(container->sessions < domain->buckets.size()
+						&& *container->b_iterator == container,
+						false,
+						"domains['" << appRoot << "'].buckets[" << container->sessions <<
+						"] contains the instance");
+				}
+			}
+			for (unsigned int b = 0; b < domain->buckets.size(); b++) {
+				if (b < domain->leastBusyBucket) {
+					P_ASSERT(domain->buckets[b].empty(), false,
+						"domains['" << appRoot << "'].buckets[" << b <<
+						"] is empty");
+				} else if (b == domain->leastBusyBucket) {
+					P_ASSERT(!domain->buckets[b].empty(), false,
+						"domains['" << appRoot << "'].buckets[" << b <<
+						"] is nonempty");
+				}
+				bucketsSize += domain->buckets[b].size();
+			}
+			P_ASSERT(bucketsSize == domain->size - domain->spawning - domain->retiring, false,
+				"(sum of all bucket sizes in domains['" << appRoot << "']) == "
+				"size - spawning - retiring");
+		}
+		P_ASSERT(totalSize == count, false, "(sum of all d.size in domains) == count");
+		
+		P_ASSERT(active <= count, false,
+			"active (" << active << ") < count (" << count << ")");
+		P_ASSERT(inactiveApps.size() == count - active, false,
+			"inactive_apps.size() == count - active");
+	#endif
+		return true;
+	}
+	
+	template<typename LockActionType>
+	string toString(LockActionType lockAction) const {
+		unique_lock<boost::mutex> l(lock, lockAction);
+		stringstream result;
+		
+		result << "----------- General information -----------" << endl;
+		result << "max      = " << max << endl;
+		result << "count    = " << count << endl;
+		result << "active   = " << active << endl;
+		result << "inactive = " << inactiveApps.size() << endl;
+		result << "Waiting on global queue: " << waitingOnGlobalQueue << endl;
+		result << "Wakeups: " << wakeups << " (useful: " << usefulWakeups << ")" << endl;
+		result << endl;
+		
+		result << "----------- Domains -----------" << endl;
+		DomainTable::const_iterator it;
+		unsigned long weight = totalWeight();
+		for (it = domains.begin(); it != domains.end(); it++) {
+			Domain *domain = it->get();
+			if (domain == NULL) {
+				continue;
+			}
+			AppContainerList *instances = &domain->instances;
+			AppContainerList::const_iterator lit;
+			
+			result << domain->appRoot << ": " << endl;
+			result << "  Slots: " << domain->size << "   Quota: " <<
+				quota(domain, weight) << "   Weight: " << domain->weight << endl;
+			for (lit = instances->begin(); lit != instances->end(); lit++) {
+				AppContainer *container = lit->get();
+				char buf[128];
+				
+				if (container->spawning) {
+					snprintf(buf, sizeof(buf),
+							"PID: (spawning)   Uptime: %s",
+							container->uptime().c_str());
+				} else {
+					snprintf(buf, sizeof(buf),
+							"PID: %-5lu   Sessions: %-2u   Processed: %-5u   Uptime: %s%s",
+							(unsigned long) container->app->getPid(),
+							container->sessions,
+							container->processed,
+							container->uptime().c_str(),
+							container->retiring ? "   (retiring)" : "");
+				}
+				result << "  " << buf << endl;
+			}
+			result << endl;
+		}
+		return result.str();
+	}
+	
+	/**
+	 * Checks whether the given domain's application should be restarted
+	 * because its restart.txt has been created or touched.
+	 *
+	 * If the directory that contains restart.txt is being watched, then
+	 * restart.txt is only examined after the watcher thread has noticed a
+	 * change in that directory. Otherwise, it is examined at most once every
+	 * <tt>options.statThrottleRate</tt> seconds.
+	 */
+	bool needsRestart(const Domain *domain, const PoolOptions &options) {
+		const string &restartFile(domain->restartFile);
+		RestartFileInfo &info(restartFiles[domain->appId]);
+		struct stat buf;
+		bool result;
+		int ret;
+		
+		if (info.watch != -1) {
+			if (!info.changed) {
+				return false;
+			}
+		} else {
+			time_t now = time(NULL);
+			if (options.statThrottleRate > 0 && info.lastChecked != 0
+			 && now >= info.lastChecked
+			 && (unsigned long) (now - info.lastChecked) < options.statThrottleRate) {
+				return false;
+			}
+			info.lastChecked = now;
+			watchRestartDir(domain);
+		}
+		info.changed = false;
+		
+		do {
+			ret = stat(restartFile.c_str(), &buf);
+		} while (ret == -1 && errno == EINTR);
+		if (ret == 0) {
+			do {
+				ret = unlink(restartFile.c_str());
+			} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+			if (ret == 0 || errno == ENOENT) {
+				info.mtime = 0;
+				result = true;
+			} else {
+				if (info.mtime == 0) {
+					result = true;
+				} else {
+					result = buf.st_mtime != info.mtime;
+				}
+				info.mtime = buf.st_mtime;
+			}
+		} else {
+			info.mtime = 0;
+			result = false;
+		}
+		return result;
+	}
+	
+	/**
+	 * Start watching the directory that contains the given domain's
+	 * restart.txt, if restart file watching is enabled. Does nothing if
+	 * the directory cannot be watched, e.g. because it doesn't exist.
+	 *
+	 * @pre The lock is held.
+	 */
+	void watchRestartDir(const Domain *domain) {
+		#ifdef PASSENGER_HAS_INOTIFY
+			if (inotifyFd == -1) {
+				return;
+			}
+			
+			int wd = inotify_add_watch(inotifyFd, domain->restartDir.c_str(),
+				IN_CREATE | IN_MODIFY | IN_ATTRIB | IN_MOVED_TO);
+			if (wd != -1) {
+				restartFiles[domain->appId].watch = wd;
+				watchedApps.insert(make_pair(wd, domain->appId));
+			}
+		#endif
+	}
+	
+	#ifdef PASSENGER_HAS_INOTIFY
+		void startRestartFileWatcher() {
+			inotifyFd = inotify_init();
+			if (inotifyFd == -1) {
+				int e = errno;
+				P_WARN("Cannot initialize inotify: " << strerror(e) <<
+					" (" << e << "). Restart files will not be watched.");
+				return;
+			}
+			if (pipe(restartFileWatcherShutdownPipe) == -1) {
+				int e = errno;
+				syscalls::close(inotifyFd);
+				inotifyFd = -1;
+				throw SystemException("Cannot create a pipe", e);
+			}
+			restartFileWatcherThread = new boost::thread(
+				bind(&StandardApplicationPool::restartFileWatcherMainLoop, this),
+				RESTART_FILE_WATCHER_THREAD_STACK_SIZE
+			);
+		}
+		
+		/**
+		 * Handle an inotify event for one of the watched directories.
+		 *
+		 * @pre The lock is held.
+		 */
+		void handleRestartDirEvent(const struct inotify_event *event) {
+			typedef multimap<int, unsigned int>::iterator Iterator;
+			
+			if (event->mask & IN_Q_OVERFLOW) {
+				// Events have been lost, so any application might have
+				// to be restarted.
+				Iterator it;
+				for (it = watchedApps.begin(); it != watchedApps.end(); it++) {
+					restartFiles[it->second].changed = true;
+				}
+				return;
+			}
+			
+			pair<Iterator, Iterator> range(watchedApps.equal_range(event->wd));
+			Iterator it;
+			if (event->mask & IN_IGNORED) {
+				// The watch has been removed, e.g. because the directory
+				// has been deleted. Fall back to stat()ing restart.txt.
+				for (it = range.first; it != range.second; it++) {
+					restartFiles[it->second].watch = -1;
+					restartFiles[it->second].changed = true;
+				}
+				watchedApps.erase(range.first, range.second);
+			} else if (event->len > 0 && strcmp(event->name, "restart.txt") == 0) {
+				for (it = range.first; it != range.second; it++) {
+					restartFiles[it->second].changed = true;
+				}
+			}
+		}
+		
+		void restartFileWatcherMainLoop() {
+			this_thread::disable_interruption di;
+			this_thread::disable_syscall_interruption dsi;
+			union {
+				struct inotify_event event;
+				char data[(sizeof(struct inotify_event) + NAME_MAX + 1) * 16];
+			} buf;
+			
+			try {
+				while (true) {
+					struct pollfd fds[2];
+					int ret;
+					
+					fds[0].fd = inotifyFd;
+					fds[0].events = POLLIN;
+					fds[1].fd = restartFileWatcherShutdownPipe[0];
+					fds[1].events = POLLIN;
+					do {
+						ret = poll(fds, 2, -1);
+					} while (ret == -1 && errno == EINTR);
+					if (ret == -1) {
+						throw SystemException("Cannot poll the inotify file descriptor",
+							errno);
+					}
+					if (fds[1].revents != 0) {
+						// StandardApplicationPool is being destroyed.
+						break;
+					}
+					
+					ssize_t size = syscalls::read(inotifyFd, buf.data, sizeof(buf.data));
+					if (size == -1) {
+						if (errno == EINTR || errno == EAGAIN) {
+							continue;
+						}
+						throw SystemException("Cannot read inotify events", errno);
+					}
+					
+					boost::mutex::scoped_lock l(lock);
+					ssize_t offset = 0;
+					while (offset < size) {
+						const struct inotify_event *event =
+							(const struct inotify_event *) (buf.data + offset);
+						handleRestartDirEvent(event);
+						offset += sizeof(struct inotify_event) + event->len;
+					}
+				}
+			} catch (const exception &e) {
+				P_ERROR("Uncaught exception: " << e.what());
+				P_ERROR("Restart files will no longer be watched.");
+				
+				boost::mutex::scoped_lock l(lock);
+				multimap<int, unsigned int>::iterator it;
+				for (it = watchedApps.begin(); it != watchedApps.end(); it++) {
+					restartFiles[it->second].watch = -1;
+					restartFiles[it->second].changed = true;
+				}
+				watchedApps.clear();
+				syscalls::close(inotifyFd);
+				inotifyFd = -1;
+			}
+		}
+	#endif
+	
+	/**
+	 * Remove the given inactive instance from the pool. Its domain is
+	 * removed as well if it has no other instances.
+	 *
+	 * @pre The lock is held, and <tt>!container->isActive()</tt>.
+	 */
+	void removeInactiveContainer(const AppContainerPtr &container) {
+		AppContainerPtr c(container); // _container_ might be in _inactiveApps_.
+		unsigned int appId = c->appId;
+		Domain *domain = domains[appId].get();
+		
+		domain->instances.erase(c->iterator);
+		domain->removeFromBucket(c);
+		domain->size--;
+		count--;
+		data->removeFromInactiveApps(c);
+		if (domain->instances.empty()) {
+			restartFiles[appId].mtime = 0;
+			domains[appId].reset();
+		}
+	}
+	
+	/**
+	 * Returns the sum of the weights of all applications in the pool.
+	 */
+	unsigned long totalWeight() const {
+		DomainTable::const_iterator it;
+		unsigned long result = 0;
+		
+		for (it = domains.begin(); it != domains.end(); it++) {
+			if (*it != NULL) {
+				result += (*it)->weight;
+			}
+		}
+		return result;
+	}
+	
+	/**
+	 * Returns the number of slots in the pool that the given domain is
+	 * entitled to, i.e. its weight's share of <tt>max</tt>, but at least 1.
+	 * _totalWeight_ is the sum of the weights of all applications that
+	 * compete for the pool's capacity.
+	 */
+	unsigned int quota(const Domain *domain, unsigned long totalWeight) const {
+		unsigned long long result = 0;
+		
+		if (totalWeight > 0) {
+			result = (unsigned long long) max * domain->weight / totalWeight;
+		}
+		if (result == 0) {
+			return 1;
+		} else {
+			return (unsigned int) result;
+		}
+	}
+	
+	/**
+	 * Returns the inactive instance that the eviction policy considers the
+	 * least valuable to keep, preferring instances of applications that
+	 * occupy more slots than their quota. If _overQuotaOnly_ is true, then
+	 * only such instances are considered. Returns a NULL pointer if there is
+	 * no suitable instance.
+	 */
+	AppContainerPtr findEvictionVictim(unsigned long totalWeight, bool overQuotaOnly) const {
+		AppContainerList::const_iterator it;
+		AppContainerPtr result;
+		bool resultOverQuota = false;
+		double resultValue = 0;
+		time_t now = time(NULL);
+		
+		for (it = inactiveApps.begin(); it != inactiveApps.end(); it++) {
+			const AppContainerPtr &container(*it);
+			const Domain *domain = domains[container->appId].get();
+			bool overQuota = domain->size > quota(domain, totalWeight);
+			
+			if ((overQuotaOnly && !overQuota) || (resultOverQuota && !overQuota)) {
+				continue;
+			}
+			
+			EvictionCandidate candidate;
+			candidate.spawnTime = domain->spawnTime;
+			candidate.requestRate = domain->currentRequestRate(now);
+			if (now > container->lastUsed) {
+				candidate.idleTime = now - container->lastUsed;
+			}
+			candidate.instances = domain->size;
+			double value = evictionPolicy->keepValue(candidate);
+			
+			// _inactiveApps_ is sorted by the time at which instances
+			// became idle, so on a tie the instance that has been idle
+			// the longest is usually chosen.
+			if (result == NULL || (overQuota && !resultOverQuota) || value < resultValue) {
+				result = container;
+				resultOverQuota = overQuota;
+				resultValue = value;
+			}
+		}
+		return result;
+	}
+	
+	/**
+	 * If the given domain occupies fewer slots than its quota, then shut
+	 * down an inactive instance of an application that occupies more than
+	 * its quota, in order to free a slot for the given domain. Returns
+	 * whether a slot has been freed.
+	 */
+	bool reclaimSlot(const Domain *domain) {
+		unsigned long weight = totalWeight();
+		
+		if (domain->size >= quota(domain, weight)) {
+			return false;
+		}
+		
+		AppContainerPtr container(findEvictionVictim(weight, true));
+		if (container == NULL) {
+			return false;
+		} else {
+			P_DEBUG("Shutting down an idle instance of " <<
+				domains[container->appId]->appRoot << " to make room for " <<
+				domain->appRoot << ", which uses less than its share of the pool");
+			removeInactiveContainer(container);
+			return true;
+		}
+	}
+	
+	/**
+	 * Removes the idle application instances that have expired, and returns
+	 * the time at which the next instance in _inactiveApps_ will expire, or 0
+	 * if there are no instances that can expire.
+	 *
+	 * _inactiveApps_ is sorted by _idleSince_ because instances are appended
+	 * to it when they become idle, so only the expired instances at the front
+	 * of the list have to be examined. Expired instances that are needed to
+	 * satisfy their domain's minimum number of instances are moved to the
+	 * back of the list with a new deadline, so that they aren't examined
+	 * again on every wakeup.
+	 */
+	time_t removeExpiredInstances(time_t now) {
+		AppContainerList::iterator it(inactiveApps.begin());
+		
+		while (it != inactiveApps.end()) {
+			AppContainerPtr container(*it);
+			time_t deadline = container->idleSince + maxIdleTime + 1;
+			
+			if (now < deadline) {
+				return deadline;
+			}
+			
+			ApplicationPtr app(container->app);
+			Domain *domain = domains[container->appId].get();
+			
+			if (domain->size > domain->minInstances) {
+				P_DEBUG("Cleaning idle app " << app->getAppRoot() <<
+					" (PID " << app->getPid() << ")");
+				it++;
+				removeInactiveContainer(container);
+			} else {
+				// This instance is needed to satisfy the domain's
+				// minimum number of instances. If it's still needed
+				// when its new deadline has passed, then it's moved
+				// to the back again.
+				it++;
+				inactiveApps.splice(inactiveApps.end(), inactiveApps,
+					container->ia_iterator);
+				container->idleSince = now;
+			}
+		}
+		return 0;
+	}
+	
+	void cleanerThreadMainLoop() {
+		this_thread::disable_syscall_interruption dsi;
+		unique_lock<boost::mutex> l(lock);
+		try {
+			while (!done && !this_thread::interruption_requested()) {
+				if (maxIdleTime == 0) {
+					// Idle instances are never cleaned. Wait until
+					// maxIdleTime changes.
+					cleanerThreadSleeper.wait(l);
+					continue;
+				}
+				
+				time_t now = syscalls::time(NULL);
+				time_t nextDeadline = removeExpiredInstances(now);
+				if (nextDeadline == 0) {
+					// Instances that become idle from now on won't
+					// expire before this time.
+					nextDeadline = now + maxIdleTime + 1;
+				}
+				
+				xtime xt;
+				xt.sec = nextDeadline;
+				xt.nsec = 0;
+				// If the condition was woken up, then either maxIdleTime
+				// changed or StandardApplicationPool is being destroyed.
+				// In both cases the loop condition and the deadline
+				// have to be checked again.
+				cleanerThreadSleeper.timed_wait(l, xt);
+			}
+		} catch (const exception &e) {
+			P_ERROR("Uncaught exception: " << e.what());
+		}
+	}
+	
+	/**
+	 * Samples the memory usage of all application instances, and retires
+	 * the instances that use more memory than their domain's memory limit.
+	 * The lock is released while /proc is being read.
+	 */
+	void memorySamplerThreadMainLoop() {
+		this_thread::disable_syscall_interruption dsi;
+		unique_lock<boost::mutex> l(lock);
+		vector<pid_t> pids;
+		map<pid_t, unsigned long> memory;
+		try {
+			while (!done && !this_thread::interruption_requested()) {
+				xtime xt;
+				xt.sec = syscalls::time(NULL) + memorySamplingInterval;
+				xt.nsec = 0;
+				memorySamplerThreadSleeper.timed_wait(l, xt);
+				if (done) {
+					break;
+				}
+				
+				DomainTable::const_iterator it;
+				AppContainerList::const_iterator lit;
+				
+				pids.clear();
+				for (it = domains.begin(); it != domains.end(); it++) {
+					if (*it != NULL) {
+						AppContainerList &instances((*it)->instances);
+						for (lit = instances.begin(); lit != instances.end(); lit++) {
+							if (!(*lit)->spawning) {
+								pids.push_back((*lit)->app->getPid());
+							}
+						}
+					}
+				}
+				
+				l.unlock();
+				memory.clear();
+				for (vector<pid_t>::const_iterator pit = pids.begin(); pit != pids.end(); pit++) {
+					memory[*pit] = getPrivateDirtyRSS(*pit);
+				}
+				l.lock();
+				
+				// Instances may have been added or removed in the mean
+				// time, so the samples are matched by PID.
+				for (it = domains.begin(); it != domains.end(); it++) {
+					DomainPtr domain(*it);
+					vector<AppContainerPtr> overLimit;
+					
+					if (domain == NULL) {
+						continue;
+					}
+					for (lit = domain->instances.begin(); lit != domain->instances.end(); lit++) {
+						const AppContainerPtr &container(*lit);
+						map<pid_t, unsigned long>::const_iterator mit;
+						
+						if (container->spawning) {
+							continue;
+						}
+						mit = memory.find(container->app->getPid());
+						if (mit == memory.end()) {
+							continue;
+						}
+						container->memory = mit->second;
+						if (domain->memoryLimit > 0 && !container->retiring
+						 && container->memory > domain->memoryLimit * 1024) {
+							overLimit.push_back(container);
+						}
+					}
+					for (vector<AppContainerPtr>::iterator oit = overLimit.begin();
+					     oit != overLimit.end(); oit++) {
+						P_WARN("Application instance " << domain->appRoot <<
+							" (PID " << (*oit)->app->getPid() << ") uses " <<
+							(*oit)->memory / 1024 << " MB of memory, which "
+							"exceeds its limit of " << domain->memoryLimit <<
+							" MB. It will be shut down.");
+						retireInstance(domain.get(), *oit);
+					}
+					if (!overLimit.empty()) {
+						// Replacement instances may be needed.
+						prespawnerThreadSleeper.notify_one();
+					}
+				}
+			}
+		} catch (const exception &e) {
+			P_ERROR("Uncaught exception: " << e.what());
+		}
+	}
+	
+	/**
+	 * Periodically predicts the demand for each domain for which predictive
+	 * spawning is enabled. The pre-spawner thread is woken up if a domain is
+	 * predicted to need more instances than it has, and surplus idle
+	 * instances are shut down.
+	 */
+	void demandPredictorThreadMainLoop() {
+		this_thread::disable_syscall_interruption dsi;
+		unique_lock<boost::mutex> l(lock);
+		try {
+			while (!done && !this_thread::interruption_requested()) {
+				xtime xt;
+				xt.sec = syscalls::time(NULL) + predictionInterval;
+				xt.nsec = 0;
+				demandPredictorThreadSleeper.timed_wait(l, xt);
+				if (done) {
+					break;
+				}
+				
+				time_t now = syscalls::time(NULL);
+				bool spawnNeeded = false;
+				DomainTable::const_iterator it;
+				
+				for (it = domains.begin(); it != domains.end(); it++) {
+					Domain *domain = it->get();
+					
+					if (domain == NULL || !domain->predictiveSpawning) {
+						continue;
+					}
+					domain->predictedSize = domain->predictedDemand(now);
+					if (domain->predictedSize > domain->size) {
+						spawnNeeded = true;
+					} else {
+						trimSurplusInstances(domain, now);
+					}
+				}
+				if (spawnNeeded) {
+					prespawnerThreadSleeper.notify_one();
+				}
+			}
+		} catch (const exception &e) {
+			P_ERROR("Uncaught exception: " << e.what());
+		}
+	}
+	
+	/**
+	 * Shut down the idle instances of the given domain that it isn't
+	 * predicted to need, least recently used first. Instances that have been
+	 * idle for less than <tt>predictionInterval</tt> seconds are kept, and so
+	 * are the domain's minimum number of instances and at least one other.
+	 *
+	 * @pre The lock is held, and <tt>domain</tt> is in _domains_.
+	 */
+	void trimSurplusInstances(Domain *domain, time_t now) {
+		unsigned long keep = domain->prespawnTarget();
+		
+		if (keep == 0) {
+			keep = 1;
+		}
+		while (domain->size > keep && domain->hasIdleInstance()) {
+			AppContainerPtr container(domain->buckets[0].back());
+			if (now - container->lastUsed < (time_t) predictionInterval) {
+				break;
+			}
+			P_DEBUG("Shutting down surplus idle instance of " << domain->appRoot <<
+				" (PID " << container->app->getPid() << ")");
+			removeInactiveContainer(container);
+		}
+	}
+	
+	/**
+	 * Returns the number of instances that the pre-spawner thread should
+	 * keep around for the given application, whose pre-spawn options are
+	 * <tt>options</tt>.
+	 */
+	unsigned long prespawnTarget(unsigned int appId, const PoolOptions &options) const {
+		const Domain *domain = domains[appId].get();
+		if (domain == NULL) {
+			return options.minInstances;
+		} else {
+			return domain->prespawnTarget();
+		}
+	}
+	
+	/**
+	 * Returns whether a new instance may be spawned for a domain with the
+	 * given size, without having to shut down other instances.
+	 */
+	bool canSpawnWithoutEviction(unsigned int domainSize) const {
+		return count < max && (maxPerApp == 0 || domainSize < maxPerApp);
+	}
+	
+	void prespawnerThreadMainLoop() {
+		this_thread::disable_interruption di;
+		this_thread::disable_syscall_interruption dsi;
+		unique_lock<boost::mutex> l(lock);
+		try {
+			while (!done) {
+				map<unsigned int, PoolOptions>::const_iterator it;
+				unsigned int appId = 0;
+				PoolOptions options;
+				bool found = false;
+				
+				for (it = prespawnOptions.begin(); it != prespawnOptions.end() && !found; it++) {
+					unsigned int size;
+					
+					if (domains[it->first] == NULL) {
+						size = 0;
+					} else {
+						size = domains[it->first]->size;
+					}
+					if (size < prespawnTarget(it->first, it->second)
+					 && canSpawnWithoutEviction(size)) {
+						appId = it->first;
+						options = it->second;
+						found = true;
+					}
+				}
+				if (!found) {
+					joinFinishedReplacementThreads();
+					if (!continueRollingRestarts(l)) {
+						prespawnerThreadSleeper.wait(l);
+					}
+					continue;
+				}
+				
+				DomainPtr domain;
+				AppContainerPtr container;
+				
+				domain = domains[appId];
+				if (domain == NULL) {
+					domain = createDomain(appId, options);
+				}
+				
+				P_DEBUG("Pre-spawning an instance of " << options.appRoot);
+				try {
+					container = spawnInstance(l, options, domain, di, dsi);
+				} catch (const thread_interrupted &) {
+					throw;
+				} catch (const exception &e) {
+					// Don't retry until the application has been
+					// successfully spawned by get().
+					P_WARN("Cannot pre-spawn application '" << options.appRoot <<
+						"': " << e.what());
+					prespawnOptions.erase(appId);
+					continue;
+				}
+				
+				if (container != NULL) {
+					// The new instance is idle.
+					data->containerBecameIdle(domain.get(), container);
+					data->wakeUpServableWaiters(domain.get());
+				}
+			}
+		} catch (const thread_interrupted &) {
+			// StandardApplicationPool is being destroyed.
+		} catch (const exception &e) {
+			P_ERROR("Uncaught exception: " << e.what());
+		}
+	}
+	
+	/**
+	 * Returns an old instance of the given domain, i.e. one that has been
+	 * spawned before the current rolling restart began, and that hasn't been
+	 * retired yet. Idle instances are preferred. Returns a NULL pointer if
+	 * there is no such instance.
+	 */
+	AppContainerPtr findOldInstance(Domain *domain) const {
+		AppContainerList::const_iterator it;
+		AppContainerPtr result;
+		
+		for (it = domain->instances.begin(); it != domain->instances.end(); it++) {
+			const AppContainerPtr &container(*it);
+			if (container->generation != domain->generation
+			 && !container->spawning && !container->retiring) {
+				if (!container->isActive()) {
+					return container;
+				} else if (result == NULL) {
+					result = container;
+				}
+			}
+		}
+		return result;
+	}
+	
+	/**
+	 * Retire the given instance, e.g. because of a rolling restart or
+	 * because it uses too much memory. If it's idle then it's removed from
+	 * the pool immediately. Otherwise it won't be used for new sessions
+	 * anymore, and it will be removed as soon as its last session has been
+	 * closed.
+	 *
+	 * @pre <tt>!container->spawning && !container->retiring</tt>
+	 */
+	void retireInstance(Domain *domain, const AppContainerPtr &container) {
+		P_DEBUG("Retiring " << domain->appRoot << " (PID " <<
+			container->app->getPid() << ")");
+		if (container->isActive()) {
+			domain->removeFromBucket(container);
+			container->retiring = true;
+			domain->retiring++;
+		} else {
+			// A thread that's waiting for an instance of this
+			// domain might now be able to spawn one.
+			wakeUpWaiter(domain->waiters);
+			removeInactiveContainer(container);
+		}
+	}
+	
+	/**
+	 * Start a thread that spawns an instance that replaces an old instance
+	 * of the given domain. Returns once the new instance's slot has been
+	 * reserved, so that the caller can base its next decision on the
+	 * pool's new size.
+	 *
+	 * @pre The lock is held.
+	 * @post The lock is held.
+	 */
+	void startReplacement(boost::mutex::scoped_lock &l, const PoolOptions &options,
+	                      const DomainPtr &domain) {
+		P_DEBUG("Spawning a replacement instance of " << options.appRoot);
+		domain->replacing++;
+		startingReplacements++;
+		try {
+			replacementThreads.push_back(new boost::thread(
+				bind(&StandardApplicationPool::replacementThreadMain, this,
+					options, domain),
+				REPLACEMENT_THREAD_STACK_SIZE
+			));
+		} catch (...) {
+			domain->replacing--;
+			startingReplacements--;
+			throw;
+		}
+		while (startingReplacements > 0) {
+			prespawnerThreadSleeper.wait(l);
+		}
+	}
+	
+	void replacementThreadMain(const PoolOptions &options, const DomainPtr &domain) {
+		this_thread::disable_interruption di;
+		this_thread::disable_syscall_interruption dsi;
+		boost::mutex::scoped_lock l(lock);
+		
+		try {
+			spawnReplacement(l, options, domain, di, dsi);
+		} catch (const thread_interrupted &) {
+			// StandardApplicationPool is being destroyed.
+		} catch (const exception &e) {
+			P_ERROR("Uncaught exception: " << e.what());
+		}
+		finishedReplacementThreads.push_back(this_thread::get_id());
+		// Let the pre-spawner thread join this thread, and continue
+		// the rolling restart.
+		prespawnerThreadSleeper.notify_one();
+	}
+	
+	/**
+	 * Joins and deletes the replacement threads that have finished.
+	 *
+	 * @pre The lock is held.
+	 */
+	void joinFinishedReplacementThreads() {
+		vector<boost::thread::id>::const_iterator id;
+		list<boost::thread *>::iterator it;
+		
+		for (id = finishedReplacementThreads.begin(); id != finishedReplacementThreads.end(); id++) {
+			for (it = replacementThreads.begin(); it != replacementThreads.end(); it++) {
+				if ((*it)->get_id() == *id) {
+					// The thread only has to return, which doesn't
+					// involve the lock.
+					(*it)->join();
+					delete *it;
+					replacementThreads.erase(it);
+					break;
+				}
+			}
+		}
+		finishedReplacementThreads.clear();
+	}
+	
+	/**
+	 * Spawn an instance that replaces an old instance of the given domain,
+	 * and retire the old instance once the new one is ready. If the new
+	 * instance cannot be spawned, then the rolling restart is aborted and
+	 * the old instances are kept. <tt>domain->replacing</tt> must already
+	 * have been incremented for this replacement; it's decremented when
+	 * spawning has finished.
+	 *
+	 * Called by a replacement thread, which reports to the pre-spawner
+	 * thread (through _startingReplacements_) once the new instance's slot
+	 * has been reserved.
+	 *
+	 * @pre The lock is held.
+	 * @post The lock is held.
+	 * @throws boost::thread_interrupted
+	 */
+	void spawnReplacement(boost::mutex::scoped_lock &l, const PoolOptions &options,
+	                      const DomainPtr &domain,
+	                      this_thread::disable_interruption &di,
+	                      this_thread::disable_syscall_interruption &dsi) {
+		AppContainerPtr container;
+		
+		// spawnInstance() reserves a slot before it releases the lock, so
+		// the pre-spawner thread will see it once it wakes up.
+		startingReplacements--;
+		prespawnerThreadSleeper.notify_one();
+		try {
+			container = spawnInstance(l, options, domain, di, dsi);
+		} catch (const thread_interrupted &) {
+			domain->replacing--;
+			throw;
+		} catch (const exception &e) {
+			domain->replacing--;
+			P_WARN("Cannot spawn a replacement instance of application '" <<
+				options.appRoot << "': " << e.what() << ". Aborting the "
+				"rolling restart; the old instances will be kept.");
+			if (domains[domain->appId] == domain) {
+				AppContainerList::iterator it;
+				for (it = domain->instances.begin(); it != domain->instances.end(); it++) {
+					(*it)->generation = domain->generation;
+				}
+				rollingRestarts.erase(domain->appId);
+			}
+			return;
+		}
+		domain->replacing--;
+		
+		if (container != NULL) {
+			AppContainerPtr old(findOldInstance(domain.get()));
+			if (old != NULL) {
+				retireInstance(domain.get(), old);
+			}
+			// The new instance is idle.
+			data->containerBecameIdle(domain.get(), container);
+			data->wakeUpServableWaiters(domain.get());
+		}
+	}
+	
+	/**
+	 * Make progress on one of the rolling restarts that are in progress, if
+	 * possible. At most <tt>rollingRestartConcurrency</tt> replacement
+	 * instances are spawned at the same time for an application, each by its
+	 * own thread. If the pool is full, then idle old instances are retired
+	 * before their replacements are spawned, provided that the application
+	 * has other instances to handle requests in the mean time.
+	 *
+	 * Returns whether anything has been done.
+	 *
+	 * @pre The lock is held.
+	 * @post The lock is held.
+	 */
+	bool continueRollingRestarts(boost::mutex::scoped_lock &l) {
+		map<unsigned int, PoolOptions>::iterator it(rollingRestarts.begin());
+		
+		while (it != rollingRestarts.end()) {
+			DomainPtr domain(domains[it->first]);
+			unsigned int oldInstances = 0;
+			unsigned int oldSpawning = 0;
+			AppContainerList::const_iterator lit;
+			
+			if (domain != NULL) {
+				for (lit = domain->instances.begin(); lit != domain->instances.end(); lit++) {
+					const AppContainerPtr &container(*lit);
+					if (container->generation != domain->generation && !container->retiring) {
+						if (container->spawning) {
+							oldSpawning++;
+						} else {
+							oldInstances++;
+						}
+					}
+				}
+			}
+			if (domain == NULL || (oldInstances == 0 && oldSpawning == 0
+			 && domain->replacing == 0)) {
+				// The rolling restart has finished, or the application
+				// has been removed from the pool.
+				rollingRestarts.erase(it++);
+				continue;
+			}
 			
-			AppContainerList::const_iterator prev_lit;
-			AppContainerList::const_iterator lit;
-			prev_lit = instances->begin();
-			lit = prev_lit;
-			lit++;
-			for (; lit != instances->end(); lit++) {
-				if ((*prev_lit)->sessions > 0) {
-					P_ASSERT((*lit)->sessions > 0, false,
-						"domains['" << appRoot << "'].instances "
-						"is sorted from nonactive to active");
+			if (domain->replacing < oldInstances
+			 && domain->replacing < it->second.rollingRestartConcurrency) {
+				if (canSpawnWithoutEviction(domain->size)) {
+					PoolOptions options(it->second);
+					startReplacement(l, options, domain);
+					return true;
+				}
+				
+				AppContainerPtr old(findOldInstance(domain.get()));
+				unsigned int usable = domain->size - domain->spawning - domain->retiring;
+				if (old != NULL && !old->isActive() && usable > 1) {
+					retireInstance(domain.get(), old);
+					return true;
 				}
 			}
+			it++;
 		}
-		P_ASSERT(totalSize == count, false, "(sum of all d.size in domains) == count");
-		
-		P_ASSERT(active <= count, false,
-			"active (" << active << ") < count (" << count << ")");
-		P_ASSERT(inactiveApps.size() == count - active, false,
-			"inactive_apps.size() == count - active");
-	#endif
-		return true;
+		return false;
 	}
 	
-	template<typename LockActionType>
-	string toString(LockActionType lockAction) const {
-		unique_lock<boost::mutex> l(lock, lockAction);
-		stringstream result;
-		
-		result << "----------- General information -----------" << endl;
-		result << "max      = " << max << endl;
-		result << "count    = " << count << endl;
-		result << "active   = " << active << endl;
-		result << "inactive = " << inactiveApps.size() << endl;
-		result << "Waiting on global queue: " << waitingOnGlobalQueue << endl;
-		result << endl;
+	/**
+	 * Returns the application ID for the given application root,
+	 * assigning a new one if necessary.
+	 */
+	unsigned int getAppId(const string &appRoot) {
+		boost::mutex::scoped_lock l(appIdsLock);
+		map<string, unsigned int>::const_iterator it(appIds.find(appRoot));
 		
-		result << "----------- Domains -----------" << endl;
-		DomainMap::const_iterator it;
-		for (it = domains.begin(); it != domains.end(); it++) {
-			Domain *domain = it->second.get();
-			AppContainerList *instances = &domain->instances;
-			AppContainerList::const_iterator lit;
-			
-			result << it->first << ": " << endl;
-			for (lit = instances->begin(); lit != instances->end(); lit++) {
-				AppContainer *container = lit->get();
-				char buf[128];
-				
-				snprintf(buf, sizeof(buf),
-						"PID: %-5lu   Sessions: %-2u   Processed: %-5u   Uptime: %s",
-						(unsigned long) container->app->getPid(),
-						container->sessions,
-						container->processed,
-						container->uptime().c_str());
-				result << "  " << buf << endl;
-			}
-			result << endl;
+		if (it == appIds.end()) {
+			unsigned int appId = appIds.size();
+			appIds[appRoot] = appId;
+			return appId;
+		} else {
+			return it->second;
 		}
-		return result.str();
 	}
 	
-	bool needsRestart(const string &appRoot) {
-		string restartFile(appRoot);
-		restartFile.append("/tmp/restart.txt");
+	/**
+	 * Create a new, empty Domain for the given application ID and
+	 * add it to _domains_. Its first instance must be added immediately.
+	 */
+	DomainPtr createDomain(unsigned int appId, const PoolOptions &options) {
+		DomainPtr domain(new Domain());
+		domain->appId = appId;
+		domain->appRoot = options.appRoot;
+		domain->restartDir = options.appRoot + "/tmp";
+		domain->restartFile = domain->restartDir + "/restart.txt";
+		domain->size = 0;
+		domain->spawning = 0;
+		domain->maxRequests = options.maxRequests;
+		domain->minInstances = options.minInstances;
+		domain->memoryLimit = options.memoryLimit;
+		domain->weight = options.poolWeight;
+		domain->concurrency = options.instanceConcurrency;
+		domains[appId] = domain;
+		return domain;
+	}
+	
+	/**
+	 * Spawn a new application instance for the given domain. The pool lock
+	 * is released while the spawn server is busy, so that get() calls for
+	 * other applications aren't blocked by a slow application startup. In
+	 * the mean time, a placeholder AppContainer reserves the instance's slot
+	 * in <tt>count</tt>, <tt>active</tt> and <tt>domain->size</tt>.
+	 *
+	 * Returns the new AppContainer, which is active and has 0 sessions.
+	 * Returns a NULL pointer if the domain has been removed from the pool
+	 * while spawning (e.g. because of a restart or a clear()); the caller
+	 * should start over in that case.
+	 *
+	 * If spawning fails, then as many threads that are waiting for an
+	 * instance of the domain as may spawn one are woken up (all of them if
+	 * the domain has no instances left). If it succeeds,
+	 * then nobody is woken up; the caller is to hand over the new instance's
+	 * spare capacity to the waiting threads.
+	 *
+	 * @pre The lock is held, and <tt>domainPtr</tt> is in _domains_.
+	 * @post The lock is held.
+	 * @throws boost::thread_interrupted
+	 * @throws SpawnException
+	 * @throws SystemException
+	 */
+	AppContainerPtr spawnInstance(boost::mutex::scoped_lock &l, const PoolOptions &options,
+	                              DomainPtr domainPtr,
+	                              this_thread::disable_interruption &di,
+	                              this_thread::disable_syscall_interruption &dsi) {
+		Domain *domain = domainPtr.get();
+		AppContainerList *instances = &domain->instances;
+		AppContainerPtr container(new AppContainer());
+		ApplicationPtr app;
 		
-		struct stat buf;
-		bool result;
-		int ret;
+		container->appId = domain->appId;
+		container->sessions = 0;
+		container->spawning = true;
+		container->generation = domain->generation;
+		instances->push_back(container);
+		container->iterator = instances->end();
+		container->iterator--;
+		domain->size++;
+		domain->spawning++;
+		count++;
+		active++;
 		
-		do {
-			ret = stat(restartFile.c_str(), &buf);
-		} while (ret == -1 && errno == EINTR);
-		if (ret == 0) {
-			do {
-				ret = unlink(restartFile.c_str());
-			} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
-			if (ret == 0 || errno == ENOENT) {
-				restartFileTimes.erase(appRoot);
-				result = true;
-			} else {
-				map<string, time_t>::const_iterator it;
-				
-				it = restartFileTimes.find(appRoot);
-				if (it == restartFileTimes.end()) {
-					result = true;
+		l.unlock();
+		system_time startTime(get_system_time());
+		try {
+			this_thread::restore_interruption ri(di);
+			this_thread::restore_syscall_interruption rsi(dsi);
+			app = spawnManager.spawn(options);
+		} catch (...) {
+			l.lock();
+			if (domains[domain->appId] == domainPtr) {
+				instances->erase(container->iterator);
+				domain->size--;
+				domain->spawning--;
+				count--;
+				active--;
+				wakeUpWaiter(globalWaiters);
+				if (instances->empty()) {
+					// Nobody will hand an instance over to the
+					// remaining waiters anymore.
+					wakeUpAllWaiters(domain->waiters);
+					domains[domain->appId].reset();
 				} else {
-					result = buf.st_mtime != restartFileTimes[appRoot];
+					data->wakeUpServableWaiters(domain);
 				}
-				restartFileTimes[appRoot] = buf.st_mtime;
 			}
+			throw;
+		}
+		l.lock();
+		
+		if (domains[domain->appId] == domainPtr) {
+			container->app = app;
+			container->spawning = false;
+			domain->recordSpawnTime((get_system_time() - startTime)
+				.total_milliseconds() / 1000.0);
+			domain->addToBucket(container);
+			domain->spawning--;
+			return container;
 		} else {
-			restartFileTimes.erase(appRoot);
-			result = false;
+			// The placeholder has already been removed from the pool,
+			// so the spawned instance is obsolete.
+			return AppContainerPtr();
 		}
-		return result;
 	}
 	
-	void cleanerThreadMainLoop() {
-		this_thread::disable_syscall_interruption dsi;
-		unique_lock<boost::mutex> l(lock);
-		try {
-			while (!done && !this_thread::interruption_requested()) {
-				xtime xt;
-				xtime_get(&xt, TIME_UTC);
-				xt.sec += maxIdleTime + 1;
-				if (cleanerThreadSleeper.timed_wait(l, xt)) {
-					// Condition was woken up.
-					if (done) {
-						// StandardApplicationPool is being destroyed.
-						break;
-					} else {
-						// maxIdleTime changed.
-						continue;
-					}
-				}
-				
-				time_t now = syscalls::time(NULL);
-				AppContainerList::iterator it;
-				for (it = inactiveApps.begin(); it != inactiveApps.end(); it++) {
-					AppContainer &container(*it->get());
-					ApplicationPtr app(container.app);
-					Domain *domain = domains[app->getAppRoot()].get();
-					AppContainerList *instances = &domain->instances;
-					
-					if (maxIdleTime > 0 &&  
-					   (now - container.lastUsed > (time_t) maxIdleTime)) {
-						P_DEBUG("Cleaning idle app " << app->getAppRoot() <<
-							" (PID " << app->getPid() << ")");
-						instances->erase(container.iterator);
-						
-						AppContainerList::iterator prev = it;
-						prev--;
-						inactiveApps.erase(it);
-						it = prev;
-						
-						domain->size--;
-						
-						count--;
-					}
-					if (instances->empty()) {
-						domains.erase(app->getAppRoot());
-						data->restartFileTimes.erase(app->getAppRoot());
-					}
-				}
+	/**
+	 * Wait in the given queue until another thread wakes us up. The queue
+	 * is ordered by ticket. If _ticket_ is 0, then we haven't waited before:
+	 * a new ticket is assigned to it and we're put at the end of the queue.
+	 * Otherwise we've waited before, and we're put back in our original
+	 * position, so that we don't lose our turn.
+	 *
+	 * Returns the AppContainer that has been handed over to us, if any.
+	 *
+	 * @pre The lock is held.
+	 * @post The lock is held.
+	 * @throws BusyException The queue already contains
+	 *    <tt>options.maxQueueLength</tt> waiters, or _deadline_ has passed.
+	 */
+	AppContainerPtr waitInQueue(boost::mutex::scoped_lock &l, WaiterList &queue,
+	                            unsigned long long &ticket, const PoolOptions &options,
+	                            const system_time &deadline) {
+		WaiterList::iterator it;
+		
+		if (ticket != 0) {
+			// Older waiters are usually near the front of the queue.
+			it = queue.begin();
+			while (it != queue.end() && (*it)->ticket < ticket) {
+				it++;
+			}
+		} else if (options.maxQueueLength > 0 && queueIsFull(queue, options.maxQueueLength)) {
+			throw BusyException("Too many requests are waiting for an "
+				"instance of application '" + options.appRoot + "'.");
+		} else {
+			ticket = nextTicket++;
+			it = queue.end();
+		}
+		
+		Waiter waiter(ticket, options.useGlobalQueue);
+		it = queue.insert(it, &waiter);
+		while (!waiter.woken) {
+			if (deadline.is_pos_infinity()) {
+				waiter.cond.wait(l);
+			} else if (!waiter.cond.timed_wait(l, deadline) && !waiter.woken) {
+				queue.erase(it);
+				throw BusyException("Timed out after having waited for " +
+					Passenger::toString(options.maxQueueTime) + " ms for an instance "
+					"of application '" + options.appRoot + "'.");
+			}
+		}
+		wakeups++;
+		return waiter.container;
+	}
+	
+	/**
+	 * Returns whether the given queue contains at least _maxLength_ waiters.
+	 * Only the first _maxLength_ list nodes are visited.
+	 */
+	static bool queueIsFull(const WaiterList &queue, unsigned long maxLength) {
+		WaiterList::const_iterator it(queue.begin());
+		unsigned long length = 0;
+		
+		while (it != queue.end() && length < maxLength) {
+			it++;
+			length++;
+		}
+		return length >= maxLength;
+	}
+	
+	/**
+	 * Wait until an instance of the given domain has been handed over to us,
+	 * or until we're woken up for another reason.
+	 *
+	 * Returns the handed over AppContainer, on which a session has already been
+	 * reserved. Returns a NULL pointer if the caller should try again.
+	 *
+	 * @pre The lock is held.
+	 * @post The lock is held.
+	 */
+	AppContainerPtr waitForInstance(boost::mutex::scoped_lock &l, const DomainPtr &domain,
+	                                bool &waited, unsigned long long &ticket,
+	                                const PoolOptions &options, const system_time &deadline) {
+		AppContainerPtr container(waitInQueue(l, domain->waiters, ticket, options, deadline));
+		waited = true;
+		if (container != NULL) {
+			if (domains[domain->appId] != domain) {
+				// The domain has been removed from the pool in the mean
+				// time, and the instance along with it.
+				container.reset();
 			}
-		} catch (const exception &e) {
-			P_ERROR("Uncaught exception: " << e.what());
 		}
+		return container;
 	}
 	
 	/**
 	 * Spawn a new application instance, or use an existing one that's in the pool.
+	 * A session is reserved on the returned AppContainer.
+	 *
+	 * Threads that cannot be served immediately wait in FIFO order: either in
+	 * the domain's queue, until an instance of that domain is handed over to
+	 * them or can be spawned, or in the global queue, until <tt>active</tt>
+	 * drops below <tt>max</tt>. The queues' lengths, and the total time spent
+	 * waiting, are limited by <tt>options.maxQueueLength</tt> and
+	 * <tt>options.maxQueueTime</tt>.
 	 *
 	 * @throws boost::thread_interrupted
 	 * @throws SpawnException
 	 * @throws SystemException
+	 * @throws BusyException
 	 */
 	pair<AppContainerPtr, Domain *>
-	spawnOrUseExisting(boost::mutex::scoped_lock &l, const PoolOptions &options) {
+	spawnOrUseExisting(boost::mutex::scoped_lock &l, unsigned int appId,
+	                   const PoolOptions &options) {
+		bool waited = false;
+		// Our position in the wait queues, once we've had to wait.
+		unsigned long long ticket = 0;
+		system_time deadline;
+		
+		if (options.maxQueueTime > 0) {
+			deadline = get_system_time() + posix_time::milliseconds(options.maxQueueTime);
+		} else {
+			deadline = system_time(posix_time::pos_infin);
+		}
+		
 		beginning_of_function:
 		
 		this_thread::disable_interruption di;
@@ -439,125 +2352,138 @@ private:
 		AppContainerPtr container;
 		Domain *domain;
 		AppContainerList *instances;
+		// Whether _container_ has been handed over to us by another
+		// thread, in which case a session has already been reserved.
+		bool handedOver = false;
+		// Whether _container_ has just been spawned by us.
+		bool spawned = false;
 		
 		try {
-			DomainMap::iterator it(domains.find(appRoot));
-			
-			if (it != domains.end() && needsRestart(appRoot)) {
-				AppContainerList::iterator it2;
-				instances = &it->second->instances;
-				for (it2 = instances->begin(); it2 != instances->end(); it2++) {
-					container = *it2;
-					if (container->sessions == 0) {
-						inactiveApps.erase(container->ia_iterator);
-					} else {
-						active--;
+			if (domains[appId] != NULL && needsRestart(domains[appId].get(), options)) {
+				if (options.rollingRestartConcurrency > 0 && domains[appId]->hasUsableInstance()) {
+					// Let the pre-spawner thread replace the instances in the
+					// background, while the current ones keep serving requests.
+					P_DEBUG("Beginning a rolling restart of " << appRoot);
+					spawnManager.reload(appRoot);
+					domains[appId]->generation++;
+					rollingRestarts[appId] = options;
+					prespawnerThreadSleeper.notify_one();
+				} else {
+					AppContainerList::iterator it2;
+					instances = &domains[appId]->instances;
+					for (it2 = instances->begin(); it2 != instances->end(); it2++) {
+						container = *it2;
+						if (!container->isActive()) {
+							data->removeFromInactiveApps(container);
+						} else {
+							active--;
+						}
+						it2--;
+						instances->erase(container->iterator);
+						count--;
 					}
-					it2--;
-					instances->erase(container->iterator);
-					count--;
+					wakeUpAllWaiters(domains[appId]->waiters);
+					domains[appId].reset();
+					spawnManager.reload(appRoot);
+					wakeUpAllWaiters(globalWaiters);
 				}
-				domains.erase(appRoot);
-				spawnManager.reload(appRoot);
-				it = domains.end();
-				activeOrMaxChanged.notify_all();
 			}
 			
-			if (it != domains.end()) {
-				domain = it->second.get();
+			if (domains[appId] != NULL) {
+				DomainPtr domainPtr(domains[appId]);
+				domain = domainPtr.get();
 				instances = &domain->instances;
 				
-				if (instances->front()->sessions == 0) {
-					container = instances->front();
-					instances->pop_front();
-					instances->push_back(container);
-					container->iterator = instances->end();
-					container->iterator--;
-					inactiveApps.erase(container->ia_iterator);
-					active++;
-					activeOrMaxChanged.notify_all();
+				if (domain->hasSpareCapacity()) {
+					container = domain->leastBusyInstance();
+					if (container->sessions == 0) {
+						data->removeFromInactiveApps(container);
+						active++;
+					}
+				} else if (!domain->hasUsableInstance() && domain->spawning > 0) {
+					// All instances for this domain are still being
+					// spawned, or are being retired. Wait until one of
+					// them is ready, or until spawning has failed.
+					container = waitForInstance(l, domainPtr, waited, ticket, options, deadline);
+					if (container == NULL) {
+						goto beginning_of_function;
+					}
+					handedOver = true;
+				} else if (count >= max && (maxPerApp == 0 || domain->size < maxPerApp)
+				        && reclaimSlot(domain)) {
+					// The pool is full, but other applications occupy
+					// part of this application's share of it.
+					container = spawnInstance(l, options, domainPtr, di, dsi);
+					if (container == NULL) {
+						goto beginning_of_function;
+					}
+					spawned = true;
 				} else if (count >= max || (
 					maxPerApp != 0 && domain->size >= maxPerApp )
 					) {
 					if (options.useGlobalQueue) {
 						waitingOnGlobalQueue++;
-						activeOrMaxChanged.wait(l);
+						try {
+							container = waitForInstance(l, domainPtr, waited, ticket, options, deadline);
+						} catch (...) {
+							waitingOnGlobalQueue--;
+							throw;
+						}
 						waitingOnGlobalQueue--;
-						goto beginning_of_function;
-					} else {
-						AppContainerList::iterator it(instances->begin());
-						AppContainerList::iterator smallest(instances->begin());
-						it++;
-						for (; it != instances->end(); it++) {
-							if ((*it)->sessions < (*smallest)->sessions) {
-								smallest = it;
-							}
+						if (container == NULL) {
+							goto beginning_of_function;
 						}
-						container = *smallest;
-						instances->erase(smallest);
-						instances->push_back(container);
-						container->iterator = instances->end();
-						container->iterator--;
+						handedOver = true;
+					} else if (!domain->hasUsableInstance()) {
+						// All instances are being retired. Wait until
+						// one of them has been removed.
+						container = waitForInstance(l, domainPtr, waited, ticket, options, deadline);
+						if (container == NULL) {
+							goto beginning_of_function;
+						}
+						handedOver = true;
+					} else {
+						container = domain->leastBusyInstance();
 					}
 				} else {
-					container = ptr(new AppContainer());
-					{
-						this_thread::restore_interruption ri(di);
-						this_thread::restore_syscall_interruption rsi(dsi);
-						container->app = spawnManager.spawn(options);
+					container = spawnInstance(l, options, domainPtr, di, dsi);
+					if (container == NULL) {
+						goto beginning_of_function;
 					}
-					container->sessions = 0;
-					instances->push_back(container);
-					container->iterator = instances->end();
-					container->iterator--;
-					domain->size++;
-					count++;
-					active++;
-					activeOrMaxChanged.notify_all();
+					spawned = true;
 				}
 			} else {
-				if (active >= max) {
-					activeOrMaxChanged.wait(l);
+				if (active >= max || (!globalWaiters.empty() && !waited)) {
+					// Don't overtake threads that are already waiting
+					// for a free slot. If there is one, then let the
+					// oldest waiter have it.
+					if (active < max) {
+						wakeUpWaiter(globalWaiters);
+					}
+					waitInQueue(l, globalWaiters, ticket, options, deadline);
+					waited = true;
 					goto beginning_of_function;
 				} else if (count == max) {
-					container = inactiveApps.front();
-					inactiveApps.pop_front();
-					domain = domains[container->app->getAppRoot()].get();
-					instances = &domain->instances;
-					instances->erase(container->iterator);
-					if (instances->empty()) {
-						domains.erase(container->app->getAppRoot());
-						restartFileTimes.erase(container->app->getAppRoot());
-					} else {
-						domain->size--;
-					}
-					count--;
-				}
-				container = ptr(new AppContainer());
-				{
-					this_thread::restore_interruption ri(di);
-					this_thread::restore_syscall_interruption rsi(dsi);
-					container->app = spawnManager.spawn(options);
-				}
-				container->sessions = 0;
-				it = domains.find(appRoot);
-				if (it == domains.end()) {
-					domain = new Domain();
-					domain->size = 1;
-					domain->maxRequests = options.maxRequests;
-					domains[appRoot] = ptr(domain);
-				} else {
-					domain = it->second.get();
-					domain->size++;
+					// Prefer to shut down an instance of an application
+					// that uses more than its share of the pool.
+					AppContainerPtr victim(findEvictionVictim(
+						totalWeight() + options.poolWeight, false));
+					P_DEBUG("Shutting down an idle instance of " <<
+						domains[victim->appId]->appRoot << " to make room for " <<
+						appRoot);
+					removeInactiveContainer(victim);
 				}
-				instances = &domain->instances;
-				instances->push_back(container);
-				container->iterator = instances->end();
-				container->iterator--;
-				count++;
-				active++;
-				activeOrMaxChanged.notify_all();
+				
+				DomainPtr domainPtr(createDomain(appId, options));
+				domain = domainPtr.get();
+				container = spawnInstance(l, options, domainPtr, di, dsi);
+				if (container == NULL) {
+					goto beginning_of_function;
+				}
+				spawned = true;
 			}
+		} catch (const BusyException &) {
+			throw;
 		} catch (const SpawnException &e) {
 			string message("Cannot spawn application '");
 			message.append(appRoot);
@@ -576,9 +2502,46 @@ private:
 			throw SpawnException(message);
 		}
 		
+		if (waited) {
+			usefulWakeups++;
+		}
+		if (handedOver) {
+			return make_pair(container, domain);
+		}
+		if (active < max && !globalWaiters.empty()) {
+			// More than one slot might have been freed in the mean time.
+			wakeUpWaiter(globalWaiters);
+		}
+		container->lastUsed = time(NULL);
+		domain->setSessions(container, container->sessions + 1);
+		if (spawned) {
+			// Threads that have been waiting for this instance may use
+			// its spare capacity, and as many of the others as the
+			// limits allow may spawn instances of their own.
+			data->handOverToWaiters(domain, container);
+			data->wakeUpServableWaiters(domain);
+		}
 		return make_pair(container, domain);
 	}
 	
+	/**
+	 * Open a new session on the given container's application instance.
+	 * Session objects and their reference counts are taken from free lists,
+	 * so this doesn't allocate memory once the pool has warmed up.
+	 *
+	 * @throws SystemException
+	 * @throws IOException
+	 */
+	Application::SessionPtr openSession(const AppContainerPtr &container) {
+		PooledSession *session = data->acquireSession();
+		Application::SessionPtr result(session, SessionRecycler(data),
+			SessionBlockAllocator<PooledSession>(data));
+		int fd = container->app->openConnection();
+		session->open(container->app->getPid(), fd,
+			SessionCloseCallback(data, container));
+		return result;
+	}
+	
 public:
 	/**
 	 * Create a new StandardApplicationPool object.
@@ -596,29 +2559,40 @@ public:
 	 *             running as root. If the empty string is given, or if
 	 *             the <tt>user</tt> is not a valid username, then
 	 *             the spawn manager will be run as the current user.
-	 * @param rubyCommand The Ruby interpreter's command.
+	 * @param maxConcurrentSpawns The maximum number of application instances
+	 *             that may be spawned concurrently. See SpawnManager for details.
+	 * @param watchRestartFiles Whether applications' tmp directories should be
+	 *             watched for changes to restart.txt with inotify, so that
+	 *             get() doesn't have to check restart.txt on every call. Has
+	 *             no effect on systems that don't support inotify.
 	 * @throws SystemException An error occured while trying to setup the spawn server.
 	 * @throws IOException The specified log file could not be opened.
 	 */
 	StandardApplicationPool(const string &spawnServerCommand,
 	             const string &logFile = "",
 	             const string &rubyCommand = "ruby",
-	             const string &user = "")
+	             const string &user = "",
+	             unsigned int maxConcurrentSpawns = 1,
+	             bool watchRestartFiles = false)
 	        :
 		#ifndef PASSENGER_USE_DUMMY_SPAWN_MANAGER
-		spawnManager(spawnServerCommand, logFile, rubyCommand, user),
+		spawnManager(spawnServerCommand, logFile, rubyCommand, user,
+			maxConcurrentSpawns),
 		#endif
 		data(new SharedData()),
 		lock(data->lock),
-		activeOrMaxChanged(data->activeOrMaxChanged),
 		domains(data->domains),
 		max(data->max),
 		count(data->count),
 		active(data->active),
 		maxPerApp(data->maxPerApp),
 		inactiveApps(data->inactiveApps),
-		restartFileTimes(data->restartFileTimes),
-		appInstanceCount(data->appInstanceCount)
+		restartFiles(data->restartFiles),
+		appInstanceCount(data->appInstanceCount),
+		prespawnOptions(data->prespawnOptions),
+		rollingRestarts(data->rollingRestarts),
+		prespawnerThreadSleeper(data->prespawnerThreadSleeper),
+		globalWaiters(data->globalWaiters)
 	{
 		TRACE_POINT();
 		detached = false;
@@ -627,12 +2601,39 @@ public:
 		count = 0;
 		active = 0;
 		waitingOnGlobalQueue = 0;
+		wakeups = 0;
+		usefulWakeups = 0;
+		nextTicket = 1;
+		startingReplacements = 0;
 		maxPerApp = DEFAULT_MAX_INSTANCES_PER_APP;
 		maxIdleTime = DEFAULT_MAX_IDLE_TIME;
+		memorySamplingInterval = DEFAULT_MEMORY_SAMPLING_INTERVAL;
+		predictionInterval = DEFAULT_PREDICTION_INTERVAL;
+		evictionPolicy = ptr(new SpawnCostEvictionPolicy());
 		cleanerThread = new boost::thread(
 			bind(&StandardApplicationPool::cleanerThreadMainLoop, this),
 			CLEANER_THREAD_STACK_SIZE
 		);
+		prespawnerThread = new boost::thread(
+			bind(&StandardApplicationPool::prespawnerThreadMainLoop, this),
+			PRESPAWNER_THREAD_STACK_SIZE
+		);
+		memorySamplerThread = new boost::thread(
+			bind(&StandardApplicationPool::memorySamplerThreadMainLoop, this),
+			MEMORY_SAMPLER_THREAD_STACK_SIZE
+		);
+		demandPredictorThread = new boost::thread(
+			bind(&StandardApplicationPool::demandPredictorThreadMainLoop, this),
+			DEMAND_PREDICTOR_THREAD_STACK_SIZE
+		);
+		
+		restartFileWatcherThread = NULL;
+		inotifyFd = -1;
+		#ifdef PASSENGER_HAS_INOTIFY
+			if (watchRestartFiles) {
+				startRestartFileWatcher();
+			}
+		#endif
 	}
 	
 	virtual ~StandardApplicationPool() {
@@ -642,10 +2643,44 @@ public:
 				boost::mutex::scoped_lock l(lock);
 				done = true;
 				cleanerThreadSleeper.notify_one();
+				prespawnerThreadSleeper.notify_one();
+				memorySamplerThreadSleeper.notify_one();
+				demandPredictorThreadSleeper.notify_one();
 			}
+			// The pre-spawner thread and the replacement threads
+			// might be busy spawning.
+			prespawnerThread->interrupt();
 			cleanerThread->join();
+			prespawnerThread->join();
+			// No replacement threads are started anymore.
+			list<boost::thread *>::iterator it;
+			for (it = replacementThreads.begin(); it != replacementThreads.end(); it++) {
+				(*it)->interrupt();
+				(*it)->join();
+			}
+			memorySamplerThread->join();
+			demandPredictorThread->join();
+			if (restartFileWatcherThread != NULL) {
+				syscalls::write(restartFileWatcherShutdownPipe[1], "x", 1);
+				restartFileWatcherThread->join();
+			}
 		}
 		delete cleanerThread;
+		delete prespawnerThread;
+		while (!replacementThreads.empty()) {
+			delete replacementThreads.front();
+			replacementThreads.pop_front();
+		}
+		delete memorySamplerThread;
+		delete demandPredictorThread;
+		if (restartFileWatcherThread != NULL) {
+			delete restartFileWatcherThread;
+			syscalls::close(restartFileWatcherShutdownPipe[0]);
+			syscalls::close(restartFileWatcherShutdownPipe[1]);
+			if (inotifyFd != -1) {
+				syscalls::close(inotifyFd);
+			}
+		}
 	}
 	
 	virtual Application::SessionPtr get(const string &appRoot) {
@@ -656,39 +2691,64 @@ public:
 		TRACE_POINT();
 		using namespace boost::posix_time;
 		unsigned int attempt = 0;
+		unsigned int appId = getAppId(options.appRoot);
 		// TODO: We should probably add a timeout to the following
 		// lock. This way we can fail gracefully if the server's under
 		// rediculous load. Though I'm not sure how much it really helps.
 		unique_lock<boost::mutex> l(lock);
 		
+		if (appId >= domains.size()) {
+			domains.resize(appId + 1);
+			restartFiles.resize(appId + 1);
+		}
+		
 		while (true) {
 			attempt++;
 			
 			pair<AppContainerPtr, Domain *> p(
-				spawnOrUseExisting(l, options)
+				spawnOrUseExisting(l, appId, options)
 			);
 			AppContainerPtr &container = p.first;
 			Domain *domain = p.second;
-
-			container->lastUsed = time(NULL);
-			container->sessions++;
+			
+			if (options.minInstances > 0 || options.predictiveSpawning) {
+				map<unsigned int, PoolOptions>::iterator it(
+					prespawnOptions.find(appId));
+				if (it == prespawnOptions.end()
+				 || it->second.minInstances != options.minInstances
+				 || it->second.predictiveSpawning != options.predictiveSpawning
+				 || domain->size < options.minInstances) {
+					prespawnOptions[appId] = options;
+				}
+				if (domain->size < options.minInstances) {
+					prespawnerThreadSleeper.notify_one();
+				}
+			} else if (domain->minInstances > 0 || domain->predictiveSpawning) {
+				prespawnOptions.erase(appId);
+			}
+			domain->minInstances = options.minInstances;
+			domain->predictiveSpawning = options.predictiveSpawning;
+			domain->memoryLimit = options.memoryLimit;
+			domain->weight = options.poolWeight;
+			domain->concurrency = options.instanceConcurrency;
+			domain->recordRequest(time(NULL));
 			
 			P_ASSERT(verifyState(), Application::SessionPtr(),
 				"State is valid:\n" << toString(false));
 			try {
-				return container->app->connect(SessionCloseCallback(data, container));
+				return openSession(container);
 			} catch (const exception &e) {
-				container->sessions--;
-				
 				AppContainerList &instances(domain->instances);
 				instances.erase(container->iterator);
+				domain->removeFromBucket(container);
 				domain->size--;
-				if (instances.empty()) {
-					domains.erase(options.appRoot);
-				}
 				count--;
 				active--;
-				activeOrMaxChanged.notify_all();
+				data->activeContainerRemoved(domain);
+				if (instances.empty()) {
+					domains[appId].reset();
+				}
+				prespawnerThreadSleeper.notify_one();
 				P_ASSERT(verifyState(), Application::SessionPtr(),
 					"State is valid: " << toString(false));
 				if (attempt == MAX_GET_ATTEMPTS) {
@@ -713,13 +2773,19 @@ public:
 	
 	virtual void clear() {
 		boost::mutex::scoped_lock l(lock);
-		domains.clear();
+		data->wakeUpEverybody();
+		// Application IDs remain valid indices.
+		domains.assign(domains.size(), DomainPtr());
 		inactiveApps.clear();
-		restartFileTimes.clear();
+		for (vector<RestartFileInfo>::iterator it = restartFiles.begin();
+		     it != restartFiles.end(); it++) {
+			it->mtime = 0;
+		}
 		appInstanceCount.clear();
+		prespawnOptions.clear();
+		rollingRestarts.clear();
 		count = 0;
 		active = 0;
-		activeOrMaxChanged.notify_all();
 	}
 	
 	virtual void setMaxIdleTime(unsigned int seconds) {
@@ -728,10 +2794,42 @@ public:
 		cleanerThreadSleeper.notify_one();
 	}
 	
+	/**
+	 * Set the number of seconds between two samples of the application
+	 * instances' memory usage. Instances that use more memory than their
+	 * PoolOptions::memoryLimit are shut down.
+	 */
+	void setMemorySamplingInterval(unsigned int seconds) {
+		boost::mutex::scoped_lock l(lock);
+		memorySamplingInterval = seconds;
+		memorySamplerThreadSleeper.notify_one();
+	}
+	
+	/**
+	 * Set the number of seconds between two predictions of the demand for
+	 * the applications that have PoolOptions::predictiveSpawning enabled.
+	 */
+	void setPredictionInterval(unsigned int seconds) {
+		boost::mutex::scoped_lock l(lock);
+		predictionInterval = seconds;
+		demandPredictorThreadSleeper.notify_one();
+	}
+	
+	/**
+	 * Set the policy that decides which inactive instance is shut down when
+	 * the pool is full and another application needs a slot. The default
+	 * policy is SpawnCostEvictionPolicy.
+	 */
+	void setEvictionPolicy(const EvictionPolicyPtr &policy) {
+		boost::mutex::scoped_lock l(lock);
+		evictionPolicy = policy;
+	}
+	
 	virtual void setMax(unsigned int max) {
 		boost::mutex::scoped_lock l(lock);
 		this->max = max;
-		activeOrMaxChanged.notify_all();
+		data->wakeUpEverybody();
+		prespawnerThreadSleeper.notify_one();
 	}
 	
 	virtual unsigned int getActive() const {
@@ -742,10 +2840,44 @@ public:
 		return count;
 	}
 	
+	/**
+	 * Close the given sessions, and clear <tt>sessions</tt>. This is
+	 * equivalent to dropping the references one by one, except that the
+	 * pool's lock is acquired only once for all of them. Sessions that are
+	 * still referenced elsewhere are closed when the last reference is
+	 * dropped, as usual.
+	 */
+	void closeSessions(vector<Application::SessionPtr> &sessions) {
+		vector<SessionCloseCallback> callbacks;
+		vector<Application::SessionPtr>::iterator it;
+		
+		callbacks.reserve(sessions.size());
+		for (it = sessions.begin(); it != sessions.end(); it++) {
+			// Nobody else can copy a reference that we own exclusively,
+			// so it's safe to take over the close callback.
+			PooledSession *session = dynamic_cast<PooledSession *>(it->get());
+			if (session != NULL && it->unique() && session->onClose.data != NULL) {
+				callbacks.push_back(session->onClose);
+				session->onClose = SessionCloseCallback();
+			}
+		}
+		// Closes the streams and recycles the sessions.
+		sessions.clear();
+		
+		if (!callbacks.empty()) {
+			boost::mutex::scoped_lock l(data->lock);
+			vector<SessionCloseCallback>::iterator callback;
+			for (callback = callbacks.begin(); callback != callbacks.end(); callback++) {
+				callback->closeLocked();
+			}
+		}
+	}
+	
 	virtual void setMaxPerApp(unsigned int maxPerApp) {
 		boost::mutex::scoped_lock l(lock);
 		this->maxPerApp = maxPerApp;
-		activeOrMaxChanged.notify_all();
+		data->wakeUpEverybody();
+		prespawnerThreadSleeper.notify_one();
 	}
 	
 	virtual pid_t getSpawnServerPid() const {
@@ -771,29 +2903,51 @@ public:
 	virtual string toXml() const {
 		unique_lock<boost::mutex> l(lock);
 		stringstream result;
-		DomainMap::const_iterator it;
+		DomainTable::const_iterator it;
+		unsigned long weight = totalWeight();
+		time_t now = time(NULL);
 		
 		result << "<?xml version=\"1.0\" encoding=\"iso8859-1\" ?>\n";
 		result << "<info>";
+		result << "<wakeups>" << wakeups << "</wakeups>";
+		result << "<useful_wakeups>" << usefulWakeups << "</useful_wakeups>";
 		
 		result << "<domains>";
 		for (it = domains.begin(); it != domains.end(); it++) {
-			Domain *domain = it->second.get();
+			Domain *domain = it->get();
+			if (domain == NULL) {
+				continue;
+			}
 			AppContainerList *instances = &domain->instances;
 			AppContainerList::const_iterator lit;
 			
 			result << "<domain>";
-			result << "<name>" << escapeForXml(it->first) << "</name>";
+			result << "<name>" << escapeForXml(domain->appRoot) << "</name>";
+			result << "<slots>" << domain->size << "</slots>";
+			result << "<quota>" << quota(domain, weight) << "</quota>";
+			result << "<weight>" << domain->weight << "</weight>";
+			result << "<spawn_time>" << domain->spawnTime << "</spawn_time>";
+			result << "<request_rate>" << domain->currentRequestRate(now) <<
+				"</request_rate>";
+			result << "<service_time>" << domain->serviceTime << "</service_time>";
+			if (domain->predictiveSpawning) {
+				result << "<predicted_size>" << domain->predictedSize <<
+					"</predicted_size>";
+			}
 			
 			result << "<instances>";
 			for (lit = instances->begin(); lit != instances->end(); lit++) {
 				AppContainer *container = lit->get();
 				
+				if (container->spawning) {
+					continue;
+				}
 				result << "<instance>";
 				result << "<pid>" << container->app->getPid() << "</pid>";
 				result << "<sessions>" << container->sessions << "</sessions>";
 				result << "<processed>" << container->processed << "</processed>";
 				result << "<uptime>" << container->uptime() << "</uptime>";
+				result << "<memory>" << container->memory << "</memory>";
 				result << "</instance>";
 			}
 			result << "</instances>";
@@ -805,6 +2959,84 @@ public:
 		result << "</info>";
 		return result.str();
 	}
+	
+	/**
+	 * Publish a snapshot of the internal state of the application pool
+	 * in the given statistics file. Domains and instances that don't fit
+	 * in the file are left out.
+	 */
+	void publishStatistics(PoolStatistics &statistics) const {
+		pid_t spawnServerPid = spawnManager.getServerPid();
+		unique_lock<boost::mutex> l(lock);
+		PoolStatistics::Data &stats(statistics.beginUpdate());
+		DomainTable::const_iterator it;
+		unsigned long weight = totalWeight();
+		time_t now = time(NULL);
+		unsigned int domainCount = 0, instanceCount = 0;
+		
+		stats.counters.spawnServerPid = spawnServerPid;
+		stats.counters.max = max;
+		stats.counters.count = count;
+		stats.counters.active = active;
+		stats.counters.updateTime = now;
+		for (it = domains.begin(); it != domains.end()
+		  && domainCount < PoolStatistics::MAX_DOMAINS; it++) {
+			Domain *domain = it->get();
+			if (domain == NULL) {
+				continue;
+			}
+			PoolStatistics::Domain &d(stats.domains[domainCount]);
+			AppContainerList::const_iterator lit;
+			
+			strncpy(d.appRoot, domain->appRoot.c_str(), sizeof(d.appRoot) - 1);
+			d.appRoot[sizeof(d.appRoot) - 1] = '\0';
+			d.size = domain->size;
+			d.weight = domain->weight;
+			d.quota = quota(domain, weight);
+			d.waiters = domain->waiters.size();
+			d.spawnTime = domain->spawnTime;
+			d.requestRate = domain->currentRequestRate(now);
+			d.serviceTime = domain->serviceTime;
+			
+			for (lit = domain->instances.begin(); lit != domain->instances.end()
+			  && instanceCount < PoolStatistics::MAX_INSTANCES; lit++) {
+				AppContainer *container = lit->get();
+				if (container->spawning) {
+					continue;
+				}
+				PoolStatistics::Instance &i(stats.instances[instanceCount]);
+				i.domain = domainCount;
+				i.pid = container->app->getPid();
+				i.sessions = container->sessions;
+				i.processed = container->processed;
+				i.startTime = container->startTime;
+				i.memory = container->memory;
+				instanceCount++;
+			}
+			domainCount++;
+		}
+		stats.counters.domainCount = domainCount;
+		stats.counters.instanceCount = instanceCount;
+		statistics.endUpdate();
+	}
+	
+	/**
+	 * Publish only the pool-wide counters in the given statistics file,
+	 * leaving the published domains and instances as they are. This is
+	 * cheap enough to be called for every request, unlike
+	 * publishStatistics().
+	 */
+	void publishCounters(PoolStatistics &statistics) const {
+		pid_t spawnServerPid = spawnManager.getServerPid();
+		unique_lock<boost::mutex> l(lock);
+		PoolStatistics::Data &stats(statistics.beginUpdate());
+		
+		stats.counters.spawnServerPid = spawnServerPid;
+		stats.counters.max = max;
+		stats.counters.count = count;
+		stats.counters.active = active;
+		statistics.endUpdate();
+	}
 };
 
 typedef shared_ptr<StandardApplicationPool> StandardApplicationPoolPtr;
@@ -0,0 +1,112 @@
+/*
+ *  Phusion Passenger - http://www.modrails.com/
+ *  Copyright (C) 2008  Phusion
+ *
+ *  Phusion Passenger is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PASSENGER_STATIC_STRING_H_
+#define _PASSENGER_STATIC_STRING_H_
+
+#include <string>
+#include <ostream>
+#include <cstring>
+
+namespace Passenger {
+
+using namespace std;
+
+/**
+ * A read-only view on a piece of memory that contains a string, i.e. a
+ * pointer and a length. A StaticString doesn't own the memory, so it's
+ * cheap to create and to copy, but the memory must stay alive and unchanged
+ * for as long as the StaticString is used. The string isn't necessarily
+ * NUL-terminated.
+ *
+ * @ingroup Support
+ */
+class StaticString {
+private:
+	const char *content;
+	string::size_type len;
+
+public:
+	StaticString() {
+		content = "";
+		len = 0;
+	}
+	
+	StaticString(const string &s) {
+		content = s.data();
+		len = s.size();
+	}
+	
+	StaticString(const char *data, string::size_type len) {
+		content = data;
+		this->len = len;
+	}
+	
+	explicit StaticString(const char *data) {
+		content = data;
+		len = strlen(data);
+	}
+	
+	const char *data() const {
+		return content;
+	}
+	
+	string::size_type size() const {
+		return len;
+	}
+	
+	bool empty() const {
+		return len == 0;
+	}
+	
+	const char &operator[](string::size_type i) const {
+		return content[i];
+	}
+	
+	bool operator==(const StaticString &other) const {
+		return len == other.len && memcmp(content, other.content, len) == 0;
+	}
+	
+	bool operator!=(const StaticString &other) const {
+		return !(*this == other);
+	}
+	
+	bool operator==(const char *other) const {
+		return strlen(other) == len && memcmp(content, other, len) == 0;
+	}
+	
+	bool operator!=(const char *other) const {
+		return !(*this == other);
+	}
+	
+	/** Create a copy of this string. */
+	string toString() const {
+		return string(content, len);
+	}
+};
+
+inline ostream &
+operator<<(ostream &os, const StaticString &s) {
+	os.write(s.data(), s.size());
+	return os;
+}
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_STATIC_STRING_H_ */
@@ -19,6 +19,8 @@
  */
 
 #include <cassert>
+#include <ctime>
+#include <sys/time.h>
 #include "Utils.h"
 
 #define SPAWN_SERVER_SCRIPT_NAME "passenger-spawn-server"
@@ -35,6 +37,24 @@ atol(const string &s) {
 	return ::atol(s.c_str());
 }
 
+int
+atoi(const StaticString &s) {
+	return (int) atol(s);
+}
+
+long
+atol(const StaticString &s) {
+	char buf[32];
+	
+	if (s.size() < sizeof(buf)) {
+		memcpy(buf, s.data(), s.size());
+		buf[s.size()] = '\0';
+		return ::atol(buf);
+	} else {
+		return ::atol(s.toString().c_str());
+	}
+}
+
 void
 split(const string &str, char sep, vector<string> &output) {
 	string::size_type start, pos;
@@ -290,6 +310,61 @@ removeDirTree(const char *path) {
 	}
 }
 
+unsigned long
+getPrivateDirtyRSS(pid_t pid) {
+	char filename[64];
+	char line[256];
+	FILE *f;
+	unsigned long total = 0;
+	bool found = false;
+	
+	snprintf(filename, sizeof(filename), "/proc/%lu/smaps", (unsigned long) pid);
+	f = fopen(filename, "r");
+	if (f != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL) {
+			unsigned long size;
+			
+			if (sscanf(line, "Private_Dirty: %lu kB", &size) == 1) {
+				total += size;
+				found = true;
+			}
+		}
+		fclose(f);
+		if (found) {
+			return total;
+		}
+	}
+	
+	// Fall back to statm: resident pages minus shared pages.
+	unsigned long size, resident, shared;
+	snprintf(filename, sizeof(filename), "/proc/%lu/statm", (unsigned long) pid);
+	f = fopen(filename, "r");
+	if (f == NULL) {
+		return 0;
+	}
+	if (fscanf(f, "%lu %lu %lu", &size, &resident, &shared) == 3 && resident > shared) {
+		total = (resident - shared) * (getpagesize() / 1024);
+	}
+	fclose(f);
+	return total;
+}
+
+unsigned long long
+getMonotonicUsec() {
+	#ifdef CLOCK_MONOTONIC
+		struct timespec ts;
+		
+		if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+			return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+		}
+	#endif
+	// No monotonic clock available; the wall clock will have to do.
+	struct timeval tv;
+	
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 bool
 verifyRailsDir(const string &dir) {
 	string temp(dir);
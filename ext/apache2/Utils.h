@@ -34,6 +34,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include "Exceptions.h"
+#include "StaticString.h"
 
 namespace Passenger {
 
@@ -114,6 +115,31 @@ struct AnythingToString< vector<string> > {
 	}
 };
 
+/**
+ * Used internally by toString(). Do not use directly.
+ *
+ * @internal
+ */
+template<>
+struct AnythingToString< vector<StaticString> > {
+	string operator()(const vector<StaticString> &v) {
+		string result("[");
+		vector<StaticString>::const_iterator it;
+		unsigned int i;
+		for (it = v.begin(), i = 0; it != v.end(); it++, i++) {
+			result.append("'");
+			result.append(it->data(), it->size());
+			if (i == v.size() - 1) {
+				result.append("'");
+			} else {
+				result.append("', ");
+			}
+		}
+		result.append("]");
+		return result;
+	}
+};
+
 /**
  * Convert anything to a string.
  *
@@ -137,6 +163,18 @@ int atoi(const string &s);
  */
 long atol(const string &s);
 
+/**
+ * Converts the given string to an integer, without copying it to the heap.
+ * @ingroup Support
+ */
+int atoi(const StaticString &s);
+
+/**
+ * Converts the given string to a long integer, without copying it to the heap.
+ * @ingroup Support
+ */
+long atol(const StaticString &s);
+
 /**
  * Split the given string using the given separator.
  *
@@ -264,6 +302,30 @@ void makeDirTree(const char *path, const char *mode = "u=rwx,g=,o=");
  */
 void removeDirTree(const char *path);
 
+/**
+ * Returns the amount of private dirty memory, in KB, of the process with
+ * the given PID. That's the memory that would be freed if the process
+ * exits. It is read from <tt>/proc/&lt;pid&gt;/smaps</tt>, or estimated from
+ * <tt>/proc/&lt;pid&gt;/statm</tt> if the former isn't available.
+ *
+ * Returns 0 if the process's memory usage cannot be determined, e.g.
+ * because the process doesn't exist or because the system has no
+ * <tt>/proc</tt> file system.
+ *
+ * @ingroup Support
+ */
+unsigned long getPrivateDirtyRSS(pid_t pid);
+
+/**
+ * Returns the current time of a monotonic clock, in microseconds. Unlike
+ * the wall clock time, this time isn't affected by changes to the system
+ * time, so it's suitable for measuring time intervals. The returned value
+ * has no meaning by itself.
+ *
+ * @ingroup Support
+ */
+unsigned long long getMonotonicUsec();
+
 /**
  * Check whether the specified directory is a valid Ruby on Rails
  * 'public' directory.
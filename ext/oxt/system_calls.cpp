@@ -84,6 +84,16 @@ syscalls::write(int fd, const void *buf, size_t count) {
 	return ret;
 }
 
+ssize_t
+syscalls::writev(int fd, const struct iovec *iov, int iovcnt) {
+	ssize_t ret;
+	CHECK_INTERRUPTION(
+		ret == -1,
+		ret = ::writev(fd, iov, iovcnt)
+	);
+	return ret;
+}
+
 int
 syscalls::close(int fd) {
 	int ret;
@@ -164,6 +174,16 @@ syscalls::shutdown(int s, int how) {
 	return ret;
 }
 
+int
+syscalls::poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	int ret;
+	CHECK_INTERRUPTION(
+		ret == -1,
+		ret = ::poll(fds, nfds, timeout)
+	);
+	return ret;
+}
+
 FILE *
 syscalls::fopen(const char *path, const char *mode) {
 	FILE *ret;
@@ -29,6 +29,8 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <signal.h>
@@ -116,6 +118,7 @@ namespace oxt {
 	namespace syscalls {
 		ssize_t read(int fd, void *buf, size_t count);
 		ssize_t write(int fd, const void *buf, size_t count);
+		ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
 		int close(int fd);
 		
 		int connect(int sockfd, const struct sockaddr *serv_addr, socklen_t addrlen);
@@ -126,6 +129,7 @@ namespace oxt {
 		int setsockopt(int s, int level, int optname, const void *optval,
 			socklen_t optlen);
 		int shutdown(int s, int how);
+		int poll(struct pollfd *fds, nfds_t nfds, int timeout);
 		
 		FILE *fopen(const char *path, const char *mode);
 		int fclose(FILE *fp);
@@ -33,6 +33,9 @@ module Passenger
 #
 # A message is just an ordered list of strings. The first element in the message is the _message name_.
 #
+# Every server handles the 'frame_version' message, so that the client may switch the connection
+# to a newer MessageChannel frame format with MessageChannel#negotiate_frame_version.
+#
 # The server will also reset all signal handlers (in the child process). That is, it will respond to
 # all signals in the default manner. The only exception is SIGHUP, which is ignored. One may define
 # additional signal handlers using define_signal_handler().
@@ -106,6 +109,7 @@ class AbstractServer
 		@signal_handlers = {}
 		@orig_signal_handlers = {}
 		@last_activity_time = Time.now
+		define_message_handler(:frame_version, :handle_frame_version)
 	end
 	
 	# Start the server. This method does not block since the server runs
@@ -289,6 +293,10 @@ protected
 	end
 
 private
+	def handle_frame_version(proposed)
+		client.accept_frame_version(proposed)
+	end
+	
 	# Reset all signal handlers to default. This is called in the child process,
 	# before entering the main loop.
 	def reset_signal_handlers
@@ -321,7 +329,7 @@ private
 	#
 	# If an unknown message is encountered, UnknownMessage will be raised.
 	def main_loop
-		channel = MessageChannel.new(@child_socket)
+		channel = client
 		while !@done
 			begin
 				name, *args = channel.read
@@ -67,7 +67,88 @@ class ControlProcess
 		end.flatten
 	end
 	
+	# Returns a snapshot of the ApplicationPool statistics that the control
+	# process publishes in a memory mapped file. Unlike #status, this doesn't
+	# require the control process to do anything. Returns nil if the
+	# statistics are not available.
+	def statistics
+		filename = "#{path}/pool_statistics"
+		STATISTICS_READ_ATTEMPTS.times do
+			begin
+				data = File.open(filename, 'rb') { |f| f.read }
+				sequence_after = File.open(filename, 'rb') { |f| f.read(12) }.unpack('L3')[2]
+			rescue SystemCallError
+				return nil
+			end
+			next if data.size < STATISTICS_HEADER_SIZE
+			header = data.unpack(STATISTICS_HEADER_FORMAT)
+			magic, layout_version, sequence = header
+			if magic != STATISTICS_MAGIC || layout_version != STATISTICS_LAYOUT_VERSION
+				return nil
+			end
+			if sequence % 2 == 0 && sequence == sequence_after
+				return parse_statistics(data, header)
+			end
+		end
+		return nil
+	end
+	
 private
+	STATISTICS_MAGIC = 0x50505354
+	STATISTICS_LAYOUT_VERSION = 1
+	STATISTICS_READ_ATTEMPTS = 100
+	STATISTICS_MAX_DOMAINS = 100
+	# See PoolStatistics.h for the layout.
+	STATISTICS_HEADER_FORMAT = 'L10Q'
+	STATISTICS_HEADER_SIZE = 48
+	STATISTICS_DOMAIN_FORMAT = 'Z256L4d3'
+	STATISTICS_DOMAIN_SIZE = 296
+	STATISTICS_INSTANCE_FORMAT = 'L4Q2'
+	STATISTICS_INSTANCE_SIZE = 32
+	
+	def parse_statistics(data, header)
+		spawn_server_pid, max, count, active, domain_count, instance_count = header[3..8]
+		result = {
+			:spawn_server_pid => spawn_server_pid,
+			:max => max,
+			:count => count,
+			:active => active,
+			:updated_at => Time.at(header[10]),
+			:domains => []
+		}
+		domain_count.times do |i|
+			offset = STATISTICS_HEADER_SIZE + i * STATISTICS_DOMAIN_SIZE
+			fields = data[offset, STATISTICS_DOMAIN_SIZE].unpack(STATISTICS_DOMAIN_FORMAT)
+			result[:domains] << {
+				:name => fields[0],
+				:size => fields[1],
+				:weight => fields[2],
+				:quota => fields[3],
+				:waiters => fields[4],
+				:spawn_time => fields[5],
+				:request_rate => fields[6],
+				:service_time => fields[7],
+				:instances => []
+			}
+		end
+		instance_count.times do |i|
+			offset = STATISTICS_HEADER_SIZE +
+				STATISTICS_MAX_DOMAINS * STATISTICS_DOMAIN_SIZE +
+				i * STATISTICS_INSTANCE_SIZE
+			fields = data[offset, STATISTICS_INSTANCE_SIZE].unpack(STATISTICS_INSTANCE_FORMAT)
+			domain = result[:domains][fields[0]]
+			next if !domain
+			domain[:instances] << {
+				:pid => fields[1],
+				:sessions => fields[2],
+				:processed => fields[3],
+				:started_at => Time.at(fields[4]),
+				:memory => fields[5]
+			}
+		end
+		return result
+	end
+	
 	def reload
 		return if @status
 		File.open("#{path}/status.fifo", 'r') do |f|
@@ -37,6 +37,12 @@ module Passenger
 # The protocol is designed to be low overhead, easy to implement and
 # easy to parse.
 #
+# Array messages start with a size header. It's 16 bits in the original
+# frame format, FRAME_VERSION_1, and 32 bits in FRAME_VERSION_2. A new
+# channel uses FRAME_VERSION_1; the two sides can agree on a newer frame
+# format with negotiate_frame_version() and accept_frame_version(). Scalar
+# messages always have a 32-bit size header.
+#
 # MessageChannel is to be wrapped around an IO object. For example:
 #
 #  a, b = IO.pipe
@@ -66,16 +72,85 @@ module Passenger
 # receiving side does things in the wrong order then bad things will
 # happen.
 class MessageChannel
-	HEADER_SIZE = 2                  # :nodoc:
 	DELIMITER = "\0"                 # :nodoc:
 	DELIMITER_NAME = "null byte"     # :nodoc:
 	
+	# The original frame format, in which an array message starts with a
+	# 16-bit size header. Array messages are thus limited to 65535 bytes.
+	FRAME_VERSION_1 = 1
+	
+	# A frame format in which an array message starts with a 32-bit size header.
+	FRAME_VERSION_2 = 2
+	
+	# The latest frame format that this implementation supports.
+	LATEST_FRAME_VERSION = FRAME_VERSION_2
+	
+	FRAME_VERSION_1_HEADER_SIZE = 2  # :nodoc:
+	FRAME_VERSION_2_HEADER_SIZE = 4  # :nodoc:
+	
 	# The wrapped IO object.
 	attr_reader :io
+	
+	# The frame format that's used for array messages.
+	attr_reader :frame_version
 
 	# Create a new MessageChannel by wrapping the given IO object.
+	# It uses FRAME_VERSION_1 until another frame version is negotiated.
 	def initialize(io)
 		@io = io
+		@frame_version = FRAME_VERSION_1
+	end
+	
+	# Set the frame format that's used for array messages. Both sides of
+	# the connection must use the same frame format, so this should only
+	# be done when both sides have agreed on it.
+	def frame_version=(version)
+		if version < FRAME_VERSION_1 || version > LATEST_FRAME_VERSION
+			raise ArgumentError, "Unsupported frame version #{version}."
+		end
+		@frame_version = version
+	end
+	
+	# Negotiate the frame format with the other side of the connection.
+	# This sends a 'frame_version' message with the latest frame version
+	# that this side supports, and waits until the other side has replied
+	# with the frame version that both sides will use from then on, as done
+	# by accept_frame_version(). Returns the negotiated frame version.
+	#
+	# This must be done at the start of the connection, when no other
+	# messages are underway in either direction.
+	#
+	# Raises IOError if the other side closed the connection or replied
+	# with something unexpected. Might also raise SystemCallError or
+	# SocketError when something goes wrong.
+	def negotiate_frame_version(max_version = LATEST_FRAME_VERSION)
+		write('frame_version', max_version)
+		reply = read
+		if reply.nil?
+			raise IOError, "The other side closed the connection while " <<
+				"negotiating the frame version."
+		end
+		if reply.size != 2 || reply[0] != 'frame_version' ||
+		   reply[1].to_i < FRAME_VERSION_1 || reply[1].to_i > max_version
+			raise IOError, "The other side sent an invalid reply while " <<
+				"negotiating the frame version: #{reply.inspect}"
+		end
+		@frame_version = reply[1].to_i
+		return @frame_version
+	end
+	
+	# Reply to a 'frame_version' message that was sent by
+	# negotiate_frame_version(), and switch to the chosen frame format.
+	# _proposed_ is the frame version in that message. Returns the chosen
+	# frame version.
+	#
+	# Might raise SystemCallError, IOError or SocketError when something
+	# goes wrong.
+	def accept_frame_version(proposed)
+		version = [[proposed.to_i, LATEST_FRAME_VERSION].min, FRAME_VERSION_1].max
+		write('frame_version', version)
+		@frame_version = version
+		return version
 	end
 	
 	# Read an array message from the underlying file descriptor.
@@ -85,12 +160,19 @@ class MessageChannel
 	# Might raise SystemCallError, IOError or SocketError when something
 	# goes wrong.
 	def read
+		if @frame_version == FRAME_VERSION_1
+			header_size = FRAME_VERSION_1_HEADER_SIZE
+			header_format = 'n'
+		else
+			header_size = FRAME_VERSION_2_HEADER_SIZE
+			header_format = 'N'
+		end
 		buffer = ''
-		while buffer.size < HEADER_SIZE
-			buffer << @io.readpartial(HEADER_SIZE - buffer.size)
+		while buffer.size < header_size
+			buffer << @io.readpartial(header_size - buffer.size)
 		end
 		
-		chunk_size = buffer.unpack('n')[0]
+		chunk_size = buffer.unpack(header_format)[0]
 		buffer = ''
 		while buffer.size < chunk_size
 			buffer << @io.readpartial(chunk_size - buffer.size)
@@ -156,6 +238,7 @@ class MessageChannel
 	# other elements. These arguments will internally be converted to strings by calling
 	# to_s().
 	#
+	# Raises ArgumentError if the message is too large for the frame format.
 	# Might raise SystemCallError, IOError or SocketError when something
 	# goes wrong.
 	def write(name, *args)
@@ -168,7 +251,16 @@ class MessageChannel
 		args.each do |arg|
 			message << arg.to_s << DELIMITER
 		end
-		@io.write([message.size].pack('n') << message)
+		if @frame_version == FRAME_VERSION_1
+			if message.size > 0xFFFF
+				raise ArgumentError, "The array message is too large " <<
+					"(#{message.size} bytes) for frame version 1. Please " <<
+					"negotiate a newer frame version."
+			end
+			@io.write([message.size].pack('n') << message)
+		else
+			@io.write([message.size].pack('N') << message)
+		end
 		@io.flush
 	end
 	
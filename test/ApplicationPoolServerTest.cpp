@@ -70,5 +70,32 @@ namespace tut {
 			}
 		}
 	}
+	
+	TEST_METHOD(5) {
+		// Many clients can be connected at the same time, and each
+		// of them is served.
+		vector<ApplicationPoolPtr> pools;
+		for (int i = 0; i < 100; i++) {
+			pools.push_back(server->connect());
+		}
+		for (int i = 99; i >= 0; i--) {
+			ensure_equals(pools[i]->getCount(), 0u);
+			ensure_equals(pools[i]->getActive(), 0u);
+		}
+	}
+	
+	TEST_METHOD(6) {
+		// The server publishes the pool's statistics in the Passenger
+		// temp folder.
+		ApplicationPoolPtr pool(server->connect());
+		pid_t spawnServerPid = pool->getSpawnServerPid();
+		PoolStatistics statistics(getPassengerTempDir() + "/pool_statistics", false);
+		PoolStatistics::Counters counters;
+		
+		ensure(spawnServerPid > 0);
+		ensure(statistics.readCounters(counters));
+		ensure_equals((pid_t) counters.spawnServerPid, spawnServerPid);
+		ensure_equals(counters.count, 0u);
+		ensure_equals(counters.active, 0u);
+	}
 }
-
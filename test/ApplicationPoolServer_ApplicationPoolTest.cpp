@@ -9,6 +9,11 @@ namespace tut {
 	struct ApplicationPoolServer_ApplicationPoolTest {
 		ApplicationPoolServerPtr server;
 		ApplicationPoolPtr pool, pool2;
+		/**
+		 * Whether the pool reuses closed session objects. Sessions are
+		 * recycled inside the server, but not in the client.
+		 */
+		bool recyclesSessions;
 		
 		ApplicationPoolServer_ApplicationPoolTest() {
 			server = ptr(new ApplicationPoolServer(
@@ -16,6 +21,7 @@ namespace tut {
 				"../bin/passenger-spawn-server"));
 			pool = server->connect();
 			pool2 = server->connect();
+			recyclesSessions = false;
 		}
 		
 		ApplicationPoolPtr newPoolConnection() {
@@ -27,5 +33,87 @@ namespace tut {
 	
 	#define USE_TEMPLATE
 	#include "ApplicationPoolTest.cpp"
+	
+	TEST_METHOD(40) {
+		// Multiple threads can have outstanding requests on the same
+		// connection. While one thread waits for a slow application to
+		// be spawned, other threads are served.
+		Application::SessionPtr session(spawnRackApp(pool, "stub/rack"));
+		session.reset();
+		
+		bool done = false;
+		SpawnSlowRackAppFunction func;
+		func.pool = pool;
+		func.done = &done;
+		boost::thread thr(func);
+		usleep(200000);
+		
+		time_t begin = time(NULL);
+		session = spawnRackApp(pool, "stub/rack");
+		ensure("get() returned before the slow application was spawned", !done);
+		ensure("get() did not block", time(NULL) - begin <= 1);
+		ensure_equals(pool->getCount(), 2u);
+		ensure_equals(pool->getActive(), 2u);
+		session.reset();
+		
+		thr.join();
+		ensure(done);
+		ensure_equals(pool->getCount(), 2u);
+	}
+	
+	TEST_METHOD(41) {
+		// Option sets are registered once per connection; subsequent
+		// get() calls refer to them by ID. Requests for different option
+		// sets on the same connection must not get mixed up.
+		Application::SessionPtr session(spawnRackApp(pool, "stub/rack"));
+		pid_t rackPid = session->getPid();
+		session.reset();
+		session = pool->get("stub/railsapp");
+		pid_t railsPid = session->getPid();
+		session.reset();
+		ensure(rackPid != railsPid);
+		
+		for (int i = 0; i < 3; i++) {
+			session = spawnRackApp(pool, "stub/rack");
+			ensure_equals(session->getPid(), rackPid);
+			session.reset();
+			session = pool->get("stub/railsapp");
+			ensure_equals(session->getPid(), railsPid);
+			session.reset();
+		}
+		ensure_equals(pool->getCount(), 2u);
+		
+		// Another connection registers its own option sets.
+		session = spawnRackApp(pool2, "stub/rack");
+		ensure_equals(session->getPid(), rackPid);
+		session.reset();
+	}
+	
+	struct GetAndCloseFunction {
+		ApplicationPoolPtr pool;
+		
+		void operator()() {
+			for (int i = 0; i < 20; i++) {
+				spawnRackApp(pool, "stub/rack");
+			}
+		}
+	};
+	
+	TEST_METHOD(42) {
+		// Sessions that are closed while another thread is writing to
+		// the same connection are reported in a batch, without waiting
+		// for a later request. With a single instance, every get() has
+		// to wait until the previous session has been released.
+		pool->setMax(1);
+		GetAndCloseFunction func;
+		func.pool = pool;
+		boost::thread_group threads;
+		for (int i = 0; i < 4; i++) {
+			threads.create_thread(func);
+		}
+		threads.join_all();
+		ensure_equals(pool->getActive(), 0u);
+		ensure_equals(pool->getCount(), 1u);
+	}
 }
 
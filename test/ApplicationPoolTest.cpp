@@ -450,5 +450,400 @@
 		session.reset();
 		thr.join();
 	}
+	
+	struct SpawnSlowRackAppFunction {
+		ApplicationPoolPtr pool;
+		bool *done;
+		
+		void operator()() {
+			spawnRackApp(pool, "stub/slow_rack");
+			*done = true;
+		}
+	};
+	
+	TEST_METHOD(20) {
+		// While an application instance is being spawned, get() calls
+		// for other applications that are already in the pool should
+		// not be blocked.
+		Application::SessionPtr session(spawnRackApp(pool, "stub/rack"));
+		session.reset();
+		
+		bool done = false;
+		SpawnSlowRackAppFunction func;
+		func.pool = pool2;
+		func.done = &done;
+		boost::thread thr(func);
+		usleep(200000);
+		
+		ApplicationPoolPtr pool3(newPoolConnection());
+		time_t begin = time(NULL);
+		session = spawnRackApp(pool3, "stub/rack");
+		ensure("get() returned before the slow application was spawned", !done);
+		ensure("get() did not block", time(NULL) - begin <= 1);
+		ensure_equals(pool->getCount(), 2u);
+		
+		thr.join();
+		ensure_equals(pool->getCount(), 2u);
+	}
+	
+	TEST_METHOD(21) {
+		// If minInstances is set, then the pool pre-spawns instances in
+		// the background until there are that many, and doesn't clean
+		// them up when they're idle.
+		PoolOptions options;
+		options.appRoot = "stub/rack";
+		options.appType = "rack";
+		options.minInstances = 2;
+		pool->setMaxIdleTime(1);
+		
+		Application::SessionPtr session(pool->get(options));
+		session.reset();
+		
+		// Wait at most 10 seconds.
+		time_t begin = time(NULL);
+		while ((pool->getCount() < 2 || pool->getActive() > 0)
+		    && time(NULL) - begin < 10) {
+			usleep(100000);
+		}
+		ensure_equals("An instance has been pre-spawned", pool->getCount(), 2u);
+		ensure_equals(pool->getActive(), 0u);
+		
+		sleep(3);
+		ensure_equals("Idle instances have not been cleaned up", pool->getCount(), 2u);
+	}
+	
+	struct GetRackAppInOrderFunction {
+		ApplicationPoolPtr pool;
+		const char *appRoot;
+		/** Microseconds to sleep before calling get(). */
+		unsigned int delay;
+		boost::mutex *lock;
+		vector<int> *order;
+		int id;
+		
+		GetRackAppInOrderFunction() {
+			appRoot = "stub/rack";
+			delay = 0;
+		}
+		
+		void operator()() {
+			usleep(delay);
+			PoolOptions options;
+			options.appRoot = appRoot;
+			options.appType = "rack";
+			options.useGlobalQueue = true;
+			Application::SessionPtr session(pool->get(options));
+			boost::mutex::scoped_lock l(*lock);
+			order->push_back(id);
+		}
+	};
+	
+	TEST_METHOD(22) {
+		// Threads that are waiting on the global queue are served
+		// in FIFO order.
+		pool->setMax(1);
+		
+		PoolOptions options;
+		options.appRoot = "stub/rack";
+		options.appType = "rack";
+		options.useGlobalQueue = true;
+		Application::SessionPtr session(pool->get(options));
+		
+		boost::mutex lock;
+		vector<int> order;
+		GetRackAppInOrderFunction func1, func2;
+		func1.pool = pool2;
+		func1.lock = &lock;
+		func1.order = &order;
+		func1.id = 1;
+		func2.pool = newPoolConnection();
+		func2.lock = &lock;
+		func2.order = &order;
+		func2.id = 2;
+		
+		boost::thread thr1(func1);
+		usleep(100000);
+		boost::thread thr2(func2);
+		usleep(100000);
+		ensure(order.empty());
+		
+		session.reset();
+		thr1.join();
+		thr2.join();
+		ensure_equals(order.size(), 2u);
+		ensure_equals("The oldest waiter was served first", order[0], 1);
+		ensure_equals(order[1], 2);
+	}
+	
+	TEST_METHOD(23) {
+		// If the pool is full and the global queue is not used, then
+		// get() connects to the instance with the fewest open sessions.
+		pool->setMax(2);
+		Application::SessionPtr session1(spawnRackApp(pool, "stub/rack"));
+		Application::SessionPtr session2(spawnRackApp(pool2, "stub/rack"));
+		ensure_equals(pool->getCount(), 2u);
+		ensure(session1->getPid() != session2->getPid());
+		
+		Application::SessionPtr session3(spawnRackApp(pool, "stub/rack"));
+		Application::SessionPtr session4(spawnRackApp(pool2, "stub/rack"));
+		ensure("Sessions are evenly distributed", session3->getPid() != session4->getPid());
+		
+		pid_t pid = session3->getPid();
+		session3.reset();
+		session3 = spawnRackApp(pool, "stub/rack");
+		ensure_equals("The least busy instance is used", session3->getPid(), pid);
+		ensure_equals(pool->getCount(), 2u);
+	}
+	
+	TEST_METHOD(24) {
+		// The cleaner thread cleans idle instances as soon as they've
+		// been idle for longer than the maximum idle time, and doesn't
+		// clean instances that have been used more recently.
+		pool->setMaxIdleTime(2);
+		spawnRackApp(pool, "stub/rack");
+		sleep(1);
+		spawnWsgiApp(pool, "stub/wsgi");
+		ensure_equals(pool->getCount(), 2u);
+		
+		// Wait at most 10 seconds.
+		time_t begin = time(NULL);
+		while (pool->getCount() == 2u && time(NULL) - begin < 10) {
+			usleep(100000);
+		}
+		ensure_equals("The oldest instance has been cleaned up", pool->getCount(), 1u);
+		ensure("The oldest instance was cleaned up in time", time(NULL) - begin <= 3);
+		
+		begin = time(NULL);
+		while (pool->getCount() == 1u && time(NULL) - begin < 10) {
+			usleep(100000);
+		}
+		ensure_equals("The other instance has been cleaned up", pool->getCount(), 0u);
+	}
+	
+	TEST_METHOD(25) {
+		// Sessions that are opened after earlier sessions have been
+		// closed work correctly, and closing them updates the pool.
+		// Pools that recycle session objects reuse the closed ones.
+		Application::Session *first = NULL;
+		for (int i = 0; i < 3; i++) {
+			Application::SessionPtr session(pool->get("stub/railsapp"));
+			if (i == 0) {
+				first = session.get();
+			} else if (recyclesSessions) {
+				ensure("The closed session object has been reused",
+					session.get() == first);
+			}
+			ensure_equals(pool->getActive(), 1u);
+			session->sendHeaders(createRequestHeaders());
+			session->shutdownWriter();
+			
+			string result(readAll(session->getStream()));
+			ensure(result.find("hello world") != string::npos);
+			session.reset();
+			ensure_equals(pool->getActive(), 0u);
+			ensure_equals(pool->getCount(), 1u);
+		}
+	}
+	
+	TEST_METHOD(26) {
+		// If a stat throttle rate is given, then tmp/restart.txt is
+		// checked at most once every that many seconds.
+		PoolOptions options("stub/rack");
+		options.appType = "rack";
+		options.statThrottleRate = 2;
+		pid_t pid = pool->get(options)->getPid();
+		pool->get(options);
+		
+		system("touch stub/rack/tmp/restart.txt");
+		ensure_equals("The application has not been restarted yet",
+			pool->get(options)->getPid(), pid);
+		
+		sleep(3);
+		pid_t new_pid = pool->get(options)->getPid();
+		unlink("stub/rack/tmp/restart.txt");
+		ensure("The application has been restarted", new_pid != pid);
+	}
+	
+	TEST_METHOD(27) {
+		// If a rolling restart concurrency is given, then the old
+		// instance keeps serving requests until its replacement
+		// has been spawned, after which it is retired.
+		PoolOptions options("stub/rack");
+		options.appType = "rack";
+		options.rollingRestartConcurrency = 1;
+		pid_t pid = pool->get(options)->getPid();
+		pool->get(options);
+		
+		system("touch stub/rack/tmp/restart.txt");
+		ensure_equals("The old instance handles the request",
+			pool->get(options)->getPid(), pid);
+		
+		pid_t new_pid = pid;
+		for (int i = 0; i < 100 && (new_pid == pid || pool->getCount() != 1); i++) {
+			usleep(100000);
+			new_pid = pool->get(options)->getPid();
+		}
+		unlink("stub/rack/tmp/restart.txt");
+		ensure("The application has been restarted", new_pid != pid);
+		ensure_equals("The old instance has been retired", pool->getCount(), 1u);
+	}
+	
+	TEST_METHOD(28) {
+		// If get() has to wait for longer than maxQueueTime milliseconds,
+		// then it throws BusyException.
+		pool->setMax(1);
+		PoolOptions options("stub/rack");
+		options.appType = "rack";
+		options.useGlobalQueue = true;
+		options.maxQueueTime = 100;
+		Application::SessionPtr session(pool->get(options));
+		
+		time_t begin = time(NULL);
+		try {
+			pool->get(options);
+			fail("BusyException expected");
+		} catch (const BusyException &) {
+			ensure("get() gave up quickly", time(NULL) - begin <= 1);
+		}
+		
+		// Waiters that have given up don't prevent other threads
+		// from being served.
+		session.reset();
+		options.maxQueueTime = 0;
+		pool->get(options);
+		ensure_equals(pool->getCount(), 1u);
+	}
+	
+	TEST_METHOD(29) {
+		// If the queue already contains maxQueueLength waiters, then
+		// get() throws BusyException immediately.
+		pool->setMax(1);
+		PoolOptions options("stub/rack");
+		options.appType = "rack";
+		options.useGlobalQueue = true;
+		options.maxQueueLength = 1;
+		Application::SessionPtr session(pool->get(options));
+		
+		bool done = false;
+		SpawnRackAppFunction func;
+		func.pool = pool2;
+		func.done = &done;
+		boost::thread thr(func);
+		usleep(100000);
+		
+		try {
+			newPoolConnection()->get(options);
+			fail("BusyException expected");
+		} catch (const BusyException &) {
+			// Success.
+		}
+		ensure("The first waiter is still waiting", !done);
+		
+		session.reset();
+		thr.join();
+		ensure(done);
+	}
+	
+	TEST_METHOD(30) {
+		// If the pool is full, then the idle instances of applications
+		// that occupy more than their share of the pool are shut down
+		// in favor of applications that occupy less than their share.
+		pool->setMax(3);
+		PoolOptions railsOptions("stub/railsapp");
+		PoolOptions rackOptions("stub/rack");
+		rackOptions.appType = "rack";
+		rackOptions.poolWeight = 2;
+		pid_t railsPids[3];
+		{
+			Application::SessionPtr session1(pool->get(railsOptions));
+			Application::SessionPtr session2(pool->get(railsOptions));
+			Application::SessionPtr session3(pool->get(railsOptions));
+			ensure_equals(pool->getCount(), 3u);
+			railsPids[0] = session1->getPid();
+			railsPids[1] = session2->getPid();
+			railsPids[2] = session3->getPid();
+		}
+		// Wait until the sessions have been closed.
+		for (int i = 0; i < 50 && pool->getActive() != 0; i++) {
+			usleep(100000);
+		}
+		
+		Application::SessionPtr session1(pool->get(rackOptions));
+		Application::SessionPtr session2(pool->get(rackOptions));
+		ensure("A second rack instance has been spawned",
+			session1->getPid() != session2->getPid());
+		ensure_equals(pool->getCount(), 3u);
+		ensure_equals(pool->getActive(), 2u);
+		
+		// The idle instance is one of the original Rails instances,
+		// so it's used without spawning a new one.
+		Application::SessionPtr session3(pool->get(railsOptions));
+		pid_t pid = session3->getPid();
+		ensure("One Rails instance is left",
+			pid == railsPids[0] || pid == railsPids[1] || pid == railsPids[2]);
+		ensure_equals(pool->getCount(), 3u);
+	}
+	
+	TEST_METHOD(31) {
+		// If instances can handle multiple sessions concurrently, then
+		// sessions are opened on existing instances until they're full,
+		// before new instances are spawned.
+		PoolOptions options("stub/rack");
+		options.appType = "rack";
+		options.instanceConcurrency = 3;
+		Application::SessionPtr session1(pool->get(options));
+		Application::SessionPtr session2(pool->get(options));
+		Application::SessionPtr session3(pool->get(options));
+		ensure_equals(pool->getCount(), 1u);
+		ensure_equals(session2->getPid(), session1->getPid());
+		ensure_equals(session3->getPid(), session1->getPid());
+		
+		Application::SessionPtr session4(pool->get(options));
+		ensure_equals(pool->getCount(), 2u);
+		ensure("A second instance has been spawned",
+			session4->getPid() != session1->getPid());
+		Application::SessionPtr session5(pool->get(options));
+		ensure_equals("The least busy instance is used",
+			session5->getPid(), session4->getPid());
+		ensure_equals(pool->getCount(), 2u);
+		ensure_equals(pool->getActive(), 2u);
+	}
+	
+	TEST_METHOD(32) {
+		// Threads that are waiting for an instance that's being spawned
+		// keep their turn when the instance is ready, and are served in
+		// FIFO order.
+		pool->setMax(1);
+		
+		boost::mutex lock;
+		vector<int> order;
+		GetRackAppInOrderFunction func1, func2;
+		func1.pool = pool2;
+		func1.appRoot = "stub/slow_rack";
+		func1.delay = 300000;
+		func1.lock = &lock;
+		func1.order = &order;
+		func1.id = 1;
+		func2.pool = newPoolConnection();
+		func2.appRoot = "stub/slow_rack";
+		func2.delay = 400000;
+		func2.lock = &lock;
+		func2.order = &order;
+		func2.id = 2;
+		boost::thread thr1(func1);
+		boost::thread thr2(func2);
+		
+		Application::SessionPtr session(spawnRackApp(pool, "stub/slow_rack"));
+		usleep(200000);
+		ensure(order.empty());
+		
+		session.reset();
+		thr1.join();
+		thr2.join();
+		ensure_equals(pool->getCount(), 1u);
+		ensure_equals(order.size(), 2u);
+		ensure_equals("The oldest waiter was served first", order[0], 1);
+		ensure_equals(order[1], 2);
+	}
 
 #endif /* USE_TEMPLATE */
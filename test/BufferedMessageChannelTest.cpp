@@ -0,0 +1,299 @@
+#include "tut.h"
+#include "BufferedMessageChannel.h"
+
+#include <cstring>
+#include <cstdio>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct BufferedMessageChannelTest {
+		int p[2];
+		
+		BufferedMessageChannelTest() {
+			if (pipe(p) != 0) {
+				throw SystemException("Cannot create a pipe", errno);
+			}
+		}
+		
+		~BufferedMessageChannelTest() {
+			close(p[0]);
+			close(p[1]);
+		}
+	};
+	
+	DEFINE_TEST_GROUP(BufferedMessageChannelTest);
+	
+	TEST_METHOD(1) {
+		// Multiple array messages that are received in a single read
+		// can be read one by one.
+		BufferedMessageChannel reader(p[0]), writer(p[1]);
+		vector<string> args;
+		list<string> input;
+		
+		input.push_back("list");
+		input.push_back("");
+		writer.write("hello", "world", "!", NULL);
+		writer.write(input);
+		writer.write("", NULL);
+		
+		ensure("End of file has not been reached (1)", reader.read(args));
+		ensure_equals(args.size(), 3u);
+		ensure_equals(args[0], "hello");
+		ensure_equals(args[1], "world");
+		ensure_equals(args[2], "!");
+		
+		ensure("End of file has not been reached (2)", reader.read(args));
+		ensure_equals(args.size(), 2u);
+		ensure_equals(args[0], "list");
+		ensure_equals(args[1], "");
+		
+		ensure("End of file has not been reached (3)", reader.read(args));
+		ensure_equals(args.size(), 1u);
+		ensure_equals(args[0], "");
+	}
+	
+	TEST_METHOD(2) {
+		// BufferedMessageChannel and MessageChannel are wire-compatible.
+		BufferedMessageChannel bufferedReader(p[0]), bufferedWriter(p[1]);
+		MessageChannel reader(p[0]), writer(p[1]);
+		vector<string> args;
+		string output;
+		
+		writer.write("from", "MessageChannel", NULL);
+		writer.writeScalar("scalar 1");
+		ensure(bufferedReader.read(args));
+		ensure_equals(args.size(), 2u);
+		ensure_equals(args[1], "MessageChannel");
+		ensure(bufferedReader.readScalar(output));
+		ensure_equals(output, "scalar 1");
+		
+		bufferedWriter.write("from", "BufferedMessageChannel", NULL);
+		bufferedWriter.writeScalar("scalar 2");
+		bufferedWriter.writeScalar("");
+		ensure(reader.read(args));
+		ensure_equals(args.size(), 2u);
+		ensure_equals(args[1], "BufferedMessageChannel");
+		ensure(reader.readScalar(output));
+		ensure_equals(output, "scalar 2");
+		ensure(reader.readScalar(output));
+		ensure_equals(output, "");
+	}
+	
+	TEST_METHOD(3) {
+		// Messages that are larger than the read buffer, and messages
+		// that cross read boundaries, are read correctly.
+		string large(1024 * 60, 'x');
+		string scalar(1024 * 200, 'y');
+		pid_t pid = fork();
+		if (pid == 0) {
+			BufferedMessageChannel writer(p[1]);
+			close(p[0]);
+			for (int i = 0; i < 3; i++) {
+				writer.write("large", large.c_str(), NULL);
+				writer.writeScalar(scalar);
+				writer.write("small", NULL);
+			}
+			_exit(0);
+		} else {
+			BufferedMessageChannel reader(p[0]);
+			vector<string> args;
+			string output;
+			close(p[1]);
+			p[1] = -1;
+			for (int i = 0; i < 3; i++) {
+				ensure(reader.read(args));
+				ensure_equals(args.size(), 2u);
+				ensure_equals(args[1], large);
+				ensure(reader.readScalar(output));
+				ensure_equals(output, scalar);
+				ensure(reader.read(args));
+				ensure_equals(args.size(), 1u);
+				ensure_equals(args[0], "small");
+			}
+			ensure("End of file has been reached", !reader.read(args));
+			waitpid(pid, NULL, 0);
+		}
+	}
+	
+	TEST_METHOD(4) {
+		// A file descriptor that is passed right after a message is
+		// received, even if it was read along with the message.
+		int s[2], my_pipe[2], fd;
+		socketpair(AF_UNIX, SOCK_STREAM, 0, s);
+		pipe(my_pipe);
+		{
+			MessageChannel writer(s[0]);
+			BufferedMessageChannel reader(s[1]);
+			vector<string> args;
+			
+			writer.write("ok", NULL);
+			writer.writeFileDescriptor(my_pipe[1]);
+			writer.write("after", NULL);
+			
+			ensure(reader.read(args));
+			ensure_equals(args[0], "ok");
+			fd = reader.readFileDescriptor();
+			ensure(reader.read(args));
+			ensure_equals(args[0], "after");
+		}
+		
+		char buf[5];
+		write(fd, "hello", 5);
+		close(fd);
+		read(my_pipe[0], buf, 5);
+		ensure(memcmp(buf, "hello", 5) == 0);
+		
+		close(s[0]);
+		close(s[1]);
+		close(my_pipe[0]);
+		close(my_pipe[1]);
+	}
+	
+	TEST_METHOD(5) {
+		// BufferedMessageChannel is compatible with the Ruby implementation.
+		int fd[2];
+		pid_t pid;
+		
+		socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+		pid = fork();
+		if (pid == 0) {
+			close(p[0]);
+			close(p[1]);
+			dup2(fd[0], 3);
+			close(fd[0]);
+			close(fd[1]);
+			execlp("ruby", "ruby", "./stub/message_channel_3.rb", (void *) 0);
+			perror("Cannot execute ruby");
+			_exit(1);
+		} else {
+			BufferedMessageChannel channel(fd[1]);
+			close(fd[0]);
+			
+			vector<string> args;
+			string output;
+			int tmp[2];
+			
+			channel.write("hello ", "my!", "world", NULL);
+			ensure("End of file has not yet been reached", channel.read(args));
+			ensure_equals(args.size(), 3u);
+			ensure_equals(args[0], "hello ");
+			ensure_equals(args[1], "my!");
+			ensure_equals(args[2], "world");
+			
+			channel.writeScalar("testing 123");
+			ensure("End of file has not yet been reached", channel.readScalar(output));
+			ensure_equals(output, "testing 123");
+			
+			pipe(tmp);
+			close(tmp[0]);
+			channel.writeFileDescriptor(tmp[1]);
+			close(tmp[1]);
+			int x = channel.readFileDescriptor();
+			close(x);
+			
+			channel.write("the end", NULL);
+			ensure("End of file has not yet been reached", channel.read(args));
+			ensure_equals(args.size(), 1u);
+			ensure_equals(args[0], "the end");
+			
+			ensure("End of file has been reached", !channel.read(args));
+			close(fd[1]);
+			waitpid(pid, NULL, 0);
+		}
+	}
+	
+	TEST_METHOD(6) {
+		// read() can return views into the read buffer.
+		BufferedMessageChannel reader(p[0]), writer(p[1]);
+		vector<StaticString> args;
+		
+		writer.write("get", "1", "app_root", "/foo", NULL);
+		writer.write("close", "2", NULL);
+		ensure("End of file has not been reached (1)", reader.read(args));
+		ensure_equals(args.size(), 4u);
+		ensure(args[0] == "get");
+		ensure_equals(atoi(args[1]), 1);
+		ensure_equals(args[3].toString(), "/foo");
+		
+		ensure("End of file has not been reached (2)", reader.read(args));
+		ensure_equals(args.size(), 2u);
+		ensure(args[0] == "close");
+		ensure_equals(atoi(args[1]), 2);
+	}
+	
+	TEST_METHOD(7) {
+		// BufferedMessageChannel can negotiate frame version 2, after which
+		// large array messages can be exchanged.
+		int s[2];
+		socketpair(AF_UNIX, SOCK_STREAM, 0, s);
+		pid_t pid = fork();
+		if (pid == 0) {
+			MessageChannel channel(s[1]);
+			vector<string> args;
+			
+			close(s[0]);
+			channel.read(args);
+			channel.acceptFrameVersion(atoi(args[1]));
+			channel.read(args);
+			channel.write(args);
+			_exit(0);
+		} else {
+			BufferedMessageChannel channel(s[0]);
+			string large(1024 * 100, 'x');
+			vector<string> args;
+			
+			close(s[1]);
+			ensure_equals(channel.negotiateFrameVersion(), 2u);
+			channel.write("large", large.c_str(), NULL);
+			ensure(channel.read(args));
+			ensure_equals(args.size(), 2u);
+			ensure_equals(args[1], large);
+			ensure("End of file has been reached", !channel.read(args));
+			close(s[0]);
+			waitpid(pid, NULL, 0);
+		}
+	}
+	
+	TEST_METHOD(8) {
+		// read() throws IOException if the size header announces a frame
+		// that's larger than MessageChannel::MAX_FRAME_SIZE, even if adding
+		// the header size to it would wrap around.
+		BufferedMessageChannel reader(p[0]), writer(p[1]);
+		vector<string> args;
+		uint32_t header = htonl(0xFFFFFFFE);
+		
+		reader.setFrameVersion(MessageChannel::FRAME_VERSION_2);
+		writer.writeRaw((const char *) &header, sizeof(header));
+		writer.writeRaw("abcd", 4);
+		try {
+			reader.read(args);
+			fail("IOException expected");
+		} catch (const IOException &) {
+			// Success.
+		}
+	}
+	
+	TEST_METHOD(9) {
+		// readScalar() throws IOException if the size header announces a
+		// message that's larger than MessageChannel::MAX_FRAME_SIZE.
+		BufferedMessageChannel reader(p[0]), writer(p[1]);
+		string output;
+		uint32_t header = htonl(MessageChannel::MAX_FRAME_SIZE + 1);
+		
+		writer.writeRaw((const char *) &header, sizeof(header));
+		writer.writeRaw("abcd", 4);
+		try {
+			reader.readScalar(output);
+			fail("IOException expected");
+		} catch (const IOException &) {
+			// Success.
+		}
+	}
+}
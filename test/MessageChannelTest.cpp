@@ -6,6 +6,8 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
 
 using namespace Passenger;
@@ -309,4 +311,180 @@ namespace tut {
 			waitpid(pid, NULL, 0);
 		}
 	}
+	
+	TEST_METHOD(13) {
+		// read() can return views into the channel's buffer, which stay
+		// valid until the next read().
+		vector<StaticString> args;
+		
+		writer.write("hello", "", "world", NULL);
+		writer.write("second", NULL);
+		ensure("End of file has not been reached", reader.read(args));
+		ensure_equals(args.size(), 3u);
+		ensure(args[0] == "hello");
+		ensure(args[1].empty());
+		ensure_equals(args[2].toString(), "world");
+		
+		ensure("End of file has not been reached", reader.read(args));
+		ensure_equals(args.size(), 1u);
+		ensure(args[0] == "second");
+		ensure(args[0] != "sec");
+	}
+	
+	TEST_METHOD(14) {
+		// Array messages that are larger than 64 KB can't be sent in frame
+		// version 1, but they can be sent in frame version 2.
+		string large(1024 * 100, 'x');
+		
+		try {
+			writer.write("large", large.c_str(), NULL);
+			fail("IOException expected");
+		} catch (const IOException &) {
+			// Success.
+		}
+		
+		pid_t pid = fork();
+		if (pid == 0) {
+			reader.close();
+			writer.setFrameVersion(MessageChannel::FRAME_VERSION_2);
+			writer.write("large", large.c_str(), NULL);
+			writer.write("small", NULL);
+			_exit(0);
+		} else {
+			vector<string> args;
+			
+			writer.close();
+			reader.setFrameVersion(MessageChannel::FRAME_VERSION_2);
+			ensure(reader.read(args));
+			ensure_equals(args.size(), 2u);
+			ensure_equals(args[1], large);
+			ensure(reader.read(args));
+			ensure_equals(args.size(), 1u);
+			ensure_equals(args[0], "small");
+			waitpid(pid, NULL, 0);
+		}
+	}
+	
+	TEST_METHOD(15) {
+		// negotiateFrameVersion() can negotiate frame version 2 with the Ruby
+		// implementation, after which large array messages can be exchanged.
+		int fd[2];
+		pid_t pid;
+		
+		socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+		pid = fork();
+		if (pid == 0) {
+			close(p[0]);
+			close(p[1]);
+			dup2(fd[0], 3);
+			close(fd[0]);
+			close(fd[1]);
+			execlp("ruby", "ruby", "./stub/message_channel_4.rb", (void *) 0);
+			perror("Cannot execute ruby");
+			_exit(1);
+		} else {
+			MessageChannel channel(fd[1]);
+			string large(1024 * 100, 'x');
+			vector<string> args;
+			
+			close(fd[0]);
+			ensure_equals(channel.negotiateFrameVersion(), 2u);
+			ensure_equals(channel.getFrameVersion(), 2u);
+			channel.write("large", large.c_str(), NULL);
+			ensure("End of file has not yet been reached", channel.read(args));
+			ensure_equals(args.size(), 2u);
+			ensure_equals(args[0], "large");
+			ensure_equals(args[1], large);
+			ensure("End of file has been reached", !channel.read(args));
+			channel.close();
+			waitpid(pid, NULL, 0);
+		}
+	}
+	
+	TEST_METHOD(16) {
+		// readRaw() with a timeout deducts the time it spends waiting from
+		// the timeout, and throws TimeoutException if the timeout expires.
+		unsigned long long timeout = 1000000;
+		char buf[3];
+		
+		writer.writeRaw("abc", 3);
+		ensure(reader.readRaw(buf, 3, &timeout));
+		ensure(memcmp(buf, "abc", 3) == 0);
+		ensure("Timeout hasn't expired", timeout > 0);
+		
+		timeout = 20000;
+		writer.writeRaw("x", 1);
+		try {
+			reader.readRaw(buf, 2, &timeout);
+			fail("TimeoutException expected");
+		} catch (const TimeoutException &) {
+			ensure_equals(timeout, 0ull);
+		}
+	}
+	
+	TEST_METHOD(17) {
+		// writeRaw() with a timeout throws TimeoutException if the other
+		// side doesn't read, and leaves the file descriptor in blocking mode.
+		unsigned long long timeout = 20000;
+		string data(1024 * 1024, 'x');
+		
+		try {
+			writer.writeRaw(data, &timeout);
+			fail("TimeoutException expected");
+		} catch (const TimeoutException &) {
+			ensure_equals(timeout, 0ull);
+		}
+		ensure("File descriptor is in blocking mode",
+			!(fcntl(p[1], F_GETFL) & O_NONBLOCK));
+	}
+	
+	TEST_METHOD(18) {
+		// The timeout of readScalar() applies to the entire operation, so
+		// a writer that trickles data can't keep it busy any longer than that.
+		pid_t pid = fork();
+		if (pid == 0) {
+			uint32_t size = htonl(100);
+			
+			close(p[0]);
+			writer.writeRaw((const char *) &size, sizeof(size));
+			for (int i = 0; i < 100; i++) {
+				usleep(10000);
+				writer.writeRaw("x", 1);
+			}
+			_exit(0);
+		} else {
+			unsigned long long timeout = 100000;
+			unsigned long long begin = getMonotonicUsec();
+			string output;
+			
+			close(p[1]);
+			p[1] = -1;
+			try {
+				reader.readScalar(output, &timeout);
+				fail("TimeoutException expected");
+			} catch (const TimeoutException &) {
+				unsigned long long elapsed = getMonotonicUsec() - begin;
+				ensure("Elapsed time is about the timeout", elapsed >= 100000 && elapsed < 500000);
+			}
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+		}
+	}
+	
+	TEST_METHOD(19) {
+		// read() throws IOException instead of allocating a buffer if the
+		// size header announces a frame that's larger than MAX_FRAME_SIZE.
+		vector<string> args;
+		uint32_t header = htonl(0xFFFFFFFE);
+		
+		reader.setFrameVersion(MessageChannel::FRAME_VERSION_2);
+		writer.writeRaw((const char *) &header, sizeof(header));
+		writer.writeRaw("abcd", 4);
+		try {
+			reader.read(args);
+			fail("IOException expected");
+		} catch (const IOException &) {
+			// Success.
+		}
+	}
 }
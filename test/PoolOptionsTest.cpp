@@ -17,6 +17,14 @@ namespace tut {
 		options.frameworkSpawnerTimeout = 123;
 		options.appSpawnerTimeout       = 456;
 		options.maxRequests = 789;
+		options.minInstances = 3;
+		options.statThrottleRate = 10;
+		options.rollingRestartConcurrency = 2;
+		options.maxQueueLength = 5;
+		options.maxQueueTime = 1000;
+		options.poolWeight = 4;
+		options.instanceConcurrency = 8;
+		options.predictiveSpawning = true;
 		
 		vector<string> args;
 		args.push_back("abc");
@@ -33,5 +41,75 @@ namespace tut {
 		ensure_equals(options.frameworkSpawnerTimeout, copy.frameworkSpawnerTimeout);
 		ensure_equals(options.appSpawnerTimeout, copy.appSpawnerTimeout);
 		ensure_equals(options.maxRequests, copy.maxRequests);
+		ensure_equals(options.minInstances, copy.minInstances);
+		ensure_equals(options.statThrottleRate, copy.statThrottleRate);
+		ensure_equals(options.rollingRestartConcurrency, copy.rollingRestartConcurrency);
+		ensure_equals(options.maxQueueLength, copy.maxQueueLength);
+		ensure_equals(options.maxQueueTime, copy.maxQueueTime);
+		ensure_equals(options.poolWeight, copy.poolWeight);
+		ensure_equals(options.instanceConcurrency, copy.instanceConcurrency);
+		ensure_equals(options.predictiveSpawning, copy.predictiveSpawning);
+	}
+	
+	TEST_METHOD(2) {
+		// PoolOptions can be constructed from string views.
+		PoolOptions options;
+		options.appRoot     = "/foo";
+		options.environment = "staging";
+		options.maxRequests = 789;
+		options.memoryLimit = 120;
+		options.useGlobalQueue = true;
+		options.maxQueueTime = 1000;
+		
+		vector<string> args;
+		args.push_back("get");
+		options.toVector(args);
+		
+		// Serialize the message so that the views don't point into
+		// the original strings.
+		string buffer;
+		vector<string>::const_iterator it;
+		for (it = args.begin(); it != args.end(); it++) {
+			buffer.append(*it);
+			buffer.append(1, '\0');
+		}
+		vector<StaticString> views;
+		string::size_type start = 0, pos;
+		while ((pos = buffer.find('\0', start)) != string::npos) {
+			views.push_back(StaticString(buffer.data() + start, pos - start));
+			start = pos + 1;
+		}
+		
+		PoolOptions copy(views, 1);
+		buffer.assign(buffer.size(), 'x');
+		ensure_equals(copy.appRoot, "/foo");
+		ensure_equals(copy.environment, "staging");
+		ensure_equals(copy.maxRequests, 789ul);
+		ensure_equals(copy.memoryLimit, 120ul);
+		ensure_equals(copy.useGlobalQueue, true);
+		ensure_equals(copy.maxQueueTime, 1000ul);
+		ensure_equals(copy.lowerPrivilege, options.lowerPrivilege);
+		ensure_equals(copy.frameworkSpawnerTimeout, options.frameworkSpawnerTimeout);
+	}
+	
+	TEST_METHOD(3) {
+		// PoolOptions objects are equivalent under operator< if and only
+		// if toVector() writes the same information for them.
+		PoolOptions a("/foo"), b("/foo");
+		ensure(!(a < b));
+		ensure(!(b < a));
+		
+		b.predictiveSpawning = true;
+		ensure(a < b);
+		ensure(!(b < a));
+		
+		b = a;
+		b.maxQueueTime = 1000;
+		ensure(a < b || b < a);
+		
+		b = a;
+		b.appRoot = "/bar";
+		ensure(b < a);
+		ensure(!(a < b));
 	}
 }
@@ -61,4 +61,49 @@ namespace tut {
 			}
 		}
 	}
+	
+	struct SpawnFunction {
+		SpawnManager *manager;
+		const char *appRoot;
+		
+		void operator()() {
+			manager->spawn(PoolOptions(appRoot));
+		}
+	};
+	
+	TEST_METHOD(4) {
+		// If maxConcurrentSpawns > 1, then different applications
+		// should be spawned concurrently.
+		SpawnManager manager2("stub/slow_spawn_server.rb", "", "ruby", "", 2);
+		SpawnFunction func1, func2;
+		func1.manager = &manager2;
+		func1.appRoot = "stub/railsapp";
+		func2.manager = &manager2;
+		func2.appRoot = "stub/railsapp2";
+		
+		time_t begin = time(NULL);
+		boost::thread thr1(func1);
+		boost::thread thr2(func2);
+		thr1.join();
+		thr2.join();
+		ensure("Both applications were spawned concurrently",
+			time(NULL) - begin < 4);
+	}
+	
+	TEST_METHOD(5) {
+		// If maxConcurrentSpawns > 1, then multiple instances of the
+		// same application should be spawned concurrently as well.
+		SpawnManager manager2("stub/slow_spawn_server.rb", "", "ruby", "", 2);
+		SpawnFunction func;
+		func.manager = &manager2;
+		func.appRoot = "stub/railsapp";
+		
+		time_t begin = time(NULL);
+		boost::thread thr1(func);
+		boost::thread thr2(func);
+		thr1.join();
+		thr2.join();
+		ensure("Both instances were spawned concurrently",
+			time(NULL) - begin < 4);
+	}
 }
@@ -7,10 +7,16 @@ using namespace Passenger;
 namespace tut {
 	struct StandardApplicationPoolTest {
 		ApplicationPoolPtr pool, pool2;
+		/** The same object as _pool_, for tests that use its own methods. */
+		StandardApplicationPoolPtr spool;
+		/** Whether the pool reuses closed session objects. */
+		bool recyclesSessions;
 		
 		StandardApplicationPoolTest() {
-			pool = ptr(new StandardApplicationPool("../bin/passenger-spawn-server"));
+			spool = ptr(new StandardApplicationPool("../bin/passenger-spawn-server"));
+			pool = spool;
 			pool2 = pool;
+			recyclesSessions = true;
 		}
 		
 		ApplicationPoolPtr newPoolConnection() {
@@ -22,4 +28,195 @@ namespace tut {
 
 	#define USE_TEMPLATE
 	#include "ApplicationPoolTest.cpp"
+	
+	#ifdef __linux__
+	TEST_METHOD(40) {
+		// If restart files are watched, then changes to tmp/restart.txt
+		// are noticed immediately, regardless of the stat throttle rate.
+		pool = ptr(new StandardApplicationPool("../bin/passenger-spawn-server",
+			"", "ruby", "", 1, true));
+		PoolOptions options("stub/rack");
+		options.appType = "rack";
+		options.statThrottleRate = 100;
+		pid_t pid = pool->get(options)->getPid();
+		pool->get(options);
+		ensure_equals(pool->get(options)->getPid(), pid);
+		
+		system("touch stub/rack/tmp/restart.txt");
+		// Give the watcher thread some time to process the event.
+		usleep(200000);
+		pid_t new_pid = pool->get(options)->getPid();
+		unlink("stub/rack/tmp/restart.txt");
+		ensure("The application has been restarted", new_pid != pid);
+	}
+	#endif
+	
+	#ifdef __linux__
+	TEST_METHOD(41) {
+		// Instances that use more memory than the memory limit
+		// are shut down once they're idle. Their memory usage is
+		// shown in toXml().
+		spool->setMemorySamplingInterval(1);
+		PoolOptions options("stub/rack");
+		options.appType = "rack";
+		options.memoryLimit = 1;
+		{
+			Application::SessionPtr session(pool->get(options));
+			ensure_equals(pool->getCount(), 1u);
+		}
+		
+		for (int i = 0; i < 50 && pool->getCount() != 0; i++) {
+			usleep(100000);
+		}
+		ensure_equals("The instance has been shut down", pool->getCount(), 0u);
+		
+		options.memoryLimit = 0;
+		pool->get(options);
+		for (int i = 0; i < 50 && spool->toXml().find("<memory>0</memory>") != string::npos; i++) {
+			usleep(100000);
+		}
+		ensure("The memory usage is known",
+			spool->toXml().find("<memory>0</memory>") == string::npos);
+		ensure_equals("The instance is kept", pool->getCount(), 1u);
+	}
+	#endif
+	
+	TEST_METHOD(42) {
+		// When the pool is full, an idle instance of an application that
+		// is cheap to spawn is shut down, instead of the least recently
+		// used instance of an application that is slow to spawn.
+		pool->setMax(2);
+		PoolOptions slowOptions("stub/slow_rack");
+		slowOptions.appType = "rack";
+		PoolOptions fastOptions("stub/rack");
+		fastOptions.appType = "rack";
+		pid_t slowPid = pool->get(slowOptions)->getPid();
+		pool->get(fastOptions);
+		for (int i = 0; i < 50 && pool->getActive() != 0; i++) {
+			usleep(100000);
+		}
+		
+		pool->get("stub/railsapp");
+		ensure_equals(pool->getCount(), 2u);
+		ensure_equals("The slow application's instance has been kept",
+			pool->get(slowOptions)->getPid(), slowPid);
+		ensure_equals(pool->getCount(), 2u);
+	}
+	
+	TEST_METHOD(43) {
+		// If predictive spawning is enabled, then instances are spawned
+		// in the background when the request rate and the requests'
+		// duration indicate that more instances will be needed.
+		spool->setPredictionInterval(1);
+		pool->setMaxPerApp(1);
+		PoolOptions options("stub/rack");
+		options.appType = "rack";
+		options.predictiveSpawning = true;
+		{
+			// 30 requests that take 1.5 seconds each.
+			vector<Application::SessionPtr> sessions;
+			for (int i = 0; i < 30; i++) {
+				sessions.push_back(pool->get(options));
+			}
+			ensure_equals(pool->getCount(), 1u);
+			usleep(1500000);
+		}
+		
+		pool->setMaxPerApp(0);
+		for (int i = 0; i < 100 && pool->getCount() < 2; i++) {
+			usleep(100000);
+		}
+		ensure_equals("An instance has been spawned ahead of demand",
+			pool->getCount(), 2u);
+		ensure_equals(pool->getActive(), 0u);
+		ensure(spool->toXml().find("<predicted_size>2</predicted_size>") != string::npos);
+	}
+	
+	TEST_METHOD(44) {
+		// publishStatistics() publishes the pool's counters and the state
+		// of its domains and instances in a statistics file, which can be
+		// read through another mapping of the file.
+		string filename("/tmp/passenger_test_statistics." + toString(getpid()));
+		PoolStatistics writer(filename, true);
+		PoolStatistics reader(filename, false);
+		shared_ptr<PoolStatistics::Data> data(new PoolStatistics::Data());
+		unlink(filename.c_str());
+		
+		Application::SessionPtr session(spawnRackApp(pool, "stub/rack"));
+		spool->publishStatistics(writer);
+		ensure(reader.read(*data));
+		ensure_equals(data->counters.count, 1u);
+		ensure_equals(data->counters.active, 1u);
+		ensure_equals((pid_t) data->counters.spawnServerPid, pool->getSpawnServerPid());
+		ensure_equals(data->counters.domainCount, 1u);
+		ensure(string(data->domains[0].appRoot).find("stub/rack") != string::npos);
+		ensure_equals(data->domains[0].size, 1u);
+		ensure_equals(data->counters.instanceCount, 1u);
+		ensure_equals((pid_t) data->instances[0].pid, session->getPid());
+		ensure_equals(data->instances[0].sessions, 1u);
+		
+		// publishCounters() only publishes the counters.
+		session.reset();
+		spool->publishCounters(writer);
+		PoolStatistics::Counters counters;
+		ensure(reader.readCounters(counters));
+		ensure_equals(counters.active, 0u);
+		ensure_equals(counters.count, 1u);
+		ensure(reader.read(*data));
+		ensure_equals("The instances are left as they were",
+			data->instances[0].sessions, 1u);
+	}
+	
+	TEST_METHOD(45) {
+		// closeSessions() closes all sessions that it holds the only
+		// reference to. Other sessions are closed when their last
+		// reference is dropped.
+		vector<Application::SessionPtr> sessions;
+		
+		sessions.push_back(spawnRackApp(pool, "stub/rack"));
+		sessions.push_back(spawnRackApp(pool, "stub/rack"));
+		ensure_equals(pool->getActive(), 2u);
+		
+		Application::SessionPtr copy(sessions[1]);
+		spool->closeSessions(sessions);
+		ensure(sessions.empty());
+		ensure_equals(pool->getActive(), 1u);
+		copy.reset();
+		ensure_equals(pool->getActive(), 0u);
+		ensure_equals(pool->getCount(), 2u);
+	}
+	
+	TEST_METHOD(46) {
+		// If the rolling restart concurrency is 2, then two replacement
+		// instances are spawned at the same time.
+		pool = ptr(new StandardApplicationPool("../bin/passenger-spawn-server",
+			"", "ruby", "", 2));
+		PoolOptions options("stub/slow_rack");
+		options.appType = "rack";
+		options.rollingRestartConcurrency = 2;
+		{
+			Application::SessionPtr session1(pool->get(options));
+			Application::SessionPtr session2(pool->get(options));
+		}
+		ensure_equals(pool->getCount(), 2u);
+		
+		system("touch stub/slow_rack/tmp/restart.txt");
+		pool->get(options);
+		unlink("stub/slow_rack/tmp/restart.txt");
+		
+		// Each placeholder for a replacement instance counts towards
+		// the pool's size.
+		unsigned int maxCount = 0;
+		for (int i = 0; i < 40 && maxCount < 4; i++) {
+			maxCount = std::max(maxCount, pool->getCount());
+			usleep(50000);
+		}
+		ensure_equals("Both replacements are being spawned", maxCount, 4u);
+		
+		for (int i = 0; i < 100 && pool->getCount() != 2; i++) {
+			usleep(100000);
+		}
+		ensure_equals("The old instances have been retired", pool->getCount(), 2u);
+	}
 }
+
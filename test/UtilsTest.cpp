@@ -235,4 +235,28 @@ namespace tut {
 		ensure_equals(escapeForXml("hello\xFF\xCCworld"), "hello&#255;&#204;world");
 		ensure_equals(escapeForXml("hello\xFFworld\xCC"), "hello&#255;world&#204;");
 	}
+	
+	/***** Test getPrivateDirtyRSS() *****/
+	
+	#ifdef __linux__
+	TEST_METHOD(26) {
+		// It returns the memory usage of an existing process.
+		ensure(getPrivateDirtyRSS(getpid()) > 0);
+	}
+	#endif
+	
+	TEST_METHOD(27) {
+		// It returns 0 for a nonexistant process.
+		ensure_equals(getPrivateDirtyRSS((pid_t) -1), 0ul);
+	}
+	
+	/***** Test getMonotonicUsec() *****/
+	
+	TEST_METHOD(28) {
+		// It advances by at least the amount of time that we slept.
+		unsigned long long begin = getMonotonicUsec();
+		usleep(20000);
+		unsigned long long end = getMonotonicUsec();
+		ensure(end >= begin + 20000);
+	}
 }
@@ -66,6 +66,10 @@ describe MessageChannel do
 			@writer.write_scalar(" " * 100)
 			lambda { @reader.read_scalar(99) }.should raise_error(SecurityError)
 		end
+		
+		it "refuses to write array messages larger than 64 KB in frame version 1" do
+			lambda { @writer.write("x" * 70000) }.should raise_error(ArgumentError)
+		end
 	end
 	
 	describe "scenarios with 2 channels and 2 concurrent processes" do
@@ -124,6 +128,30 @@ describe MessageChannel do
 			end
 		end
 		
+		it "can negotiate frame version 2 and then exchange array messages larger than 64 KB" do
+			blob = "x" * 200000
+			spawn_process do
+				name, proposed = @channel.read
+				@channel.accept_frame_version(proposed)
+				@channel.write(*@channel.read)
+			end
+			@channel.negotiate_frame_version.should == MessageChannel::FRAME_VERSION_2
+			@channel.write("hello", blob)
+			@channel.read.should == ["hello", blob]
+		end
+		
+		it "negotiates frame version 1 if the other side doesn't support anything newer" do
+			spawn_process do
+				name, proposed = @channel.read
+				@channel.accept_frame_version(proposed)
+				@channel.write(*@channel.read)
+			end
+			@channel.negotiate_frame_version(MessageChannel::FRAME_VERSION_1).should ==
+				MessageChannel::FRAME_VERSION_1
+			@channel.write("hello")
+			@channel.read.should == ["hello"]
+		end
+		
 		it "has stream properties" do
 			garbage = File.read("stub/garbage1.dat")
 			spawn_process do
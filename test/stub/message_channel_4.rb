@@ -0,0 +1,12 @@
+#!/usr/bin/env ruby
+$LOAD_PATH << "#{File.dirname(__FILE__)}/../../lib"
+$LOAD_PATH << "#{File.dirname(__FILE__)}/../../ext"
+require 'passenger/message_channel'
+require 'passenger/utils'
+
+include Passenger
+channel = MessageChannel.new(IO.new(3))
+name, proposed = channel.read
+channel.accept_frame_version(proposed)
+channel.write(*channel.read)
+channel.close
@@ -0,0 +1,22 @@
+#!/usr/bin/env ruby
+# A spawn server stub which takes 2 seconds to spawn an application.
+$LOAD_PATH << "#{File.dirname(__FILE__)}/../../lib"
+$LOAD_PATH << "#{File.dirname(__FILE__)}/../../ext"
+require 'passenger/spawn_manager'
+
+include Passenger
+class SpawnManager
+	def handle_spawn_application(*options)
+		sleep 2
+		client.write('ok')
+		client.write(1234, "/tmp/nonexistant.socket", false)
+		client.send_io(STDERR)
+	end
+end
+
+DEFAULT_INPUT_FD = 3
+
+manager = SpawnManager.new
+input = IO.new(DEFAULT_INPUT_FD)
+manager.start_synchronously(input)
+manager.cleanup